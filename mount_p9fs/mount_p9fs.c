@@ -41,6 +41,7 @@ __FBSDID("$FreeBSD$");
 #include <sys/stat.h>
 #include <sys/syslog.h>
 #include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/errno.h>
 
 #include <arpa/inet.h>
@@ -82,7 +83,7 @@ usage(int exitcode, const char *errfmt, ...)
 
 struct mnt_context {
 	struct iovec *iov;
-	struct sockaddr saddr;
+	struct sockaddr_storage saddr;
 	int iovlen;
 	int socktype;
 	char errmsg[256];
@@ -106,6 +107,8 @@ parse_opt_o(struct mnt_context *ctx)
 	if (strcmp(opt, "proto") == 0) {
 		if (strcasecmp(val, "tcp") == 0)
 			ctx->socktype = SOCK_STREAM;
+		else if (strcasecmp(val, "loop") == 0)
+			usage(1, "Use a loop:path pathspec for proto=loop");
 		else
 			ctx->socktype = SOCK_DGRAM;
 	}
@@ -174,6 +177,59 @@ try_addrinfo(struct mnt_context *ctx, struct addrinfo *ai)
 	return (0);
 }
 
+/*
+ * Handle a unix:/path/to/socket:path pathspec, for a server on this host.
+ * The socket path runs up to the last ':'.
+ */
+static void
+parse_unix_pathspec(struct mnt_context *ctx, char *spec)
+{
+	struct sockaddr_un *sun = (struct sockaddr_un *)&ctx->saddr;
+	const char *sockpath = spec + sizeof ("unix:") - 1;
+	int s;
+
+	ctx->path = strrchr(sockpath, ':');
+	if (ctx->path == NULL)
+		usage(1, "Pathspec does not follow unix:socket:path format");
+	*ctx->path++ = '\0';
+	if (sockpath[0] != '/')
+		usage(1, "Socket path %s is not absolute", sockpath);
+	if (ctx->socktype != 0)
+		usage(1, "proto may not be used with unix:");
+
+	sun->sun_family = AF_LOCAL;
+	if (strlcpy(sun->sun_path, sockpath, sizeof (sun->sun_path)) >=
+	    sizeof (sun->sun_path))
+		errx(1, "Socket path %s is too long", sockpath);
+	sun->sun_len = SUN_LEN(sun);
+
+	/* Check that the server is there, for a useful error message. */
+	s = socket(AF_LOCAL, SOCK_STREAM, 0);
+	if (s == -1)
+		err(1, "socket");
+	if (connect(s, (struct sockaddr *)sun, sun->sun_len) == -1)
+		err(1, "Unable to connect to %s", sockpath);
+	close(s);
+
+	build_iovec(&ctx->iov, &ctx->iovlen, "addr", &ctx->saddr,
+	    sun->sun_len);
+}
+
+/*
+ * Handle a loop:path pathspec, for the in-kernel loopback server.  There
+ * is no address, as nothing leaves the kernel.
+ */
+static void
+parse_loop_pathspec(struct mnt_context *ctx, char *spec)
+{
+
+	if (ctx->socktype != 0)
+		usage(1, "proto may not be used with loop:");
+	ctx->path = spec + sizeof ("loop:") - 1;
+	ctx->path[-1] = '\0';
+	build_iovec(&ctx->iov, &ctx->iovlen, "proto", "loop", (size_t)-1);
+}
+
 static void
 parse_required_args(struct mnt_context *ctx, char **argv)
 {
@@ -183,6 +239,15 @@ parse_required_args(struct mnt_context *ctx, char **argv)
 	struct addrinfo hints = { 0 };
 	struct sockaddr *addr;
 
+	if (strncmp(argv[0], "unix:", sizeof ("unix:") - 1) == 0) {
+		parse_unix_pathspec(ctx, argv[0]);
+		goto done;
+	}
+	if (strncmp(argv[0], "loop:", sizeof ("loop:") - 1) == 0) {
+		parse_loop_pathspec(ctx, argv[0]);
+		goto done;
+	}
+
 	/* Parse pathspec */
 	ctx->path = strchr(argv[0], ':');
 	if (ctx->path == NULL)
@@ -208,9 +273,10 @@ parse_required_args(struct mnt_context *ctx, char **argv)
 	freeaddrinfo(res);
 	if (error > 0)
 		err(error, "Unable to connect to %s", argv[0]);
-	if (ctx->saddr.sa_family == 0)
+	if (ctx->saddr.ss_family == 0)
 		errx(1, "No working address found for %s", argv[0]);
 
+done:
 	build_iovec(&ctx->iov, &ctx->iovlen, "fstype", "p9fs", (size_t)-1);
 	build_iovec(&ctx->iov, &ctx->iovlen, "hostname", argv[0], (size_t)-1);
 	build_iovec(&ctx->iov, &ctx->iovlen, "fspath", argv[1], (size_t)-1);
@@ -50,6 +50,10 @@ __FBSDID("$FreeBSD$");
 #include <sys/mount.h>
 #include <sys/uio.h>
 #include <sys/vnode.h>
+#include <sys/counter.h>
+#include <sys/sysctl.h>
+#include <sys/callout.h>
+#include <sys/taskqueue.h>
 
 #include "p9fs_proto.h"
 #include "p9fs_subr.h"
@@ -72,47 +76,51 @@ __FBSDID("$FreeBSD$");
  *
  * This implementation only handles 9P2000.u, so if any other version is
  * returned, the call will simply bail.
+ *
+ * Each connection is a separate 9P session, so this is done per connection.
+ * The session's msize starts out as the size to request, and is lowered to
+ * the smallest size any connection's server granted.
  */
 int
-p9fs_client_version(struct p9fs_session *p9s)
+p9fs_client_version(struct p9fs_session *p9s, struct p9fs_conn *conn)
 {
+	struct p9fs_msg_Tversion tv;
+	struct p9fs_msg_Rversion rv;
+	char buf[64];
+	size_t len;
 	void *m;
-	int error = 0;
-	uint32_t max_size = P9_MSG_MAX;
+	int error;
 
-retry:
-	m = p9fs_msg_create(Tversion, NOTAG);
+	tv.Tversion_max_size = p9s->p9s_msize;
+	tv.Tversion_version.p9str_str = __DECONST(char *, UN_VERS);
+	tv.Tversion_version.p9str_size = strlen(UN_VERS);
+	m = p9fs_msg_build(Tversion, NOTAG, &tv);
 	if (m == NULL)
 		return (ENOBUFS);
 
-	if (error == 0) /* max_size[4] */
-		error = p9fs_msg_add(m, sizeof (uint32_t), &max_size);
-	if (error == 0) /* version[s] */
-		error = p9fs_msg_add_string(m, UN_VERS, strlen(UN_VERS));
-	if (error != 0) {
-		p9fs_msg_destroy(p9s, m);
-		return (error);
-	}
-
-	error = p9fs_msg_send(p9s, &m);
-	if (error == EMSGSIZE)
-		goto retry;
-
+	error = p9fs_msg_send_conn(p9s, conn, &m);
 	if (m != NULL) {
-		struct p9fs_str p9str;
-		size_t off;
-
 		error = p9fs_client_error(p9s, &m, Rversion);
 		if (error != 0)
 			return (error);
 
-		off = sizeof (struct p9fs_msg_Rversion);
-		p9fs_msg_get_str(m, &off, &p9str);
-		if (strncmp(p9str.p9str_str, UN_VERS, p9str.p9str_size) != 0) {
+		error = p9fs_msg_parse(m, Rversion, &rv);
+		if (error != 0)
+			;
+		else if (!p9fs_str_eq(&rv.Rversion_version, UN_VERS)) {
+			len = p9fs_str_copy(&rv.Rversion_version, buf,
+			    sizeof (buf));
 			printf("Remote offered incompatible version '%.*s'\n",
-			    p9str.p9str_size, p9str.p9str_str);
+			    (int)len, buf);
 			error = EINVAL;
-		}
+		} else if (rv.Rversion_max_size <
+		    ((conn->p9c_flags & P9C_ATOMIC) != 0 ?
+		    P9FS_MSIZE_DGRAM_MIN : P9FS_MSIZE_MIN)) {
+			printf("Remote offered unusable msize %u\n",
+			    rv.Rversion_max_size);
+			error = EINVAL;
+		} else if (rv.Rversion_max_size < p9s->p9s_msize)
+			p9s->p9s_msize = rv.Rversion_max_size;
 
 		p9fs_msg_destroy(p9s, m);
 	}
@@ -146,6 +154,8 @@ retry:
  ********
  *
  * This implementation only supports authentication-free connections for now.
+ *
+ * Every connection attaches its own root fid; see struct p9fs_conn.
  */
 int
 p9fs_client_auth(struct p9fs_session *p9s)
@@ -154,48 +164,34 @@ p9fs_client_auth(struct p9fs_session *p9s)
 }
 
 int
-p9fs_client_attach(struct p9fs_session *p9s)
+p9fs_client_attach(struct p9fs_session *p9s, struct p9fs_conn *conn)
 {
-	void *m;
-	int error = 0;
+	struct p9fs_msg_Tattach ta;
+	struct p9fs_msg_Rattach ra;
 	struct p9fs_node *np = &p9s->p9s_rootnp;
-
-retry:
-	m = p9fs_msg_create(Tattach, p9fs_gettag(p9s));
+	void *m;
+	int error;
+
+	ta.Tattach_fid = P9FS_CONN_ROOTFID(conn);
+	ta.Tattach_afid = p9s->p9s_afid;
+	ta.Tattach_uname.p9str_str = p9s->p9s_uname;
+	ta.Tattach_uname.p9str_size = strlen(p9s->p9s_uname);
+	ta.Tattach_aname.p9str_str = p9s->p9s_path;
+	ta.Tattach_aname.p9str_size = strlen(p9s->p9s_path);
+	ta.Tattach_n_uname = p9s->p9s_uid;
+	m = p9fs_msg_build(Tattach, p9fs_gettag(p9s), &ta);
 	if (m == NULL)
 		return (ENOBUFS);
 
-	if (error == 0) /* fid[4] */
-		error = p9fs_msg_add(m, sizeof (uint32_t), &np->p9n_fid);
-	if (error == 0) /* afid[4] */
-		error = p9fs_msg_add(m, sizeof (uint32_t), &p9s->p9s_afid);
-	if (error == 0) /* uname[s] */
-		error = p9fs_msg_add_string(m, p9s->p9s_uname,
-		    strlen(p9s->p9s_uname));
-	if (error == 0) /* aname[s] */
-		error = p9fs_msg_add_string(m, p9s->p9s_path,
-		    strlen(p9s->p9s_path));
-	if (error == 0) /* uid[4] */
-		error = p9fs_msg_add(m, sizeof (uint32_t), &p9s->p9s_uid);
-	if (error != 0) {
-		p9fs_msg_destroy(p9s, m);
-		return (error);
-	}
-
 	error = p9fs_msg_send(p9s, &m);
-	if (error == EMSGSIZE)
-		goto retry;
-
 	if (m != NULL) {
-		size_t off = sizeof (struct p9fs_msg_hdr);
-		struct p9fs_qid *qid;
-
 		error = p9fs_client_error(p9s, &m, Rattach);
 		if (error != 0)
 			return (error);
 
-		p9fs_msg_get(m, &off, (void *)&qid, sizeof (struct p9fs_qid));
-		bcopy(qid, &np->p9n_qid, sizeof (struct p9fs_qid));
+		error = p9fs_msg_parse(m, Rattach, &ra);
+		if (error == 0)
+			np->p9n_qid = ra.Rattach_qid;
 		p9fs_msg_destroy(p9s, m);
 	}
 
@@ -216,25 +212,16 @@ retry:
 int
 p9fs_client_clunk(struct p9fs_session *p9s, uint32_t fid)
 {
+	struct p9fs_msg_Tclunk tc;
 	void *m;
-	int error = 0;
+	int error;
 
-retry:
-	m = p9fs_msg_create(Tclunk, p9fs_gettag(p9s));
+	tc.Tclunk_fid = fid;
+	m = p9fs_msg_build(Tclunk, p9fs_gettag(p9s), &tc);
 	if (m == NULL)
 		return (ENOBUFS);
 
-	if (error == 0) /* fid[4] */
-		error = p9fs_msg_add(m, sizeof (uint32_t), &fid);
-	if (error != 0) {
-		p9fs_msg_destroy(p9s, m);
-		return (error);
-	}
-
 	error = p9fs_msg_send(p9s, &m);
-	if (error == EMSGSIZE)
-		goto retry;
-
 	if (m != NULL) {
 		error = p9fs_client_error(p9s, &m, Rclunk);
 		if (error != 0)
@@ -274,24 +261,22 @@ p9fs_client_error(struct p9fs_session *p9s, void **mp,
     enum p9fs_msg_type expected_type)
 {
 	void *m = *mp;
-	size_t off = 0;
-	struct p9fs_msg_hdr *hdr;
+	struct p9fs_msg_hdr hdr;
+	struct p9fs_msg_Rerror re;
+	char ename[64];
+	size_t len;
 	int errcode = EINVAL;
 
-	p9fs_msg_get(m, &off, (void **)&hdr, sizeof (*hdr));
-	if (hdr->hdr_type == expected_type)
+	p9fs_msg_hdr(m, &hdr);
+	if (hdr.hdr_type == expected_type)
 		return (0);
 
-	if (hdr->hdr_type == Rerror) {
-		struct p9fs_str p9str;
-		uint32_t *proto_err;
-
-		p9fs_msg_get_str(m, &off, &p9str);
-		p9fs_msg_get(m, &off, (void *)&proto_err, sizeof (*proto_err));
-		errcode = *proto_err;
-		printf("%s: Rerror ret: errcode=%d err(%d)='%.*s'\n",
-		    __func__, errcode, p9str.p9str_size,
-		    p9str.p9str_size, p9str.p9str_str);
+	if (hdr.hdr_type == Rerror && p9fs_msg_parse(m, Rerror, &re) == 0) {
+		errcode = re.Rerror_errnum;
+		len = p9fs_str_copy(&re.Rerror_ename, ename, sizeof (ename));
+		P9FS_DEBUG(p9s, 1,
+		    "%s: Rerror ret: errcode=%d err(%d)='%.*s'\n", __func__,
+		    errcode, re.Rerror_ename.p9str_size, (int)len, ename);
 		if (errcode == -1)
 			errcode = EIO;
 	}
@@ -307,14 +292,95 @@ p9fs_client_error(struct p9fs_session *p9s, void **mp,
  *   size[4] Rflush tag[2]
  *
  ******** PROTOCOL NOTES
+ * The server must answer Tflush with Rflush, without replying to oldtag if
+ * it has not already done so.  oldtag may not be reused until the Rflush
+ * arrives, even if the reply to oldtag arrives first.
  *
+ * Tflush must travel on the same connection as the message it aborts.
  ********
  *
+ * The sender of oldtag has already given up on it; any reply to oldtag
+ * that arrives before the Rflush is discarded by the receive path.  The
+ * Rflush is not waited for, so that an interrupted sender can return at
+ * once; oldtag is released when it arrives, or when the connection fails.
+ * If it does not arrive within the flush's own timeout, the server is
+ * presumed hung and the connection is given up on, which also ends the
+ * server's interest in oldtag.
+ *
+ * XXX If the discarded reply was for a Twalk or Tcreate, the server has
+ *     bound the new fid, which is then leaked on the server until the
+ *     connection closes.
  */
+struct p9fs_flush {
+	struct callout pf_timer;
+	struct p9fs_conn *pf_conn;
+	uint16_t pf_oldtag;
+};
+
+/* The Rflush is overdue; runs with p9s_lock held. */
+static void
+p9fs_client_flush_timeout(void *arg)
+{
+	struct p9fs_flush *pf = arg;
+
+	taskqueue_enqueue(taskqueue_thread, &pf->pf_conn->p9c_ftask);
+}
+
+static void
+p9fs_client_flush_done(struct p9fs_session *p9s, void *arg, void *m,
+    int error __unused)
+{
+	struct p9fs_flush *pf = arg;
+
+	mtx_lock(&p9s->p9s_lock);
+	callout_stop(&pf->pf_timer);
+	mtx_unlock(&p9s->p9s_lock);
+	if (m != NULL)
+		p9fs_msg_destroy(p9s, m);
+	p9fs_reltag(p9s, pf->pf_oldtag);
+	free(pf, M_TEMP);
+}
+
 int
-p9fs_client_flush(void)
+p9fs_client_flush(struct p9fs_session *p9s, struct p9fs_conn *conn,
+    uint16_t oldtag)
 {
-	return (EINVAL);
+	struct p9fs_msg_Tflush tf;
+	struct p9fs_flush *pf;
+	void *m;
+	int error, timo;
+	uint16_t tag;
+
+	tag = p9fs_gettag(p9s);
+	tf.Tflush_oldtag = oldtag;
+	m = p9fs_msg_build(Tflush, tag, &tf);
+	if (m == NULL) {
+		/* XXX The server may still reply to oldtag after reuse. */
+		p9fs_reltag(p9s, tag);
+		p9fs_reltag(p9s, oldtag);
+		return (ENOBUFS);
+	}
+
+	/* The Rflush may arrive before the send returns. */
+	pf = malloc(sizeof (*pf), M_TEMP, M_WAITOK);
+	pf->pf_conn = conn;
+	pf->pf_oldtag = oldtag;
+	callout_init_mtx(&pf->pf_timer, &p9s->p9s_lock, 0);
+	timo = p9fs_rtt_timeout(p9s, Tflush);
+	mtx_lock(&p9s->p9s_lock);
+	callout_reset(&pf->pf_timer, timo, p9fs_client_flush_timeout, pf);
+	mtx_unlock(&p9s->p9s_lock);
+
+	error = p9fs_msg_send_async(p9s, conn, m, p9fs_client_flush_done, pf);
+	if (error != 0) {
+		mtx_lock(&p9s->p9s_lock);
+		callout_stop(&pf->pf_timer);
+		mtx_unlock(&p9s->p9s_lock);
+		free(pf, M_TEMP);
+		p9fs_reltag(p9s, oldtag);
+	}
+
+	return (error);
 }
 
 /*
@@ -333,17 +399,15 @@ p9fs_client_flush(void)
  *
  */
 int
-p9fs_client_open(struct p9fs_session *p9s, uint32_t fid, int mode)
+p9fs_client_open(struct p9fs_session *p9s, uint32_t fid, int mode,
+    uint32_t *iounitp)
 {
+	struct p9fs_msg_Topen to;
+	struct p9fs_msg_Ropen ro;
 	void *m;
-	int error = 0;
+	int error;
 	uint8_t mode1;
 
-retry:
-	m = p9fs_msg_create(Topen, p9fs_gettag(p9s));
-	if (m == NULL)
-		return (ENOBUFS);
-
 	/* Convert VOP_OPEN() mode to 9P2000 mode[1]. */
 	if ((mode & (FREAD|FWRITE)) == (FREAD|FWRITE))
 		mode1 = ORDWR;
@@ -355,30 +419,25 @@ retry:
 		mode1 |= OTRUNC;
 	/* There is no POSIX mode correlating to ORCLOSE. */
 
-	if (error == 0)
-		error = p9fs_msg_add(m, sizeof (uint32_t), &fid);
-	if (error == 0)
-		error = p9fs_msg_add(m, sizeof (uint8_t), &mode1);
-	if (error != 0) {
-		p9fs_msg_destroy(p9s, m);
-		return (error);
-	}
+	to.Topen_fid = fid;
+	to.Topen_mode = mode1;
+	m = p9fs_msg_build(Topen, p9fs_gettag(p9s), &to);
+	if (m == NULL)
+		return (ENOBUFS);
 
 	error = p9fs_msg_send(p9s, &m);
-	if (error == EMSGSIZE)
-		goto retry;
-
 	if (m != NULL) {
-		size_t off = sizeof (struct p9fs_msg_hdr);
-		struct p9fs_qid *qid;
-
 		error = p9fs_client_error(p9s, &m, Ropen);
 		if (error != 0)
 			return (error);
 
-		p9fs_msg_get(m, &off, (void *)&qid, sizeof (struct p9fs_qid));
 		/* XXX Put qid in vnode private space? */
+		error = p9fs_msg_parse(m, Ropen, &ro);
+		if (error == 0 && iounitp != NULL)
+			*iounitp = ro.Ropen_iounit;
 		p9fs_msg_destroy(p9s, m);
+		if (error == 0)
+			p9fs_fidrec_open(p9s, fid, mode1);
 	}
 
 	return (error);
@@ -394,9 +453,14 @@ p9fs_client_create(void)
  * Common i/o callback for uio users.  This will be used by higher layers
  * that want to use read/write directly via uio, without custom translation.
  * Other callers have the choice to do additional processing.
+ *
+ * Rread data is copied out of the received mbuf chain directly, so each
+ * byte is copied once between the socket and the uio.  Callbacks that parse
+ * the data, like readdir's, likewise decode it where it lies.
  */
 int
-p9fs_client_uio_callback(void *mp, uint32_t count, size_t *offp, struct uio *uio)
+p9fs_client_uio_callback(void **mp, uint32_t count, size_t *offp,
+    struct uio *uio)
 {
 	int error = 0;
 
@@ -404,10 +468,8 @@ p9fs_client_uio_callback(void *mp, uint32_t count, size_t *offp, struct uio *uio
 		uio->uio_offset += count;
 		uio->uio_resid -= count;
 	} else {
-		uint8_t *buf;
-
-		p9fs_msg_get(mp, offp, (void *)&buf, count);
-		error = uiomove(buf, count, uio);
+		error = p9fs_msg_uiomove(*mp, *offp, count, uio);
+		*offp += count;
 	}
 
 	return (error);
@@ -423,114 +485,199 @@ p9fs_client_uio_callback(void *mp, uint32_t count, size_t *offp, struct uio *uio
  *   size[4] Rwrite tag[2] count[4]
  *
  ******** PROTOCOL NOTES
- *
+ * count[4]: No message may exceed the negotiated msize, so count is at most
+ * msize - P9_IOHDRSZ.  If Ropen or Rcreate returned a nonzero iounit, no
+ * more than iounit bytes may be transferred atomically, so count should not
+ * exceed it either.
  ********
  *
+ * Each call transfers at most one message's worth; callers loop.
  */
+static uint32_t
+p9fs_client_iosize(struct p9fs_session *p9s, uint32_t iounit)
+{
+	uint32_t iosize = p9s->p9s_msize - P9_IOHDRSZ;
+
+	if (iounit != 0 && iounit < iosize)
+		iosize = iounit;
+	return (iosize);
+}
+
 int
-p9fs_client_read(struct p9fs_session *p9s, uint32_t fid,
+p9fs_client_read(struct p9fs_session *p9s, uint32_t fid, uint32_t iounit,
     io_callback iocb, struct uio *uio)
 {
+	struct p9fs_msg_Tread tr;
+	struct p9fs_msg_Rread rr;
+	size_t off;
 	void *m;
-	int error = 0;
-	uint64_t off;
-	uint32_t count;
+	int error;
 
 	if (iocb == NULL || uio->uio_offset < 0 || uio->uio_rw != UIO_READ)
 		return (EINVAL);
 
-	off = uio->uio_offset;
-	CTASSERT(P9_MSG_MAX <= UINT32_MAX);
-	count = MIN(P9_MSG_MAX, uio->uio_resid);
-	if (count == 0)
+	tr.Tread_fid = fid;
+	tr.Tread_offset = uio->uio_offset;
+	tr.Tread_count = MIN(p9fs_client_iosize(p9s, iounit), uio->uio_resid);
+	if (tr.Tread_count == 0)
 		return (0);
 
-retry:
-	m = p9fs_msg_create(Tread, p9fs_gettag(p9s));
+	m = p9fs_msg_build(Tread, p9fs_gettag(p9s), &tr);
 	if (m == NULL)
 		return (ENOBUFS);
 
-	if (error == 0) /* fid[4] */
-		error = p9fs_msg_add(m, sizeof (uint32_t), &fid);
-	if (error == 0) /* offset[8] */
-		error = p9fs_msg_add(m, sizeof (uint64_t), &off);
-	if (error == 0) /* count[4] */
-		error = p9fs_msg_add(m, sizeof (uint32_t), &count);
-	if (error != 0) {
-		p9fs_msg_destroy(p9s, m);
-		return (error);
-	}
-
 	error = p9fs_msg_send(p9s, &m);
-	if (error == EMSGSIZE)
-		goto retry;
-
 	if (m != NULL) {
-		size_t off = sizeof (struct p9fs_msg_hdr);
-		uint32_t *retcount;
-
 		error = p9fs_client_error(p9s, &m, Rread);
 		if (error != 0)
 			return (error);
 
-		p9fs_msg_get(m, &off, (void *)&retcount, sizeof (*retcount));
-		error = iocb(m, *retcount, &off, uio);
+		error = p9fs_msg_parse(m, Rread, &rr);
+		if (error == 0) {
+			off = rr.Rread_data.pd_off;
+			error = iocb(&m, rr.Rread_data.pd_count, &off, uio);
+		}
 		p9fs_msg_destroy(p9s, m);
 	}
 
 	return (error);
 }
 
+/*
+ * Read into uio with up to depth Treads in flight: successive message-sized
+ * pieces of the range are asked for in turn, and each reply's data is
+ * copied into uio as it is taken, oldest first, so the data lands in offset
+ * order while the round trips overlap.  A new Tread is sent as each reply
+ * is taken.
+ *
+ * The first short read, normally the end of the file, ends the transfer;
+ * the replies to any Treads past it are discarded, as are those past an
+ * error.  Callers loop, as for p9fs_client_read().
+ */
+struct p9fs_readv_slot {
+	struct p9fs_msg_sync rs_ps;
+	uint32_t rs_count;
+};
+
 int
-p9fs_client_write(struct p9fs_session *p9s, uint32_t fid,
+p9fs_client_readv(struct p9fs_session *p9s, uint32_t fid, uint32_t iounit,
+    u_int depth, struct uio *uio)
+{
+	struct p9fs_readv_slot *slots, *rs;
+	struct p9fs_msg_Tread tr;
+	struct p9fs_msg_Rread rr;
+	uint32_t iosize;
+	off_t next;
+	ssize_t left;
+	size_t off;
+	u_int head, nout;
+	void *m;
+	int done, error, error1, skip;
+
+	if (uio->uio_offset < 0 || uio->uio_rw != UIO_READ)
+		return (EINVAL);
+	iosize = p9fs_client_iosize(p9s, iounit);
+	depth = MIN(MAX(depth, 1), howmany(uio->uio_resid, iosize));
+	if (depth == 0)
+		return (0);
+
+	slots = malloc(depth * sizeof (*slots), M_TEMP, M_WAITOK);
+	tr.Tread_fid = fid;
+	next = uio->uio_offset;
+	left = uio->uio_resid;
+	head = nout = 0;
+	done = error = 0;
+	for (;;) {
+		/* Keep the pipeline full. */
+		while (!done && error == 0 && nout < depth && left > 0) {
+			rs = &slots[(head + nout) % depth];
+			tr.Tread_offset = next;
+			tr.Tread_count = MIN(iosize, left);
+			m = p9fs_msg_build(Tread, p9fs_gettag(p9s), &tr);
+			if (m == NULL) {
+				error = ENOBUFS;
+				break;
+			}
+			error = p9fs_msg_send_start(p9s, NULL, &m, &rs->rs_ps);
+			if (error != 0)
+				break;
+			rs->rs_count = tr.Tread_count;
+			next += tr.Tread_count;
+			left -= tr.Tread_count;
+			nout++;
+		}
+		if (nout == 0)
+			break;
+
+		/* Take the oldest; each must be waited for. */
+		rs = &slots[head];
+		head = (head + 1) % depth;
+		nout--;
+		skip = done || error != 0;
+		error1 = p9fs_msg_send_wait(p9s, &rs->rs_ps, &m);
+		if (m != NULL)
+			error1 = p9fs_client_error(p9s, &m, Rread);
+		if (m != NULL && !skip) {
+			error1 = p9fs_msg_parse(m, Rread, &rr);
+			if (error1 == 0) {
+				off = rr.Rread_data.pd_off;
+				error1 = p9fs_msg_uiomove(m, off,
+				    rr.Rread_data.pd_count, uio);
+				if (rr.Rread_data.pd_count < rs->rs_count)
+					done = 1;
+			}
+		}
+		if (m != NULL)
+			p9fs_msg_destroy(p9s, m);
+		if (!skip)
+			error = error1;
+	}
+	free(slots, M_TEMP);
+
+	return (error);
+}
+
+int
+p9fs_client_write(struct p9fs_session *p9s, uint32_t fid, uint32_t iounit,
     io_callback iocb, struct uio *uio)
 {
+	struct p9fs_msg_Twrite tw;
+	struct p9fs_msg_Rwrite rw;
+	size_t off;
 	void *m;
-	int error = 0;
-	uint64_t off;
-	uint32_t count;
+	int error;
 
 	if (iocb == NULL || uio->uio_offset < 0 || uio->uio_rw != UIO_WRITE)
 		return (EINVAL);
 
-	off = uio->uio_offset;
-	CTASSERT(P9_MSG_MAX <= UINT32_MAX);
-	count = MIN(P9_MSG_MAX, uio->uio_resid);
-	if (count == 0)
+	tw.Twrite_fid = fid;
+	tw.Twrite_offset = uio->uio_offset;
+	tw.Twrite_data.pd_count = MIN(p9fs_client_iosize(p9s, iounit),
+	    uio->uio_resid);
+	if (tw.Twrite_data.pd_count == 0)
 		return (0);
 
-retry:
-	m = p9fs_msg_create(Twrite, p9fs_gettag(p9s));
+	/* The data is attached after the other fields, not copied in. */
+	m = p9fs_msg_build(Twrite, p9fs_gettag(p9s), &tw);
 	if (m == NULL)
 		return (ENOBUFS);
-
-	if (error == 0) /* fid[4] */
-		error = p9fs_msg_add(m, sizeof (uint32_t), &fid);
-	if (error == 0) /* offset[8] */
-		error = p9fs_msg_add(m, sizeof (uint64_t), &off);
-	if (error == 0) /* count[4] */
-		error = p9fs_msg_add(m, sizeof (uint32_t), &count);
-	if (error == 0) /* data[count] */
-		error = p9fs_msg_add_uio(m, uio, count);
+	error = p9fs_msg_add_uio(m, uio, tw.Twrite_data.pd_count);
 	if (error != 0) {
 		p9fs_msg_destroy(p9s, m);
 		return (error);
 	}
 
-	error = p9fs_msg_send(p9s, m);
-	if (error == EMSGSIZE)
-		goto retry;
-
+	error = p9fs_msg_send(p9s, &m);
 	if (m != NULL) {
-		size_t off = sizeof (struct p9fs_msg_hdr);
-		uint32_t *retcount;
-
 		error = p9fs_client_error(p9s, &m, Rwrite);
 		if (error != 0)
 			return (error);
 
-		p9fs_msg_get(m, &off, (void *)&retcount, sizeof (*retcount));
-		error = iocb(m, *retcount, &off, uio);
+		error = p9fs_msg_parse(m, Rwrite, &rw);
+		if (error == 0) {
+			off = P9_HDRSZ + sizeof (rw.Rwrite_count);
+			error = iocb(&m, rw.Rwrite_count, &off, uio);
+		}
 		p9fs_msg_destroy(p9s, m);
 	}
 
@@ -554,58 +701,12 @@ p9fs_client_remove(void)
 	return (EINVAL);
 }
 
-/* Parse the 9P2000-only portion of Rstat from the message. */
-void
-p9fs_client_parse_std_stat(void *m, struct p9fs_stat_payload *pay, size_t *offp)
-{
-	size_t soff = *offp;
-
-	p9fs_msg_get(m, offp, (void **)&pay->pay_stat, sizeof (*pay->pay_stat));
-	{
-		struct p9fs_stat *p9stat = pay->pay_stat;
-		printf("p9stat: size=%u type=%u dev=%u qid=(%u,%u,%lu) "
-		    "mode=%u atime=%u mtime=%u length=%lu\n",
-		    p9stat->stat_size, p9stat->stat_type,
-		    p9stat->stat_dev, p9stat->stat_qid.qid_mode,
-		    p9stat->stat_qid.qid_version,
-		    p9stat->stat_qid.qid_path, p9stat->stat_mode,
-		    p9stat->stat_atime, p9stat->stat_mtime,
-		    p9stat->stat_length);
-	}
-	p9fs_msg_get_str(m, offp, &pay->pay_name);
-	p9fs_msg_get_str(m, offp, &pay->pay_uid);
-	p9fs_msg_get_str(m, offp, &pay->pay_gid);
-	p9fs_msg_get_str(m, offp, &pay->pay_muid);
-	printf("p9stat: name='%.*s' uid='%.*s' gid='%.*s' muid='%.*s'\n",
-	    pay->pay_name.p9str_size, pay->pay_name.p9str_str,
-	    pay->pay_uid.p9str_size, pay->pay_uid.p9str_str,
-	    pay->pay_gid.p9str_size, pay->pay_gid.p9str_str,
-	    pay->pay_muid.p9str_size, pay->pay_muid.p9str_str);
-	printf("p9stat: start off %zu end off %zu\n", soff, *offp);
-}
-
-/* Parse the 9P2000.u-only portion of Rstat from the message. */
-void
-p9fs_client_parse_u_stat(void *m, struct p9fs_stat_u_payload *pay, size_t *offp)
-{
-	size_t soff = *offp;
-
-	p9fs_client_parse_std_stat(m, &pay->upay_std, offp);
-	p9fs_msg_get_str(m, offp, &pay->upay_extension);
-	p9fs_msg_get(m, offp, (void **)&pay->upay_footer,
-	    sizeof (pay->upay_footer));
-
-	printf("p9stat.u: ext='%.*s' uid=%d gid=%d muid=%d\n",
-	    pay->upay_extension.p9str_size, pay->upay_extension.p9str_str,
-	    pay->upay_footer->n_uid, pay->upay_footer->n_gid, pay->upay_footer->n_muid);
-	printf("p9stat.u: start off %zu end off %zu\n", soff, *offp);
-}
-
 static void
 print_vattr(struct vattr *vap, uint32_t fid)
 {
 	printf("vattr(fid=%u %p)={\n", fid, vap);
-	printf("  atime=%ld mtime=%ld\n", vap->va_atime.tv_sec, vap->va_mtime.tv_sec);
+	printf("  atime=%ld mtime=%ld\n", vap->va_atime.tv_sec,
+	    vap->va_mtime.tv_sec);
 	printf("  mode=%o bytes=%lu\n", vap->va_mode, vap->va_bytes);
 	printf("  type=%d fileid=%lu\n", vap->va_type, vap->va_fileid);
 	printf("}\n");
@@ -629,47 +730,29 @@ print_vattr(struct vattr *vap, uint32_t fid)
 int
 p9fs_client_stat(struct p9fs_session *p9s, uint32_t fid, struct vattr *vap)
 {
+	struct p9fs_msg_Tstat ts;
+	struct p9fs_msg_Rstat rs;
+	struct p9fs_stat *p9stat;
 	void *m;
-	int error = 0;
+	int error;
 
-retry:
-	m = p9fs_msg_create(Tstat, p9fs_gettag(p9s));
+	ts.Tstat_fid = fid;
+	m = p9fs_msg_build(Tstat, p9fs_gettag(p9s), &ts);
 	if (m == NULL)
 		return (ENOBUFS);
 
-	if (error == 0) /* fid[4] */
-		error = p9fs_msg_add(m, sizeof (uint32_t), &fid);
-	if (error != 0) {
-		p9fs_msg_destroy(p9s, m);
-		return (error);
-	}
-
 	error = p9fs_msg_send(p9s, &m);
-	if (error == EMSGSIZE)
-		goto retry;
-
 	if (m != NULL) {
-		size_t off = 0;
-		struct p9fs_stat_u_payload upay = {};
-		struct p9fs_stat *p9stat;
-		struct p9fs_stat_u_footer *foot;
-		uint16_t *totsz;
-
 		error = p9fs_client_error(p9s, &m, Rstat);
 		if (error != 0)
 			return (error);
 
-		off = sizeof (struct p9fs_msg_hdr);
-		/*
-		 * XXX py9p sends a 'total stat size', is that correct?
-		 *     This behavior is not called out in the specs
-		 *     explicitly, but it does say "stat[n]", implying that
-		 *     more than one stat entry may be returned.
-		 */
-		p9fs_msg_get(m, &off, (void *)&totsz, sizeof (*totsz));
-
-		p9fs_client_parse_u_stat(m, &upay, &off);
-		p9stat = upay.upay_std.pay_stat;
+		error = p9fs_msg_parse(m, Rstat, &rs);
+		if (error != 0) {
+			p9fs_msg_destroy(p9s, m);
+			return (error);
+		}
+		p9stat = &rs.Rstat_stat;
 
 		/* XXX number of links is not provided by 9P2000{,.u} */
 		vap->va_nlink = 1;
@@ -718,14 +801,10 @@ retry:
 			}
 			break;
 		}
-		foot = upay.upay_footer;
-		vap->va_uid = foot->n_uid;
-		vap->va_gid = foot->n_gid;
-#if 0
-		print_vattr(vap, fid);
-		{
-		}
-#endif
+		vap->va_uid = p9stat->stat_n_uid;
+		vap->va_gid = p9stat->stat_n_gid;
+		if (p9s->p9s_debug >= 2)
+			print_vattr(vap, fid);
 
 		p9fs_msg_destroy(p9s, m);
 	}
@@ -752,8 +831,8 @@ p9fs_client_wstat(void)
  * T*wname[s] are the names of those things.
  ********
  *
- * For the purposes of p9fs, this call will only ever be used for a single
- * walk at a time, due to the nature of POSIX VFS.
+ * This call walks a single name at a time, as POSIX VFS looks them up;
+ * p9fs_client_walkv() looks ahead down a path.
  *
  * Note that this call is used to open files in addition to directories.
  */
@@ -761,53 +840,435 @@ int
 p9fs_client_walk(struct p9fs_session *p9s, uint32_t fid, uint32_t *newfid,
     size_t namelen, const char *namestr, struct p9fs_qid *qidp)
 {
+	struct p9fs_msg_Twalk tw;
+	struct p9fs_msg_Rwalk rw;
 	void *m;
-	int error = 0;
-	uint16_t nwname = namestr == NULL ? 0 : 1;
-
-retry:
-	m = p9fs_msg_create(Twalk, p9fs_gettag(p9s));
+	int error;
+
+	tw.Twalk_fid = fid;
+	tw.Twalk_newfid = *newfid;
+	tw.Twalk_wnames.wn_nwname = namestr == NULL ? 0 : 1;
+	tw.Twalk_wnames.wn_wname[0].p9str_str = __DECONST(char *, namestr);
+	tw.Twalk_wnames.wn_wname[0].p9str_size = namelen;
+	m = p9fs_msg_build(Twalk, p9fs_gettag(p9s), &tw);
 	if (m == NULL)
 		return (ENOBUFS);
 
-	if (error == 0) /* fid[4] */
-		error = p9fs_msg_add(m, sizeof (fid), &fid);
-	if (error == 0) /* newfid[4] */
-		error = p9fs_msg_add(m, sizeof (*newfid), newfid);
-	if (error == 0) /* nwname[2] */
-		error = p9fs_msg_add(m, sizeof (uint16_t), &nwname);
-	if (error == 0 && nwname == 1) /* the sole wname[s] */
-		error = p9fs_msg_add_string(m, namestr, namelen);
-	if (error != 0) {
-		p9fs_msg_destroy(p9s, m);
-		return (error);
-	}
-
 	error = p9fs_msg_send(p9s, &m);
-	if (error == EMSGSIZE)
-		goto retry;
-
 	if (m != NULL) {
-		size_t off = sizeof (struct p9fs_msg_hdr);
-		uint16_t *nwqid;
-		struct p9fs_qid *qid;
-
 		error = p9fs_client_error(p9s, &m, Rwalk);
 		if (error != 0)
 			return (error);
 
-		p9fs_msg_get(m, &off, (void *)&nwqid, sizeof (*nwqid));
-		if (nwname != *nwqid) {
+		error = p9fs_msg_parse(m, Rwalk, &rw);
+		if (error == 0 &&
+		    rw.Rwalk_wqids.wq_nwqid != tw.Twalk_wnames.wn_nwname) {
 			/* XXX: How else could this occur other than ENOENT? */
 			error = ENOENT;
 		}
 		/* Return the qid; this only applies if not a self-walk. */
-		if (error == 0 && nwname == 1) {
-			p9fs_msg_get(m, &off, (void *)&qid,
-			    sizeof (struct p9fs_qid));
-			bcopy(qid, qidp, sizeof (struct p9fs_qid));
+		if (error == 0 && tw.Twalk_wnames.wn_nwname == 1)
+			*qidp = rw.Rwalk_wqids.wq_qid[0];
+		p9fs_msg_destroy(p9s, m);
+	}
+	if (error == 0)
+		p9fs_fidrec_walk(p9s, fid, *newfid, namestr, namelen,
+		    tw.Twalk_wnames.wn_nwname == 1 ? qidp : NULL);
+
+	return (error);
+}
+
+/*
+ * Walk newfid from fid to wnames[0] and, in the same round trip, find out
+ * how far down the path of nwname names a walk gets, with one Twalk of all
+ * of them to lastfid.  This is how a lookup looks ahead at the directories
+ * namei(9) is about to descend through, without a fid for each of them.
+ *
+ * Fails only if newfid cannot be walked.  Otherwise *nfoundp is set to the
+ * number of names found in turn, whose qids are in qids[], and *missingp is
+ * set if the next name was found not to exist in its directory.  lastfid
+ * is bound, to the last name, only if all nwname names were found.
+ */
+int
+p9fs_client_walkv(struct p9fs_session *p9s, uint32_t fid, uint32_t newfid,
+    uint32_t lastfid, uint16_t nwname, const struct p9fs_str *wnames,
+    struct p9fs_qid *qids, uint16_t *nfoundp, int *missingp)
+{
+	struct p9fs_msg_sync ps[2];
+	struct p9fs_msg_Twalk tw;
+	struct p9fs_msg_Rwalk rw;
+	struct p9fs_qid qid0;
+	uint16_t nwqid;
+	void *m;
+	int error, i, nsent, serror;
+
+	tw.Twalk_fid = fid;
+	bcopy(wnames, tw.Twalk_wnames.wn_wname, nwname * sizeof (*wnames));
+	serror = 0;
+	for (nsent = 0; nsent < 2; nsent++) {
+		tw.Twalk_newfid = nsent == 0 ? newfid : lastfid;
+		tw.Twalk_wnames.wn_nwname = nsent == 0 ? 1 : nwname;
+		m = p9fs_msg_build(Twalk, p9fs_gettag(p9s), &tw);
+		if (m == NULL) {
+			serror = ENOBUFS;
+			break;
+		}
+		serror = p9fs_msg_send_start(p9s, NULL, &m, &ps[nsent]);
+		if (serror != 0)
+			break;
+	}
+
+	/*
+	 * Each walk that was started must be waited for.  A partial Rwalk
+	 * of the whole path gives the qids of the names found; a name not
+	 * found in a directory is missing, whereas one that could not be
+	 * walked through is not known either way.
+	 */
+	nwqid = 0;
+	*missingp = 0;
+	for (i = 0; i < nsent; i++) {
+		error = p9fs_msg_send_wait(p9s, &ps[i], &m);
+		if (m != NULL)
+			error = p9fs_client_error(p9s, &m, Rwalk);
+		if (error == 0)
+			error = p9fs_msg_parse(m, Rwalk, &rw);
+		if (error == 0 && i == 0) {
+			if (rw.Rwalk_wqids.wq_nwqid == 1)
+				qid0 = rw.Rwalk_wqids.wq_qid[0];
+			else
+				error = ENOENT;
+		} else if (error == 0) {
+			nwqid = MIN(rw.Rwalk_wqids.wq_nwqid, nwname);
+			bcopy(rw.Rwalk_wqids.wq_qid, qids,
+			    nwqid * sizeof (*qids));
+			*missingp = nwqid > 0 && nwqid < nwname &&
+			    (qids[nwqid - 1].qid_mode & QTDIR) != 0;
+		}
+		if (m != NULL)
+			p9fs_msg_destroy(p9s, m);
+		if (i == 0)
+			serror = error;
+	}
+	error = serror;
+
+	/*
+	 * The two walks are separate, so the path may have changed between
+	 * them; if so, nothing past the first name is known.
+	 */
+	if (nwqid > 0 &&
+	    (error != 0 || qids[0].qid_path != qid0.qid_path)) {
+		if (nwqid == nwname)
+			(void) p9fs_client_clunk(p9s, lastfid);
+		nwqid = 0;
+		*missingp = 0;
+	}
+	if (error != 0) {
+		*nfoundp = 0;
+		return (error);
+	}
+
+	qids[0] = qid0;
+	p9fs_fidrec_walk(p9s, fid, newfid, wnames[0].p9str_str,
+	    wnames[0].p9str_size, &qids[0]);
+	if (nwqid == nwname)
+		p9fs_fidrec_walkv(p9s, fid, lastfid, wnames, nwname,
+		    &qids[nwname - 1]);
+	*nfoundp = MAX(nwqid, 1);
+	return (0);
+}
+
+/*
+ * Point a Twalk at the n NUL-separated names starting at path.  Returns
+ * the length of the names taken, so that the next walk can continue.
+ */
+static size_t
+p9fs_client_wnames(struct p9fs_wnames *wn, const char *path, uint16_t n)
+{
+	size_t len, off;
+	uint16_t i;
+
+	wn->wn_nwname = n;
+	for (i = 0, off = 0; i < n; i++) {
+		len = strlen(path + off);
+		wn->wn_wname[i].p9str_str = __DECONST(char *, path + off);
+		wn->wn_wname[i].p9str_size = len;
+		off += len + 1;
+	}
+	return (off);
+}
+
+/*
+ * Walk newfid, from the root fid of its own connection, to the file that
+ * fid leads to on another connection, by the path recorded for fid.  This
+ * is how p9fs_open() reaches a file on a bulk connection.  The walk must
+ * end at the file fid has, or ESTALE is returned.  Paths longer than
+ * P9_MAXWELEM names take several walks, each continuing from newfid.
+ */
+int
+p9fs_client_walk_path(struct p9fs_session *p9s, uint32_t fid,
+    uint32_t newfid)
+{
+	struct p9fs_msg_Twalk tw;
+	struct p9fs_msg_Rwalk rw;
+	struct p9fs_qid qid;
+	uint16_t nsent, nwalked, nwname;
+	size_t poff, plen;
+	char *path;
+	void *m;
+	int bound, error;
+
+	error = p9fs_fidrec_path(p9s, fid, &path, &nwname, &qid);
+	if (error != 0)
+		return (error);
+
+	/* Each connection's root fid is its index. */
+	tw.Twalk_fid = P9FS_FID_CONN(p9s, newfid);
+	tw.Twalk_newfid = newfid;
+	bound = 0;
+	nwalked = 0;
+	poff = 0;
+	do {
+		nsent = MIN(nwname - nwalked, P9_MAXWELEM);
+		plen = p9fs_client_wnames(&tw.Twalk_wnames, path + poff, nsent);
+		m = p9fs_msg_build(Twalk, p9fs_gettag(p9s), &tw);
+		if (m == NULL) {
+			error = ENOBUFS;
+			break;
 		}
+
+		error = p9fs_msg_send(p9s, &m);
+		if (m != NULL)
+			error = p9fs_client_error(p9s, &m, Rwalk);
+		if (error != 0)
+			break;
+
+		error = p9fs_msg_parse(m, Rwalk, &rw);
 		p9fs_msg_destroy(p9s, m);
+		if (error != 0)
+			break;
+		if (rw.Rwalk_wqids.wq_nwqid != nsent)
+			error = ENOENT;
+		else if (nsent > 0 && nwalked + nsent == nwname &&
+		    rw.Rwalk_wqids.wq_qid[nsent - 1].qid_path != qid.qid_path) {
+			/* The walk did not end up at the same file. */
+			error = ESTALE;
+		}
+		/* A walk of several names binds newfid only if all succeed. */
+		if (rw.Rwalk_wqids.wq_nwqid == nsent)
+			bound = 1;
+		nwalked += nsent;
+		poff += plen;
+		tw.Twalk_fid = newfid;
+	} while (error == 0 && nwalked < nwname);
+
+	free(path, M_TEMP);
+	if (error == 0)
+		p9fs_fidrec_walk(p9s, fid, newfid, NULL, 0, NULL);
+	else if (bound)
+		(void) p9fs_client_clunk(p9s, newfid);
+
+	return (error);
+}
+
+/*
+ * Rebuild a connection's fids after reconnecting, once the root fid has
+ * been reattached.  Each recorded fid is walked to again from the root
+ * fid, and reopened if it was open.  All the walks are sent before
+ * waiting for any reply, then all the opens.  Paths longer than
+ * P9_MAXWELEM names take several rounds of walks, each continuing from
+ * where the last one left off.
+ *
+ * A fid that cannot be rebuilt, because its file is gone or was replaced
+ * by another, is left unknown to the server, so that using it fails.
+ * Returns an error only if the connection itself failed.
+ */
+struct p9fs_replay {
+	STAILQ_HEAD(, p9fs_replay_fid) pr_fids;
+	u_int pr_pending;
+};
+
+struct p9fs_replay_fid {
+	STAILQ_ENTRY(p9fs_replay_fid) rf_link;
+	struct p9fs_replay *rf_replay;
+	int rf_error;
+	uint8_t rf_rtype;	/* Reply expected to the request in flight. */
+	uint16_t rf_nsent;	/* Names in the Twalk in flight. */
+	uint16_t rf_nwalked;	/* Names walked so far. */
+	uint16_t rf_off;	/* Offset of the next name in rf_path. */
+	uint32_t rf_fid;
+	int rf_mode;
+	struct p9fs_qid rf_qid;
+	uint16_t rf_nwname;
+	char rf_path[];
+};
+
+static void
+p9fs_client_replay_done(struct p9fs_session *p9s, void *arg, void *m,
+    int error)
+{
+	struct p9fs_replay_fid *rf = arg;
+	struct p9fs_replay *pr = rf->rf_replay;
+	struct p9fs_msg_Rwalk rw;
+
+	if (m != NULL) {
+		error = p9fs_client_error(p9s, &m, rf->rf_rtype);
+		if (error == 0 && rf->rf_rtype == Rwalk)
+			error = p9fs_msg_parse(m, Rwalk, &rw);
+		if (error == 0 && rf->rf_rtype == Rwalk) {
+			if (rw.Rwalk_wqids.wq_nwqid != rf->rf_nsent)
+				error = ENOENT;
+			rf->rf_nwalked += rf->rf_nsent;
+			/* Check that the walk ended up at the same file. */
+			if (error == 0 && rf->rf_nsent > 0 &&
+			    rf->rf_nwalked == rf->rf_nwname &&
+			    rw.Rwalk_wqids.wq_qid[rf->rf_nsent - 1].qid_path !=
+			    rf->rf_qid.qid_path)
+				error = ESTALE;
+		}
+		if (m != NULL)
+			p9fs_msg_destroy(p9s, m);
+	}
+
+	mtx_lock(&p9s->p9s_lock);
+	if (error != 0)
+		rf->rf_error = error;
+	if (--pr->pr_pending == 0)
+		wakeup(pr);
+	mtx_unlock(&p9s->p9s_lock);
+}
+
+/* Send the next Twalk, or the Topen, needed to rebuild a fid. */
+static int
+p9fs_client_replay_send(struct p9fs_session *p9s, struct p9fs_conn *conn,
+    struct p9fs_replay_fid *rf, enum p9fs_msg_type type)
+{
+	struct p9fs_replay *pr = rf->rf_replay;
+	union p9fs_msg t;
+	void *m;
+	int error;
+
+	if (type == Topen) {
+		rf->rf_rtype = Ropen;
+		t.p9msg_Topen.Topen_fid = rf->rf_fid;
+		t.p9msg_Topen.Topen_mode = rf->rf_mode;
+	} else {
+		/* The first walk starts at the root; the rest continue. */
+		rf->rf_rtype = Rwalk;
+		t.p9msg_Twalk.Twalk_fid = rf->rf_nwalked == 0 ?
+		    P9FS_CONN_ROOTFID(conn) : rf->rf_fid;
+		t.p9msg_Twalk.Twalk_newfid = rf->rf_fid;
+		rf->rf_nsent = MIN(rf->rf_nwname - rf->rf_nwalked,
+		    P9_MAXWELEM);
+		rf->rf_off += p9fs_client_wnames(&t.p9msg_Twalk.Twalk_wnames,
+		    rf->rf_path + rf->rf_off, rf->rf_nsent);
+	}
+	m = p9fs_msg_build(type, p9fs_gettag(p9s), &t);
+	if (m == NULL)
+		return (ENOBUFS);
+
+	mtx_lock(&p9s->p9s_lock);
+	pr->pr_pending++;
+	mtx_unlock(&p9s->p9s_lock);
+	error = p9fs_msg_send_async(p9s, conn, m, p9fs_client_replay_done, rf);
+	if (error != 0) {
+		mtx_lock(&p9s->p9s_lock);
+		pr->pr_pending--;
+		mtx_unlock(&p9s->p9s_lock);
+	}
+	return (error);
+}
+
+static void
+p9fs_client_replay_wait(struct p9fs_session *p9s, struct p9fs_replay *pr)
+{
+
+	mtx_lock(&p9s->p9s_lock);
+	while (pr->pr_pending > 0)
+		(void) msleep(pr, &p9s->p9s_lock, 0, "p9replay", 0);
+	mtx_unlock(&p9s->p9s_lock);
+}
+
+int
+p9fs_client_replay(struct p9fs_session *p9s, struct p9fs_conn *conn)
+{
+	struct p9fs_replay pr;
+	struct p9fs_replay_fid *rf;
+	struct p9fs_fidrec_bucket *frb;
+	struct p9fs_fidrec *fr;
+	int error, more;
+	u_int i;
+
+	/*
+	 * Take a copy of each of the connection's records, since they may
+	 * be dropped while this runs.
+	 */
+	STAILQ_INIT(&pr.pr_fids);
+	pr.pr_pending = 0;
+	for (i = 0; i < P9FS_FIDREC_BUCKETS; i++) {
+		frb = &p9s->p9s_fidrecs[i];
+		mtx_lock(&frb->frb_lock);
+		LIST_FOREACH(fr, &frb->frb_head, fr_link) {
+			if (P9FS_FID_CONN(p9s, fr->fr_fid) != conn->p9c_index)
+				continue;
+			rf = malloc(sizeof (*rf) + fr->fr_pathlen, M_TEMP,
+			    M_NOWAIT | M_ZERO);
+			if (rf == NULL) {
+				printf("p9fs: no memory to restore fid %u\n",
+				    fr->fr_fid);
+				continue;
+			}
+			rf->rf_replay = &pr;
+			rf->rf_fid = fr->fr_fid;
+			rf->rf_mode = fr->fr_mode;
+			rf->rf_qid = fr->fr_qid;
+			rf->rf_nwname = fr->fr_nwname;
+			bcopy(fr->fr_path, rf->rf_path, fr->fr_pathlen);
+			STAILQ_INSERT_TAIL(&pr.pr_fids, rf, rf_link);
+		}
+		mtx_unlock(&frb->frb_lock);
+	}
+
+	/*
+	 * Walk, one round of up to P9_MAXWELEM names per fid at a time.  A
+	 * reply may update its fid as soon as the walk is sent, so whether
+	 * another round is needed is only decided once they are all in.
+	 */
+	error = 0;
+	do {
+		STAILQ_FOREACH(rf, &pr.pr_fids, rf_link) {
+			/* Skip fids that failed, or are done walking. */
+			if (rf->rf_error != 0 || (rf->rf_rtype == Rwalk &&
+			    rf->rf_nwalked == rf->rf_nwname))
+				continue;
+			error = p9fs_client_replay_send(p9s, conn, rf, Twalk);
+			if (error != 0)
+				break;
+		}
+		p9fs_client_replay_wait(p9s, &pr);
+
+		more = 0;
+		mtx_lock(&p9s->p9s_lock);
+		STAILQ_FOREACH(rf, &pr.pr_fids, rf_link) {
+			if (rf->rf_error == 0 && rf->rf_nwalked < rf->rf_nwname)
+				more = 1;
+		}
+		mtx_unlock(&p9s->p9s_lock);
+	} while (error == 0 && more);
+
+	STAILQ_FOREACH(rf, &pr.pr_fids, rf_link) {
+		if (error != 0)
+			break;
+		if (rf->rf_error == 0 && rf->rf_mode != -1)
+			error = p9fs_client_replay_send(p9s, conn, rf, Topen);
+	}
+	p9fs_client_replay_wait(p9s, &pr);
+
+	while ((rf = STAILQ_FIRST(&pr.pr_fids)) != NULL) {
+		STAILQ_REMOVE_HEAD(&pr.pr_fids, rf_link);
+		if (error == 0 && rf->rf_error != 0)
+			printf("p9fs: could not restore fid %u: error %d\n",
+			    rf->rf_fid, rf->rf_error);
+		free(rf, M_TEMP);
 	}
 
 	return (error);
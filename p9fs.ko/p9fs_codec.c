@@ -0,0 +1,916 @@
+/*-
+ * Copyright (c) 2015 Will Andrews.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Plan9 filesystem (9P2000.u) message codec.
+ *
+ * Nothing here knows any particular message.  Each field kind has a size,
+ * an encode, a decode and a print function, and each message is a case in
+ * the switches below, generated from its field list in p9fs_proto.h, that
+ * calls them for its fields in order.
+ *
+ * Encoding writes straight into the single allocation made by
+ * p9fs_msg_create(), since the size is known up front.  Decoding walks the
+ * mbuf chain as it was received, so nothing is ever made contiguous: fixed
+ * size fields are read in place, or copied out if they span mbufs, and
+ * strings and data are left where they lie.  Every field is checked against
+ * the message size; a malformed message yields EBADMSG.
+ */
+
+#ifdef _KERNEL
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/endian.h>
+#include <sys/mbuf.h>
+#include <sys/types.h>
+#include <sys/malloc.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+#include <sys/mount.h>
+#include <sys/vnode.h>
+#include <sys/counter.h>
+#include <sys/sysctl.h>
+#include <sys/callout.h>
+#include <sys/taskqueue.h>
+#else
+/* Built into the userland benchmark and fuzzer; see ../p9fs_user. */
+#include "p9fs_user.h"
+#endif
+
+#include "p9fs_proto.h"
+#include "p9fs_subr.h"
+
+static struct mbuf *p9fs_msg_alloc(int, int, int);
+
+/*
+ * A message being encoded or decoded.  Encoding fills one contiguous
+ * buffer.  Decoding moves along the chain; c_buf is then the data of the
+ * current mbuf, c_m.
+ */
+struct p9fs_cursor {
+	struct mbuf *c_m;
+	uint8_t *c_buf;
+	uint32_t c_pos;		/* Offset of the next field in c_buf. */
+	uint32_t c_len;		/* Bytes at c_buf. */
+	uint32_t c_off;		/* Offset of the next field in the message. */
+	uint32_t c_size;	/* Bytes in the whole message. */
+	int c_error;
+};
+
+/*
+ * Little endian loads and stores, at any alignment.  On little endian
+ * hosts these are plain loads and stores.
+ */
+#if BYTE_ORDER == LITTLE_ENDIAN
+#define	P9FS_LE_FUNCS(bits)						\
+static __inline uint##bits##_t						\
+p9fs_get##bits(const uint8_t *p)					\
+{									\
+	uint##bits##_t v;						\
+									\
+	memcpy(&v, p, sizeof (v));					\
+	return (v);							\
+}									\
+static __inline void							\
+p9fs_put##bits(uint8_t *p, uint##bits##_t v)				\
+{									\
+									\
+	memcpy(p, &v, sizeof (v));					\
+}
+#else
+#define	P9FS_LE_FUNCS(bits)						\
+static __inline uint##bits##_t						\
+p9fs_get##bits(const uint8_t *p)					\
+{									\
+									\
+	return (le##bits##dec(p));					\
+}									\
+static __inline void							\
+p9fs_put##bits(uint8_t *p, uint##bits##_t v)				\
+{									\
+									\
+	le##bits##enc(p, v);						\
+}
+#endif
+P9FS_LE_FUNCS(16)
+P9FS_LE_FUNCS(32)
+P9FS_LE_FUNCS(64)
+
+static __inline uint8_t
+p9fs_get8(const uint8_t *p)
+{
+
+	return (*p);
+}
+
+static __inline void
+p9fs_put8(uint8_t *p, uint8_t v)
+{
+
+	*p = v;
+}
+
+/* Start decoding the size bytes of a message at the start of m. */
+static void
+p9fs_dec_init(struct p9fs_cursor *c, struct mbuf *m, uint32_t size)
+{
+
+	c->c_m = m;
+	c->c_buf = mtod(m, uint8_t *);
+	c->c_pos = 0;
+	c->c_len = m->m_len;
+	c->c_off = 0;
+	c->c_size = size;
+	c->c_error = 0;
+}
+
+/*
+ * Check that n more bytes can be decoded.  Once a field has failed, every
+ * later one does too, so only the final error needs checking.
+ */
+static __inline int
+p9fs_dec_room(struct p9fs_cursor *c, uint32_t n)
+{
+
+	if (c->c_error == 0 && n > c->c_size - c->c_off)
+		c->c_error = EBADMSG;
+	return (c->c_error == 0);
+}
+
+/* Step over any used up (or empty) mbufs. */
+static __inline void
+p9fs_dec_next(struct p9fs_cursor *c)
+{
+
+	while (c->c_pos == c->c_len && c->c_m->m_next != NULL) {
+		c->c_m = c->c_m->m_next;
+		c->c_buf = mtod(c->c_m, uint8_t *);
+		c->c_pos = 0;
+		c->c_len = c->c_m->m_len;
+	}
+}
+
+/*
+ * Consume n bytes, copying them to buf unless it is NULL.  The bytes must
+ * have been checked with p9fs_dec_room(); the chain holds the whole message.
+ */
+static void
+p9fs_dec_skip(struct p9fs_cursor *c, void *buf, uint32_t n)
+{
+	uint32_t len;
+
+	c->c_off += n;
+	while (n > 0) {
+		p9fs_dec_next(c);
+		len = MIN(n, c->c_len - c->c_pos);
+		KASSERT(len > 0, ("p9fs: message runs past its mbuf chain"));
+		if (buf != NULL) {
+			memcpy(buf, c->c_buf + c->c_pos, len);
+			buf = (uint8_t *)buf + len;
+		}
+		c->c_pos += len;
+		n -= len;
+	}
+}
+
+/*
+ * Consume an n byte field, returning a pointer to it in place, or to a
+ * copy in buf if it spans mbufs.
+ */
+static __inline const uint8_t *
+p9fs_dec_take(struct p9fs_cursor *c, uint8_t *buf, uint32_t n)
+{
+	const uint8_t *p;
+
+	p9fs_dec_next(c);
+	if (n > c->c_len - c->c_pos) {
+		p9fs_dec_skip(c, buf, n);
+		return (buf);
+	}
+	p = c->c_buf + c->c_pos;
+	c->c_pos += n;
+	c->c_off += n;
+	return (p);
+}
+
+/* Integer kinds. */
+#define	P9FS_INT_KIND(kind, bits)					\
+static __inline size_t							\
+p9fs_size_##kind(const uint##bits##_t *v __unused)			\
+{									\
+									\
+	return (sizeof (*v));						\
+}									\
+static __inline void							\
+p9fs_enc_##kind(struct p9fs_cursor *c, const uint##bits##_t *v)	\
+{									\
+									\
+	p9fs_put##bits(c->c_buf + c->c_pos, *v);			\
+	c->c_pos += sizeof (*v);					\
+}									\
+static __inline void							\
+p9fs_dec_##kind(struct p9fs_cursor *c, uint##bits##_t *v)		\
+{									\
+	uint8_t buf[sizeof (*v)];					\
+									\
+	if (p9fs_dec_room(c, sizeof (*v)))				\
+		*v = p9fs_get##bits(p9fs_dec_take(c, buf, sizeof (*v))); \
+}									\
+static void								\
+p9fs_print_##kind(const char *name, const uint##bits##_t *v)		\
+{									\
+									\
+	printf(" %s=%ju", name, (uintmax_t)*v);				\
+}
+P9FS_INT_KIND(u8, 8)
+P9FS_INT_KIND(u16, 16)
+P9FS_INT_KIND(u32, 32)
+P9FS_INT_KIND(u64, 64)
+
+/* Strings. */
+static __inline size_t
+p9fs_size_str(const struct p9fs_str *v)
+{
+
+	return (P9FS_STR_SIZE(v->p9str_size));
+}
+
+static __inline void
+p9fs_enc_str(struct p9fs_cursor *c, const struct p9fs_str *v)
+{
+
+	p9fs_enc_u16(c, &v->p9str_size);
+	p9fs_str_copy(v, (char *)c->c_buf + c->c_pos, v->p9str_size);
+	c->c_pos += v->p9str_size;
+}
+
+/* Decoded strings are left in the chain; see p9fs_str_copy(). */
+static __inline void
+p9fs_dec_str(struct p9fs_cursor *c, struct p9fs_str *v)
+{
+
+	p9fs_dec_u16(c, &v->p9str_size);
+	if (!p9fs_dec_room(c, v->p9str_size))
+		return;
+	p9fs_dec_next(c);
+	v->p9str_m = c->c_m;
+	v->p9str_moff = c->c_pos;
+	if (v->p9str_size <= c->c_len - c->c_pos)
+		v->p9str_str = (char *)c->c_buf + c->c_pos;
+	else
+		v->p9str_str = NULL;
+	p9fs_dec_skip(c, NULL, v->p9str_size);
+}
+
+static void
+p9fs_print_str(const char *name, const struct p9fs_str *v)
+{
+	char buf[64];
+	size_t len;
+
+	len = p9fs_str_copy(v, buf, sizeof (buf));
+	printf(" %s='%.*s%s'", name, (int)len, buf,
+	    len < v->p9str_size ? "..." : "");
+}
+
+/*
+ * Copy out up to len bytes of a string, returning how many were copied.
+ * A decoded string that spans mbufs has no p9str_str, only its place in
+ * the chain, so this is how strings are read.
+ */
+size_t
+p9fs_str_copy(const struct p9fs_str *str, char *buf, size_t len)
+{
+
+	len = MIN(len, str->p9str_size);
+	if (str->p9str_str != NULL)
+		memcpy(buf, str->p9str_str, len);
+	else if (len > 0)
+		m_copydata(str->p9str_m, str->p9str_moff, len, buf);
+	return (len);
+}
+
+/* Whether a string is the given C string. */
+int
+p9fs_str_eq(const struct p9fs_str *str, const char *cstr)
+{
+	char buf[64];
+	size_t len, off;
+
+	if (str->p9str_size != strlen(cstr))
+		return (0);
+	if (str->p9str_str != NULL)
+		return (memcmp(str->p9str_str, cstr, str->p9str_size) == 0);
+	for (off = 0; off < str->p9str_size; off += len) {
+		len = MIN(sizeof (buf), str->p9str_size - off);
+		m_copydata(str->p9str_m, str->p9str_moff + off, len, buf);
+		if (memcmp(buf, cstr + off, len) != 0)
+			return (0);
+	}
+	return (1);
+}
+
+/* Generic field operations, for use with the field lists. */
+#define	P9FS_F_SIZE(P, kind, name)					\
+	size += p9fs_size_##kind(&f->P##_##name);
+#define	P9FS_F_ENC(P, kind, name)					\
+	p9fs_enc_##kind(c, &f->P##_##name);
+#define	P9FS_F_DEC(P, kind, name)					\
+	p9fs_dec_##kind(c, &f->P##_##name);
+#define	P9FS_F_PRINT(P, kind, name)					\
+	p9fs_print_##kind(#name, &f->P##_##name);
+
+/* QIDs. */
+static __inline size_t
+p9fs_size_qid(const struct p9fs_qid *f)
+{
+	size_t size = 0;
+
+	P9FS_QID_FIELDS(P9FS_F_SIZE, qid)
+	return (size);
+}
+
+static __inline void
+p9fs_enc_qid(struct p9fs_cursor *c, const struct p9fs_qid *f)
+{
+
+	P9FS_QID_FIELDS(P9FS_F_ENC, qid)
+}
+
+static __inline void
+p9fs_dec_qid(struct p9fs_cursor *c, struct p9fs_qid *f)
+{
+
+	P9FS_QID_FIELDS(P9FS_F_DEC, qid)
+}
+
+static void
+p9fs_print_qid(const char *name, const struct p9fs_qid *f)
+{
+
+	printf(" %s={", name);
+	P9FS_QID_FIELDS(P9FS_F_PRINT, qid)
+	printf(" }");
+}
+
+/*
+ * Stat entries.  These are encoded with their size field filled in, and
+ * decoded by it, so that any fields past the known ones are skipped.
+ */
+size_t
+p9fs_stat_size(const struct p9fs_stat *f)
+{
+	size_t size = 0;
+
+	P9FS_STAT_FIELDS(P9FS_F_SIZE, stat)
+	return (size);
+}
+
+static void
+p9fs_stat_enc(struct p9fs_cursor *c, const struct p9fs_stat *st)
+{
+	struct p9fs_stat stat = *st, *f = &stat;
+
+	f->stat_size = p9fs_stat_size(f) - sizeof (f->stat_size);
+	P9FS_STAT_FIELDS(P9FS_F_ENC, stat)
+}
+
+static void
+p9fs_stat_dec(struct p9fs_cursor *c, struct p9fs_stat *f)
+{
+	uint32_t end;
+
+	end = c->c_off + sizeof (f->stat_size);
+	P9FS_STAT_FIELDS(P9FS_F_DEC, stat)
+	if (c->c_error != 0)
+		return;
+	end += f->stat_size;
+	if (end < c->c_off || end > c->c_size)
+		c->c_error = EBADMSG;
+	else
+		p9fs_dec_skip(c, NULL, end - c->c_off);
+}
+
+/* stat[n]: a stat entry behind its own size. */
+static __inline size_t
+p9fs_size_stat(const struct p9fs_stat *f)
+{
+
+	return (sizeof (uint16_t) + p9fs_stat_size(f));
+}
+
+static __inline void
+p9fs_enc_stat(struct p9fs_cursor *c, const struct p9fs_stat *f)
+{
+	uint16_t n;
+
+	n = p9fs_stat_size(f);
+	p9fs_enc_u16(c, &n);
+	p9fs_stat_enc(c, f);
+}
+
+static __inline void
+p9fs_dec_stat(struct p9fs_cursor *c, struct p9fs_stat *f)
+{
+	uint32_t start;
+	uint16_t n = 0;
+
+	p9fs_dec_u16(c, &n);
+	start = c->c_off;
+	p9fs_stat_dec(c, f);
+	if (c->c_error == 0 && c->c_off - start != n)
+		c->c_error = EBADMSG;
+}
+
+static void
+p9fs_print_stat(const char *name, const struct p9fs_stat *f)
+{
+
+	printf(" %s={", name);
+	P9FS_STAT_FIELDS(P9FS_F_PRINT, stat)
+	printf(" }");
+}
+
+/* Twalk names. */
+static __inline size_t
+p9fs_size_wnames(const struct p9fs_wnames *v)
+{
+	size_t size;
+	int i;
+
+	size = sizeof (v->wn_nwname);
+	for (i = 0; i < v->wn_nwname; i++)
+		size += p9fs_size_str(&v->wn_wname[i]);
+	return (size);
+}
+
+static __inline void
+p9fs_enc_wnames(struct p9fs_cursor *c, const struct p9fs_wnames *v)
+{
+	int i;
+
+	p9fs_enc_u16(c, &v->wn_nwname);
+	for (i = 0; i < v->wn_nwname; i++)
+		p9fs_enc_str(c, &v->wn_wname[i]);
+}
+
+static __inline void
+p9fs_dec_wnames(struct p9fs_cursor *c, struct p9fs_wnames *v)
+{
+	int i;
+
+	p9fs_dec_u16(c, &v->wn_nwname);
+	if (c->c_error == 0 && v->wn_nwname > P9_MAXWELEM)
+		c->c_error = EBADMSG;
+	for (i = 0; c->c_error == 0 && i < v->wn_nwname; i++)
+		p9fs_dec_str(c, &v->wn_wname[i]);
+}
+
+static void
+p9fs_print_wnames(const char *name, const struct p9fs_wnames *v)
+{
+	char buf[64];
+	size_t len;
+	int i;
+
+	printf(" %s=[", name);
+	for (i = 0; i < v->wn_nwname; i++) {
+		len = p9fs_str_copy(&v->wn_wname[i], buf, sizeof (buf));
+		printf("%s'%.*s'", i > 0 ? " " : "", (int)len, buf);
+	}
+	printf("]");
+}
+
+/* Rwalk qids. */
+static __inline size_t
+p9fs_size_wqids(const struct p9fs_wqids *v)
+{
+	size_t size;
+	int i;
+
+	size = sizeof (v->wq_nwqid);
+	for (i = 0; i < v->wq_nwqid; i++)
+		size += p9fs_size_qid(&v->wq_qid[i]);
+	return (size);
+}
+
+static __inline void
+p9fs_enc_wqids(struct p9fs_cursor *c, const struct p9fs_wqids *v)
+{
+	int i;
+
+	p9fs_enc_u16(c, &v->wq_nwqid);
+	for (i = 0; i < v->wq_nwqid; i++)
+		p9fs_enc_qid(c, &v->wq_qid[i]);
+}
+
+static __inline void
+p9fs_dec_wqids(struct p9fs_cursor *c, struct p9fs_wqids *v)
+{
+	int i;
+
+	p9fs_dec_u16(c, &v->wq_nwqid);
+	if (c->c_error == 0 && v->wq_nwqid > P9_MAXWELEM)
+		c->c_error = EBADMSG;
+	for (i = 0; c->c_error == 0 && i < v->wq_nwqid; i++)
+		p9fs_dec_qid(c, &v->wq_qid[i]);
+}
+
+static void
+p9fs_print_wqids(const char *name, const struct p9fs_wqids *v)
+{
+	int i;
+
+	printf(" %s=[", name);
+	for (i = 0; i < v->wq_nwqid; i++)
+		printf("%s%#jx", i > 0 ? " " : "",
+		    (uintmax_t)v->wq_qid[i].qid_path);
+	printf("]");
+}
+
+/*
+ * Bulk data.  Only the count is encoded; the bytes are attached after it.
+ * Decoding leaves the bytes where they arrived, at pd_off.
+ */
+static __inline size_t
+p9fs_size_data(const struct p9fs_data *v)
+{
+
+	return (sizeof (v->pd_count));
+}
+
+static __inline void
+p9fs_enc_data(struct p9fs_cursor *c, const struct p9fs_data *v)
+{
+
+	p9fs_enc_u32(c, &v->pd_count);
+}
+
+static __inline void
+p9fs_dec_data(struct p9fs_cursor *c, struct p9fs_data *v)
+{
+
+	p9fs_dec_u32(c, &v->pd_count);
+	if (p9fs_dec_room(c, v->pd_count)) {
+		v->pd_off = c->c_off;
+		p9fs_dec_skip(c, NULL, v->pd_count);
+	}
+}
+
+static void
+p9fs_print_data(const char *name, const struct p9fs_data *v)
+{
+
+	printf(" %s=%u@%u", name, v->pd_count, v->pd_off);
+}
+
+/* Messages. */
+const char *
+p9fs_msg_name(enum p9fs_msg_type type)
+{
+
+	switch (type) {
+#define	P9FS_M_NAME(T)	case T: return (#T);
+	P9FS_MSGS(P9FS_M_NAME)
+#undef	P9FS_M_NAME
+	default:
+		return ("unknown");
+	}
+}
+
+/* Encoded size of the fields of a message, not counting its header. */
+size_t
+p9fs_msg_fields_size(enum p9fs_msg_type type, const void *fields)
+{
+	size_t size = 0;
+
+	switch (type) {
+#define	P9FS_M_SIZE(T)							\
+	case T: {							\
+		const struct p9fs_msg_##T *f = fields;			\
+									\
+		(void)f;						\
+		P9FS_MSG_##T(P9FS_F_SIZE, T)				\
+		break;							\
+	}
+	P9FS_MSGS(P9FS_M_SIZE)
+#undef	P9FS_M_SIZE
+	default:
+		break;
+	}
+	return (size);
+}
+
+static void
+p9fs_msg_enc(struct p9fs_cursor *c, enum p9fs_msg_type type,
+    const void *fields)
+{
+
+	switch (type) {
+#define	P9FS_M_ENC(T)							\
+	case T: {							\
+		const struct p9fs_msg_##T *f = fields;			\
+									\
+		(void)f;						\
+		P9FS_MSG_##T(P9FS_F_ENC, T)				\
+		break;							\
+	}
+	P9FS_MSGS(P9FS_M_ENC)
+#undef	P9FS_M_ENC
+	default:
+		break;
+	}
+}
+
+static void
+p9fs_msg_dec(struct p9fs_cursor *c, enum p9fs_msg_type type, void *fields,
+    uint16_t tag)
+{
+
+	switch (type) {
+#define	P9FS_M_DEC(T)							\
+	case T: {							\
+		struct p9fs_msg_##T *f = fields;			\
+									\
+		f->T##_tag = tag;					\
+		P9FS_MSG_##T(P9FS_F_DEC, T)				\
+		break;							\
+	}
+	P9FS_MSGS(P9FS_M_DEC)
+#undef	P9FS_M_DEC
+	default:
+		c->c_error = EBADMSG;
+		break;
+	}
+}
+
+/*
+ * Build a message from the in-core structure for its type, e.g. a struct
+ * p9fs_msg_Tread for Tread.  The message is ready for p9fs_msg_send*(),
+ * once any data has been attached with p9fs_msg_add*().  Returns NULL if
+ * the fields do not fit in one cluster.
+ */
+void *
+p9fs_msg_build(enum p9fs_msg_type type, uint16_t tag, const void *fields)
+{
+	struct p9fs_cursor c;
+	struct mbuf *m;
+	size_t size;
+
+	size = p9fs_msg_fields_size(type, fields);
+	m = p9fs_msg_create(type, tag, size);
+	if (m == NULL)
+		return (NULL);
+	if (M_TRAILINGSPACE(m) < 0 ||
+	    (size_t)M_TRAILINGSPACE(m) < size) {
+		m_freem(m);
+		return (NULL);
+	}
+
+	c.c_buf = mtod(m, uint8_t *) + m->m_len;
+	c.c_pos = 0;
+	c.c_len = size;
+	p9fs_msg_enc(&c, type, fields);
+	KASSERT(c.c_pos == size, ("p9fs: %s encoded %u of %zu bytes",
+	    p9fs_msg_name(type), c.c_pos, size));
+	m->m_len += size;
+	m->m_pkthdr.len += size;
+	return (m);
+}
+
+/* Decode a message's header; it need not be contiguous. */
+void
+p9fs_msg_hdr(void *mp, struct p9fs_msg_hdr *hdr)
+{
+	uint8_t buf[P9_HDRSZ];
+
+	m_copydata(mp, 0, sizeof (buf), (void *)buf);
+	hdr->hdr_size = p9fs_get32(buf);
+	hdr->hdr_type = p9fs_get8(buf + sizeof (hdr->hdr_size));
+	hdr->hdr_tag = p9fs_get16(buf + sizeof (hdr->hdr_size) +
+	    sizeof (hdr->hdr_type));
+}
+
+/*
+ * Decode a message of the given type, in whatever mbufs it arrived in,
+ * into its in-core structure.  Strings and data are left in the message,
+ * so it must outlive their use.
+ */
+int
+p9fs_msg_parse(void *mp, enum p9fs_msg_type type, void *fields)
+{
+	struct mbuf *m = mp;
+	struct p9fs_msg_hdr hdr;
+	struct p9fs_cursor c;
+	u_int len;
+
+	len = m_length(m, NULL);
+	if (len < P9_HDRSZ)
+		return (EBADMSG);
+	p9fs_msg_hdr(m, &hdr);
+	if (hdr.hdr_type != type || hdr.hdr_size < P9_HDRSZ ||
+	    hdr.hdr_size > len)
+		return (EBADMSG);
+
+	p9fs_dec_init(&c, m, hdr.hdr_size);
+	p9fs_dec_skip(&c, NULL, P9_HDRSZ);
+	p9fs_msg_dec(&c, type, fields, hdr.hdr_tag);
+	return (c.c_error);
+}
+
+/* Print a message, field by field, for debugging. */
+void
+p9fs_msg_print(void *mp)
+{
+	union p9fs_msg msg;
+	struct p9fs_msg_hdr hdr;
+	int error;
+
+	p9fs_msg_hdr(mp, &hdr);
+	printf("p9fs: %s tag=%u size=%u", p9fs_msg_name(hdr.hdr_type),
+	    hdr.hdr_tag, hdr.hdr_size);
+	error = p9fs_msg_parse(mp, hdr.hdr_type, &msg);
+	if (error != 0) {
+		printf(" (malformed)\n");
+		return;
+	}
+
+	switch (hdr.hdr_type) {
+#define	P9FS_M_PRINT(T)							\
+	case T: {							\
+		const struct p9fs_msg_##T *f = &msg.p9msg_##T;		\
+									\
+		(void)f;						\
+		P9FS_MSG_##T(P9FS_F_PRINT, T)				\
+		break;							\
+	}
+	P9FS_MSGS(P9FS_M_PRINT)
+#undef	P9FS_M_PRINT
+	default:
+		break;
+	}
+	printf("\n");
+}
+
+/*
+ * Append a bare stat entry, as directories read, to a message.  The entry
+ * is kept in one mbuf, since it is encoded in place.
+ */
+int
+p9fs_stat_pack(void *mp, const struct p9fs_stat *st)
+{
+	struct mbuf *m = mp, *n;
+	struct p9fs_cursor c;
+	size_t size;
+
+	size = p9fs_stat_size(st);
+	n = m_last(m);
+	if (M_TRAILINGSPACE(n) < 0 ||
+	    (size_t)M_TRAILINGSPACE(n) < size) {
+		n->m_next = p9fs_msg_alloc(size, M_WAITOK, 0);
+		if (n->m_next == NULL)
+			return (EMSGSIZE);
+		n = n->m_next;
+	}
+
+	c.c_buf = mtod(n, uint8_t *) + n->m_len;
+	c.c_pos = 0;
+	c.c_len = size;
+	p9fs_stat_enc(&c, st);
+	n->m_len += size;
+	m->m_pkthdr.len += size;
+	return (0);
+}
+
+/*
+ * Decode the bare stat entry at *offp in a message, which must end by end.
+ * On success, *offp is advanced past it.
+ */
+int
+p9fs_stat_parse(void *mp, size_t *offp, size_t end, struct p9fs_stat *st)
+{
+	struct mbuf *m = mp;
+	struct p9fs_cursor c;
+
+	if (*offp > end || end > m_length(m, NULL))
+		return (EBADMSG);
+	p9fs_dec_init(&c, m, end);
+	p9fs_dec_skip(&c, NULL, *offp);
+	p9fs_stat_dec(&c, st);
+	if (c.c_error == 0)
+		*offp = c.c_off;
+	return (c.c_error);
+}
+
+/*
+ * Message buffers.  Each message is an mbuf chain with a packet header, so
+ * it can be handed to the socket layer as is; the fields are encoded and
+ * decoded above.  Nothing here depends on a session, so this part of the
+ * message layer also builds in userland.
+ */
+
+/*
+ * Allocate an mbuf, or the smallest cluster, that holds len bytes.
+ * m_get2() stops at a page; larger messages take a jumbo cluster.  Returns
+ * NULL if len exceeds the largest cluster.
+ */
+static struct mbuf *
+p9fs_msg_alloc(int len, int how, int flags)
+{
+	int size;
+
+	if (len <= MJUMPAGESIZE)
+		return (m_get2(len, how, MT_DATA, flags));
+	if (len <= MJUM9BYTES)
+		size = MJUM9BYTES;
+	else if (len <= MJUM16BYTES)
+		size = MJUM16BYTES;
+	else
+		return (NULL);
+	return (m_getjcl(how, MT_DATA, flags, size));
+}
+
+/*
+ * Start a message whose fields, after the header, total size bytes.  The
+ * whole message is allocated at once from the smallest mbuf or cluster that
+ * holds it, so the p9fs_msg_add*() calls that follow only copy.  The size is
+ * a hint: anything past it grows the chain, and bulk payloads attached by
+ * p9fs_msg_add_uio() need not be counted.
+ */
+void *
+p9fs_msg_create(enum p9fs_msg_type p9_type, uint16_t tag, size_t size)
+{
+	struct mbuf *m;
+	uint8_t *p;
+
+	size += P9_HDRSZ;
+	m = p9fs_msg_alloc(MIN(size, MJUM16BYTES), M_WAITOK, M_PKTHDR);
+
+	/*
+	 * Reserve the size field up front; p9fs_msg_send() fills it in.
+	 * This keeps the header at the same offsets in requests and replies.
+	 */
+	p = mtod(m, uint8_t *);
+	le32enc(p, 0);
+	p[sizeof (uint32_t)] = p9_type;
+	le16enc(p + sizeof (uint32_t) + sizeof (uint8_t), tag);
+	m->m_len = m->m_pkthdr.len = P9_HDRSZ;
+
+	return (m);
+}
+
+/*
+ * Append len bytes to the message.  This normally fits in the space set
+ * aside by p9fs_msg_create(); if not, the rest goes in clusters sized to fit.
+ */
+int
+p9fs_msg_add(void *mp, size_t len, void *cp)
+{
+	struct mbuf *m = mp;
+	struct mbuf *n;
+	size_t l;
+
+	m->m_pkthdr.len += len;
+	n = m_last(m);
+	while (len > 0) {
+		if (M_TRAILINGSPACE(n) <= 0) {
+			if (n->m_next == NULL)
+				n->m_next = m_getm2(NULL, len, M_WAITOK,
+				    MT_DATA, 0);
+			n = n->m_next;
+			continue;
+		}
+		l = MIN((size_t)M_TRAILINGSPACE(n), len);
+		bcopy(cp, mtod(n, char *) + n->m_len, l);
+		n->m_len += l;
+		cp = (char *)cp + l;
+		len -= l;
+	}
+	return (0);
+}
@@ -263,23 +263,17 @@ enum p9fs_msg_type {
 	Rwstat,
 };
 
-/* All 9P2000* messages are prefixed with: size[4] <Type> tag[2] */
+/*
+ * All 9P2000* messages are prefixed with: size[4] <Type> tag[2].  Like
+ * every structure below, this is the decoded, in-core form; nothing is
+ * ever laid over the wire format.  See p9fs_codec.c.
+ */
 struct p9fs_msg_hdr {
 	uint32_t	hdr_size;
 	uint8_t		hdr_type;
 	uint16_t	hdr_tag;
-} __attribute__((packed));
-
-/*
- * Common structures for 9P2000 message payload items.
- */
-
-/* QID: Unique identification for the file being accessed */
-struct p9fs_qid {
-	uint8_t qid_mode;
-	uint32_t qid_version;
-	uint64_t qid_path;
-} __attribute__((packed));
+};
+#define	P9_HDRSZ	7	/* Encoded size of the header. */
 
 enum p9fs_qid_type {
 	QTDIR =		0x80,
@@ -312,231 +306,168 @@ enum p9fs_mode {
 	P9MODEUPPER =	0xffff0000,
 };
 
-/* Plan9-specific stat structure */
-struct p9fs_stat {
-	uint16_t stat_size;
-	uint16_t stat_type;
-	uint32_t stat_dev;
-	struct p9fs_qid stat_qid;
-	uint32_t stat_mode;
-	uint32_t stat_atime;
-	uint32_t stat_mtime;
-	uint64_t stat_length;
-	/* stat_name[s] */
-	/* stat_uid[s] */
-	/* stat_gid[s] */
-	/* stat_muid[s] */
-} __attribute__((packed));
-
-/* This is the stat addendum for 9P2000.u vs 9P2000 */
-struct p9fs_stat_u {
-	struct p9fs_stat u_stat;
-	/* extension[s] */
-	/* p9fs_stat_u_footer */
-} __attribute__((packed));
-
-struct p9fs_stat_u_footer {
-	uint32_t n_uid;
-	uint32_t n_gid;
-	uint32_t n_muid;
-} __attribute__((packed));
-
 /*
- * Basic structures for 9P2000 message types.
+ * Message specifications.
+ *
+ * Each message's fields, after the header, are listed here once, in wire
+ * order, as F(prefix, kind, name).  The in-core structures below and the
+ * whole codec (sizing, encoding, decoding and printing) are generated from
+ * these lists, so a new message needs only its list and a P9FS_MSGS entry.
+ * All integers are little endian on the wire.
  *
- * Aside from Rerror and Tcreate, all variable length fields follow fixed
- * length fields.
+ * Field kinds, and their in-core types:
+ *   u8, u16, u32, u64	the same-sized unsigned integer
+ *   str		string, size[2] then the bytes (struct p9fs_str)
+ *   qid		qid[13] (struct p9fs_qid)
+ *   stat		stat[n], n[2] then one stat entry (struct p9fs_stat)
+ *   wnames		nwname[2] then nwname*(wname[s]) (struct p9fs_wnames)
+ *   wqids		nwqid[2] then nwqid*(qid[13]) (struct p9fs_wqids)
+ *   data		count[4] then count bytes (struct p9fs_data); the bytes
+ *			are attached or consumed separately, so data must be
+ *			the last field
+ *
+ * Decoded strings are left in the message, and are not NUL-terminated;
+ * read them with p9fs_str_copy() or p9fs_str_eq().
  */
 
-struct p9fs_msg_Tversion {
-	struct p9fs_msg_hdr Tversion_hdr;
-	uint32_t Tversion_max_size;
-	/* Tversion_version[s] */
-} __attribute__((packed));
-
-struct p9fs_msg_Rversion {
-	struct p9fs_msg_hdr Rversion_hdr;
-	uint32_t Rversion_max_size;
-	/* Rversion_version[s] */
-} __attribute__((packed));
-
-struct p9fs_msg_Tauth {
-	struct p9fs_msg_hdr Tauth_hdr;
-	uint32_t Tauth_afid;
-	/* Tauth_uname[s] */
-	/* Tauth_aname[s] */
-} __attribute__((packed));
-
-struct p9fs_msg_Rauth {
-	struct p9fs_msg_hdr Rauth_hdr;
-	struct p9fs_qid Rauth_aqid;
-} __attribute__((packed));
-
-struct p9fs_msg_Tattach {
-	struct p9fs_msg_hdr Tattach_hdr;
-	uint32_t Tattach_fid;
-	uint32_t Tattach_afid;
-	/* Tattach_uname[s] */
-	/* Tattach_aname[s] */
-} __attribute__((packed));
-
-struct p9fs_msg_Rattach {
-	struct p9fs_msg_hdr Rattach_hdr;
-	struct p9fs_qid Rattach_qid;
-} __attribute__((packed));
-
-struct p9fs_msg_Rerror {
-	struct p9fs_msg_hdr Rerror_hdr;
-	/* Rerror_ename[s] */
-	uint32_t Rerror_errno;
-} __attribute__((packed));
-
-struct p9fs_msg_Tflush {
-	struct p9fs_msg_hdr Tflush_hdr;
-	uint16_t Tflush_oldtag;
-} __attribute__((packed));
-
-struct p9fs_msg_Rflush {
-	struct p9fs_msg_hdr Rflush_hdr;
-} __attribute__((packed));
-
-struct p9fs_msg_Twalk {
-	struct p9fs_msg_hdr Twalk_hdr;
-	uint32_t Twalk_fid;
-	uint32_t Twalk_newfid;
-	uint16_t Twalk_nwname;
-	/* Twalk_wname[s][] */
-} __attribute__((packed));
-
-struct p9fs_msg_Rwalk {
-	struct p9fs_msg_hdr Rwalk_hdr;
-	uint16_t Rwalk_nwqid;
-	/* struct p9fs_qid Rwalk_nwqid[] */
-} __attribute__((packed));
-
-struct p9fs_msg_Topen {
-	struct p9fs_msg_hdr Topen_hdr;
-	uint32_t Topen_fid;
-	uint8_t Topen_mode;
-} __attribute__((packed));
-
-struct p9fs_msg_Ropen {
-	struct p9fs_msg_hdr Ropen_hdr;
-	struct p9fs_qid Ropen_qid;
-	uint32_t Ropen_iounit;
-} __attribute__((packed));
-
-struct p9fs_msg_Tcreate {
-	struct p9fs_msg_hdr Tcreate_hdr;
-	uint32_t Tcreate_fid;
-	/* Tcreate_name[s] */
-	uint32_t Tcreate_perm;
-	uint8_t Tcreate_mode;
-} __attribute__((packed));
-
-struct p9fs_msg_Rcreate {
-	struct p9fs_msg_hdr Rcreate_hdr;
-	struct p9fs_qid Rcreate_qid;
-	uint32_t Rcreate_iounit;
-} __attribute__((packed));
-
-struct p9fs_msg_Tread {
-	struct p9fs_msg_hdr Tread_hdr;
-	uint32_t Tread_fid;
-	uint64_t Tread_offset;
-	uint32_t Tread_count;
-} __attribute__((packed));
-
-struct p9fs_msg_Rread {
-	struct p9fs_msg_hdr Rread_hdr;
-	uint32_t Rread_count;
-	/* uint8_t data[count] */
-} __attribute__((packed));
-
-struct p9fs_msg_Twrite {
-	struct p9fs_msg_hdr Twrite_hdr;
-	uint32_t Twrite_fid;
-	uint64_t Twrite_offset;
-	uint32_t Twrite_count;
-	/* uint8_t data[count] */
-} __attribute__((packed));
-
-struct p9fs_msg_Rwrite {
-	struct p9fs_msg_hdr Rwrite_hdr;
-	uint32_t Rwrite_count;
-} __attribute__((packed));
-
-struct p9fs_msg_Tclunk {
-	struct p9fs_msg_hdr Tclunk_hdr;
-	uint32_t Tclunk_fid;
-} __attribute__((packed));
-
-struct p9fs_msg_Rclunk {
-	struct p9fs_msg_hdr Rclunk_hdr;
-} __attribute__((packed));
-
-struct p9fs_msg_Tremove {
-	struct p9fs_msg_hdr Tremove_hdr;
-	uint32_t Tremove_fid;
-} __attribute__((packed));
-
-struct p9fs_msg_Rremove {
-	struct p9fs_msg_hdr Rremove_hdr;
-} __attribute__((packed));
-
-struct p9fs_msg_Tstat {
-	struct p9fs_msg_hdr Tstat_hdr;
-	uint32_t Tstat_fid;
-} __attribute__((packed));
-
-struct p9fs_msg_Rstat {
-	struct p9fs_msg_hdr Rstat_hdr;
-	struct p9fs_stat Rstat_stat;
-} __attribute__((packed));
-
-struct p9fs_msg_Twstat {
-	struct p9fs_msg_hdr Twstat_hdr;
-	uint32_t Twstat_fid;
-	struct p9fs_stat Twstat_stat;
-} __attribute__((packed));
-
-struct p9fs_msg_Rwstat {
-	struct p9fs_msg_hdr Rwstat_hdr;
-} __attribute__((packed));
+/* QID: Unique identification for the file being accessed */
+#define	P9FS_QID_FIELDS(F, P)						\
+	F(P, u8, mode)							\
+	F(P, u32, version)						\
+	F(P, u64, path)
+
+/*
+ * Plan9 stat entry, with the 9P2000.u extension[s] and numeric ids.  The
+ * size field counts the bytes that follow it; entries may be longer than
+ * this list, and the rest is skipped.
+ */
+#define	P9FS_STAT_FIELDS(F, P)						\
+	F(P, u16, size)							\
+	F(P, u16, type)							\
+	F(P, u32, dev)							\
+	F(P, qid, qid)							\
+	F(P, u32, mode)							\
+	F(P, u32, atime)						\
+	F(P, u32, mtime)						\
+	F(P, u64, length)						\
+	F(P, str, name)							\
+	F(P, str, uid)							\
+	F(P, str, gid)							\
+	F(P, str, muid)							\
+	F(P, str, extension)						\
+	F(P, u32, n_uid)						\
+	F(P, u32, n_gid)						\
+	F(P, u32, n_muid)
+
+#define	P9FS_MSG_Tversion(F, P)	F(P, u32, max_size) F(P, str, version)
+#define	P9FS_MSG_Rversion(F, P)	F(P, u32, max_size) F(P, str, version)
+#define	P9FS_MSG_Tauth(F, P)						\
+	F(P, u32, afid) F(P, str, uname) F(P, str, aname) F(P, u32, n_uname)
+#define	P9FS_MSG_Rauth(F, P)	F(P, qid, aqid)
+#define	P9FS_MSG_Tattach(F, P)						\
+	F(P, u32, fid) F(P, u32, afid) F(P, str, uname) F(P, str, aname) \
+	F(P, u32, n_uname)
+#define	P9FS_MSG_Rattach(F, P)	F(P, qid, qid)
+#define	P9FS_MSG_Rerror(F, P)	F(P, str, ename) F(P, u32, errnum)
+#define	P9FS_MSG_Tflush(F, P)	F(P, u16, oldtag)
+#define	P9FS_MSG_Rflush(F, P)
+#define	P9FS_MSG_Twalk(F, P)						\
+	F(P, u32, fid) F(P, u32, newfid) F(P, wnames, wnames)
+#define	P9FS_MSG_Rwalk(F, P)	F(P, wqids, wqids)
+#define	P9FS_MSG_Topen(F, P)	F(P, u32, fid) F(P, u8, mode)
+#define	P9FS_MSG_Ropen(F, P)	F(P, qid, qid) F(P, u32, iounit)
+#define	P9FS_MSG_Tcreate(F, P)						\
+	F(P, u32, fid) F(P, str, name) F(P, u32, perm) F(P, u8, mode)	\
+	F(P, str, extension)
+#define	P9FS_MSG_Rcreate(F, P)	F(P, qid, qid) F(P, u32, iounit)
+#define	P9FS_MSG_Tread(F, P)						\
+	F(P, u32, fid) F(P, u64, offset) F(P, u32, count)
+#define	P9FS_MSG_Rread(F, P)	F(P, data, data)
+#define	P9FS_MSG_Twrite(F, P)						\
+	F(P, u32, fid) F(P, u64, offset) F(P, data, data)
+#define	P9FS_MSG_Rwrite(F, P)	F(P, u32, count)
+#define	P9FS_MSG_Tclunk(F, P)	F(P, u32, fid)
+#define	P9FS_MSG_Rclunk(F, P)
+#define	P9FS_MSG_Tremove(F, P)	F(P, u32, fid)
+#define	P9FS_MSG_Rremove(F, P)
+#define	P9FS_MSG_Tstat(F, P)	F(P, u32, fid)
+#define	P9FS_MSG_Rstat(F, P)	F(P, stat, stat)
+#define	P9FS_MSG_Twstat(F, P)	F(P, u32, fid) F(P, stat, stat)
+#define	P9FS_MSG_Rwstat(F, P)
+
+/* Every message, as X(type). */
+#define	P9FS_MSGS(X)							\
+	X(Tversion) X(Rversion) X(Tauth) X(Rauth) X(Tattach) X(Rattach)	\
+	X(Rerror) X(Tflush) X(Rflush) X(Twalk) X(Rwalk) X(Topen) X(Ropen) \
+	X(Tcreate) X(Rcreate) X(Tread) X(Rread) X(Twrite) X(Rwrite)	\
+	X(Tclunk) X(Rclunk) X(Tremove) X(Rremove) X(Tstat) X(Rstat)	\
+	X(Twstat) X(Rwstat)
+
+/* Most path elements a single Twalk may carry. */
+#define	P9_MAXWELEM	16
+
+/* In-core types of the field kinds. */
+struct p9fs_str {
+	uint16_t p9str_size;
+	char *p9str_str;	/* NULL if decoded and split across mbufs. */
+	struct mbuf *p9str_m;	/* Decoded only: the mbuf it starts in, */
+	uint32_t p9str_moff;	/* and where. */
+};
+/* Encoded size of a string of len bytes: size[2] followed by the bytes. */
+#define	P9FS_STR_SIZE(len)	(sizeof (uint16_t) + (len))
+
+#define	P9FS_CTYPE_u8		uint8_t
+#define	P9FS_CTYPE_u16		uint16_t
+#define	P9FS_CTYPE_u32		uint32_t
+#define	P9FS_CTYPE_u64		uint64_t
+#define	P9FS_CTYPE_str		struct p9fs_str
+#define	P9FS_CTYPE_qid		struct p9fs_qid
+#define	P9FS_CTYPE_stat		struct p9fs_stat
+#define	P9FS_CTYPE_wnames	struct p9fs_wnames
+#define	P9FS_CTYPE_wqids	struct p9fs_wqids
+#define	P9FS_CTYPE_data		struct p9fs_data
+
+#define	P9FS_FIELD_DECL(P, kind, name)	P9FS_CTYPE_##kind P##_##name;
+
+struct p9fs_qid {
+	P9FS_QID_FIELDS(P9FS_FIELD_DECL, qid)
+};
+
+struct p9fs_stat {
+	P9FS_STAT_FIELDS(P9FS_FIELD_DECL, stat)
+};
+
+struct p9fs_wnames {
+	uint16_t wn_nwname;
+	struct p9fs_str wn_wname[P9_MAXWELEM];
+};
+
+struct p9fs_wqids {
+	uint16_t wq_nwqid;
+	struct p9fs_qid wq_qid[P9_MAXWELEM];
+};
+
+struct p9fs_data {
+	uint32_t pd_count;
+	uint32_t pd_off;	/* Decoded only: offset of the bytes. */
+};
 
 /*
- * The main 9P message management structure.
+ * One structure per message, e.g. struct p9fs_msg_Tread with Tread_fid,
+ * Tread_offset and Tread_count.  The tag is filled in by the decoder; the
+ * encoder takes it separately.
  */
+#define	P9FS_MSG_DECL(T)						\
+	struct p9fs_msg_##T {						\
+		uint16_t T##_tag;					\
+		P9FS_MSG_##T(P9FS_FIELD_DECL, T)			\
+	};
+P9FS_MSGS(P9FS_MSG_DECL)
+
+#define	P9FS_MSG_MEMBER(T)	struct p9fs_msg_##T p9msg_##T;
 union p9fs_msg {
-	struct p9fs_msg_hdr p9msg_hdr;
-	struct p9fs_msg_Tversion p9msg_Tversion;
-	struct p9fs_msg_Rversion p9msg_Rversion;
-	struct p9fs_msg_Tauth p9msg_Tauth;
-	struct p9fs_msg_Rauth p9msg_Rauth;
-	struct p9fs_msg_Tattach p9msg_Tattach;
-	struct p9fs_msg_Rattach p9msg_Rattach;
-	struct p9fs_msg_Rerror p9msg_Rerror;
-	struct p9fs_msg_Tflush p9msg_Tflush;
-	struct p9fs_msg_Rflush p9msg_Rflush;
-	struct p9fs_msg_Twalk p9msg_Twalk;
-	struct p9fs_msg_Rwalk p9msg_Rwalk;
-	struct p9fs_msg_Topen p9msg_Topen;
-	struct p9fs_msg_Ropen p9msg_Ropen;
-	struct p9fs_msg_Tcreate p9msg_Tcreate;
-	struct p9fs_msg_Rcreate p9msg_Rcreate;
-	struct p9fs_msg_Tread p9msg_Tread;
-	struct p9fs_msg_Rread p9msg_Rread;
-	struct p9fs_msg_Twrite p9msg_Twrite;
-	struct p9fs_msg_Rwrite p9msg_Rwrite;
-	struct p9fs_msg_Tclunk p9msg_Tclunk;
-	struct p9fs_msg_Rclunk p9msg_Rclunk;
-	struct p9fs_msg_Tremove p9msg_Tremove;
-	struct p9fs_msg_Rremove p9msg_Rremove;
-	struct p9fs_msg_Tstat p9msg_Tstat;
-	struct p9fs_msg_Rstat p9msg_Rstat;
-	struct p9fs_msg_Twstat p9msg_Twstat;
-	struct p9fs_msg_Rwstat p9msg_Rwstat;
-} __attribute__((packed));
+	P9FS_MSGS(P9FS_MSG_MEMBER)
+};
 
 #define	NOTAG		(unsigned short)~0
 #define	NOFID		(uint32_t)~0
@@ -545,7 +476,17 @@ union p9fs_msg {
 
 #define	P9_VERS		"9P2000"
 #define	UN_VERS		P9_VERS ".u"
-#define	P9_MSG_MAX	MAXPHYS + sizeof (struct p9fs_msg_hdr)
+/*
+ * Bytes of a Tread/Twrite/Rread message that are not data, rounded up as
+ * Plan 9 does; a message of msize bytes carries msize - P9_IOHDRSZ bytes.
+ */
+#define	P9_IOHDRSZ	24
+/* Default msize requested; can be changed with the msize mount option. */
+#define	P9_MSG_MAX	(MAXPHYS + P9_IOHDRSZ)
+#define	P9FS_MSIZE_MIN	4096
+/* Datagram transports may go lower, to fit msize to the path MTU. */
+#define	P9FS_MSIZE_DGRAM_MIN	512
+#define	P9FS_MSIZE_MAX	(1024 * 1024 + P9_IOHDRSZ)
 
 #define	OREAD	0
 #define	OWRITE	1
@@ -557,41 +498,108 @@ union p9fs_msg {
  * Plan9 session details section
  **************************************************************************/
 
+/*
+ * Everything above is also used by the userland build of the message
+ * layer; the rest is the kernel client's.
+ */
+#ifdef _KERNEL
+
+#include "p9fs_stats.h"
+
+struct p9fs_conn;
+struct p9fs_session;
+
+/*
+ * Completion callback for asynchronous requests.  Called exactly once with
+ * the reply (which the callback then owns) or NULL and an error.  It runs
+ * from the receive upcall, so it must not sleep.
+ */
+typedef void (*p9fs_msg_cb)(struct p9fs_session *, void *, void *, int);
+
 struct p9fs_req {
-	TAILQ_ENTRY(p9fs_req) req_link;
+	STAILQ_ENTRY(p9fs_req) req_link;
 	uint16_t req_tag;
+	uint8_t req_type;
+	uint8_t req_resent;	/* Sent more than once (Karn). */
+	sbintime_t req_start;
+	uint32_t req_fid;	/* NOFID for Tversion and Tflush. */
+
+	/*
+	 * Lifecycle, for the slow request log; see struct p9fs_slowreq.
+	 * req_sent and req_replied are set under p9s_lock.
+	 */
+	sbintime_t req_tagwait;
+	sbintime_t req_reserved;
+	sbintime_t req_enq;
+	sbintime_t req_sent;
+	sbintime_t req_replied;
+
+	struct p9fs_conn *req_conn;
+	u_long req_size;
 	struct mbuf *req_msg;
 	int req_error;
+	p9fs_msg_cb req_cb;
+	void *req_arg;
+	struct mbuf *req_rmsg;	/* Copy kept for resending, if retryable. */
+
+	/* Retransmission on P9C_REXMT connections; under p9s_lock. */
+	struct callout req_rexmt;
+	int req_rexmt_timo;	/* Ticks; 0 if not retransmitted. */
+	int req_rexmt_due;
 };
-TAILQ_HEAD(p9fs_req_list, p9fs_req);
+STAILQ_HEAD(p9fs_req_list, p9fs_req);
 
-/* NB: This is used for in-core, not wire format. */
-struct p9fs_str {
-	uint16_t p9str_size;
-	char *p9str_str;
+/*
+ * Tag table.  Each session owns a table indexed directly by tag value, so
+ * both tag allocation and matching a reply to its request are constant
+ * time.  Free slots are threaded through ts_next, terminated by NOTAG.
+ * A slot only accepts a reply while it is P9TAG_SENT, so stale and
+ * duplicate replies are dropped without searching for their request.
+ *
+ * A request abandoned by its sender is flushed; its tag stays in
+ * P9TAG_FLUSHING, discarding any late reply, until the Rflush arrives.
+ */
+enum p9fs_tag_state {
+	P9TAG_FREE,
+	P9TAG_RESERVED,		/* Allocated by the client; not yet sent. */
+	P9TAG_SENT,		/* Sent; waiting for the reply. */
+	P9TAG_REPLIED,		/* Reply delivered; released with the reply. */
+	P9TAG_FLUSHING,		/* Abandoned; released on Rflush. */
 };
 
-/* Payload structures passed to requesters via callback.  In-core only. */
-struct p9fs_stat_payload {
-	struct p9fs_stat *pay_stat;
-	struct p9fs_str pay_name;
-	struct p9fs_str pay_uid;
-	struct p9fs_str pay_gid;
-	struct p9fs_str pay_muid;
-};
-struct p9fs_stat_u_payload {
-	struct p9fs_stat_payload upay_std;
-	struct p9fs_str upay_extension;
-	struct p9fs_stat_u_footer *upay_footer;
+struct p9fs_tag_slot {
+	struct p9fs_req *ts_req;
+	sbintime_t ts_reserved;		/* When the tag was allocated. */
+	sbintime_t ts_tagwait;		/* Time spent waiting for it. */
+	uint16_t ts_next;
+	uint8_t ts_state;
 };
 
+/* Number of tags in each session's table; must be less than NOTAG. */
+#define	P9FS_TAGS	4096
+
+/*
+ * Receive state for a socket connection, protected by the receive sockbuf
+ * lock.  p9r_msg holds the bytes received but not yet delivered, which is
+ * at most one partial record between upcalls.
+ *
+ * p9r_rcvbatch is a histogram of the messages delivered per upcall: bucket
+ * i counts upcalls that delivered 2^i to 2^(i+1)-1 of them, and the last
+ * bucket everything beyond.
+ */
+#define	P9FS_RCVBATCH_HIST	6
+
 struct p9fs_recv {
-	uint32_t p9r_resid;
-	uint32_t p9r_size;
+	uint32_t p9r_len;
 	int p9r_error;
 	int p9r_soupcalls;
 	struct mbuf *p9r_msg;
-	struct p9fs_req_list p9r_reqs;
+
+	u_long p9r_rcvcalls;		/* soreceive() calls made. */
+	u_long p9r_rcvbytes;
+	u_long p9r_rcvmsgs;		/* Messages delivered. */
+	u_long p9r_rcvdrops;		/* Malformed datagrams dropped. */
+	u_long p9r_rcvbatch[P9FS_RCVBATCH_HIST];
 };
 
 enum p9s_state {
@@ -603,6 +611,115 @@ enum p9s_state {
 
 struct p9fs_session;
 
+/*
+ * A transport connection to the server.  A session may use several of
+ * them (nconnect); each has its own socket and receive state.  Fids are
+ * only valid on the connection that created them, so each fid encodes its
+ * connection: fid % p9s_nconn is the index of the connection that owns it.
+ * Fid 'i' is that connection's root fid, attached at mount time.
+ *
+ * With the bulk option, each connection used for lookups and metadata is
+ * paired with a bulk connection, which carries only the reads and writes
+ * of open files, so that those do not delay everything else.  The bulk
+ * connections come last; see P9FS_CONN_BULK().
+ */
+struct p9fs_conn {
+	struct p9fs_session *p9c_session;
+	u_int p9c_index;
+	int p9c_connected;
+	int p9c_flags;
+
+	/* Transport state. */
+	struct socket *p9c_sock;
+	struct p9fs_recv p9c_recv;
+	void *p9c_tpriv;
+
+	/* Outstanding request load; protected by p9s_lock. */
+	u_int p9c_outreqs;
+	u_long p9c_outbytes;
+
+	/* Tversion uses NOTAG, which is per-connection. */
+	struct p9fs_tag_slot p9c_notag;
+
+	/*
+	 * Recovery after the connection is lost; see p9fs_conn_lost().
+	 * While p9c_recovering is set, only p9c_rtd may send requests.
+	 * Protected by p9s_lock.
+	 */
+	int p9c_recovering;
+	u_int p9c_lostgen;		/* Times the connection was lost. */
+	struct thread *p9c_rtd;
+	struct task p9c_rtask;
+
+	/* Retransmits due; see p9fs_req_rexmt(). */
+	struct task p9c_xtask;
+	u_long p9c_rexmits;
+
+	/* A flush went unanswered; see p9fs_client_flush(). */
+	struct task p9c_ftask;
+
+	/*
+	 * Transmit queue, linked through m_nextpkt.  Whichever thread finds
+	 * nobody sending becomes the sender and drains it, so messages that
+	 * queue up behind a sosend() go out together in the next one.
+	 * Protected by p9c_sndlock.
+	 */
+	struct mtx p9c_sndlock;
+	struct mbuf *p9c_sndq_head;
+	struct mbuf *p9c_sndq_tail;
+	u_long p9c_sndq_bytes;
+	int p9c_sndq_waiters;
+	int p9c_sending;
+	int p9c_snderror;
+	u_long p9c_sndcalls;		/* sosend() calls made. */
+	u_long p9c_sndmsgs;		/* Messages sent. */
+};
+
+/* p9c_flags */
+#define	P9C_ATOMIC	0x1	/* Send only one message at a time. */
+#define	P9C_REXMT	0x2	/* Unreliable; resend until answered. */
+
+#define	P9FS_NCONNECT_MAX	16
+#define	P9FS_CONN_MAX		(2 * P9FS_NCONNECT_MAX)
+
+/*
+ * Transport operations.  A transport carries whole messages between a
+ * connection and the server; everything else is common to all of them.
+ *
+ * pt_connect	Establish the connection, reporting errors against the
+ *		session's mount.
+ * pt_send	Send a chain of one or more complete messages, consuming it.
+ *		May block for buffer space.
+ * pt_shutdown	Stop all I/O, waking any sender blocked in pt_send.
+ * pt_close	Release the connection.  No receive callbacks may be running
+ *		or start once this returns.
+ *
+ * Transports pass each complete reply to p9fs_msg_deliver() and report a
+ * broken connection with p9fs_conn_lost().
+ */
+struct p9fs_trans {
+	const char *pt_name;
+	int (*pt_connect)(struct p9fs_conn *);
+	int (*pt_send)(struct p9fs_conn *, struct mbuf *);
+	void (*pt_shutdown)(struct p9fs_conn *);
+	void (*pt_close)(struct p9fs_conn *);
+};
+
+/*
+ * Queued messages are coalesced into one sosend() up to P9FS_SNDQ_BATCH
+ * bytes.  Senders block once P9FS_SNDQ_MAX bytes are waiting.
+ */
+#define	P9FS_SNDQ_BATCH		(32 * 1024)
+#define	P9FS_SNDQ_MAX		(256 * 1024)
+
+/* Messages per batch whose requests are stamped as sent; see req_sent. */
+#define	P9FS_SNDQ_STAMPS	64
+#define	P9FS_FID_CONN(p9s, fid)	((fid) % (p9s)->p9s_nconn)
+#define	P9FS_CONN_ROOTFID(c)	((uint32_t)(c)->p9c_index)
+#define	P9FS_FID_ROOT(p9s, fid)	((fid) < (p9s)->p9s_nconn)
+#define	P9FS_NCONN_META(p9s)	((p9s)->p9s_nconn - (p9s)->p9s_nbulk)
+#define	P9FS_CONN_BULK(p9s, i)	((i) + P9FS_NCONN_META(p9s))
+
 struct p9fs_node_user {
 	uint32_t p9nu_read_fid;
 	uint16_t p9nu_read_refs;
@@ -612,27 +729,188 @@ struct p9fs_node_user {
 	uint16_t p9nu_append_refs;
 };
 
+struct p9fs_ahead;
+
 /* A Plan9 node. */
 struct p9fs_node {
 	uint32_t p9n_fid;
 	uint32_t p9n_ofid;
 	uint32_t p9n_opens;
+	uint32_t p9n_iounit;		/* From Ropen; 0 if not given. */
 	struct p9fs_qid p9n_qid;
 	struct vnode *p9n_vnode;
 	struct p9fs_session *p9n_session;
+	struct p9fs_ahead *p9n_ahead;	/* Names walked to ahead of namei. */
+};
+
+/*
+ * Fid allocator state.  Free fid units are cached per CPU, spilling to and
+ * refilling from a session-wide list of chunks, so that the common case
+ * takes no lock.  See p9fs_getfid().
+ */
+#define	P9FS_FIDCACHE_SIZE	64
+
+struct p9fs_fid_cache {
+	u_int fc_count;
+	uint32_t fc_units[P9FS_FIDCACHE_SIZE];
+} __aligned(CACHE_LINE_SIZE);
+
+struct p9fs_fid_chunk {
+	SLIST_ENTRY(p9fs_fid_chunk) fch_link;
+	uint32_t fch_units[P9FS_FIDCACHE_SIZE];
+};
+SLIST_HEAD(p9fs_fid_chunk_list, p9fs_fid_chunk);
+
+/*
+ * What it takes to rebuild a fid on a new connection: the names walked to
+ * reach it from its connection's root fid, the qid it should lead to, and
+ * the mode it was opened in.  fr_path holds fr_nwname NUL-terminated names
+ * back to back.  Records are hashed by fid, each bucket under its own lock.
+ */
+struct p9fs_fidrec {
+	LIST_ENTRY(p9fs_fidrec) fr_link;
+	uint32_t fr_fid;
+	int fr_mode;		/* Topen mode[1], or -1 if not open. */
+	struct p9fs_qid fr_qid;	/* What the walk found. */
+	uint16_t fr_nwname;
+	uint16_t fr_pathlen;
+	char fr_path[];
+};
+
+struct p9fs_fidrec_bucket {
+	struct mtx frb_lock;
+	LIST_HEAD(, p9fs_fidrec) frb_head;
+} __aligned(CACHE_LINE_SIZE);
+
+#define	P9FS_FIDREC_BUCKETS	64
+#define	P9FS_FIDREC_BUCKET(p9s, fid)	\
+	(&(p9s)->p9s_fidrecs[(fid) % P9FS_FIDREC_BUCKETS])
+
+/*
+ * Round-trip time estimate for one message type, in microseconds; srtt is
+ * scaled by 8 and rttvar by 4, as in TCP.  See p9fs_rtt_sample().
+ */
+struct p9fs_rtt {
+	int rtt_srtt;
+	int rtt_rttvar;
+	int rtt_min;		/* Lowest sample; the uncongested RTT. */
+	u_long rtt_samples;
+};
+
+/* One estimate per T-message type, Tversion through Twstat. */
+#define	P9FS_RTT_TYPES		((Twstat - Tversion) / 2 + 1)
+#define	P9FS_RTT_INDEX(type)	(((type) - Tversion) / 2)
+
+/*
+ * An entry in the slow request log: a request that took at least the
+ * mount's slow_ms from asking for a tag to its sender being woken with the
+ * result.  Times are from sbinuptime(), except sr_tagwait, which is a
+ * duration; stages the request never reached are 0, as is sr_sent for
+ * requests sent in a batch too large to stamp them all.  The same entries,
+ * with sr_state, describe outstanding tags; see p9fs_req_outstanding().
+ */
+struct p9fs_slowreq {
+	sbintime_t sr_tagwait;	/* Waiting for a free tag... */
+	sbintime_t sr_reserved;	/* ...which was then allocated. */
+	sbintime_t sr_enq;	/* Handed to p9fs_msg_send_req(). */
+	sbintime_t sr_start;	/* Past the window and into the tag table. */
+	sbintime_t sr_sent;	/* Handed to the transport, e.g. sosend(). */
+	sbintime_t sr_replied;	/* Reply matched to the request. */
+	sbintime_t sr_done;	/* Sender woken, or callback called. */
+	uint32_t sr_fid;
+	uint16_t sr_tag;
+	uint8_t sr_type;
+	uint8_t sr_conn;
+	uint8_t sr_state;	/* Outstanding tags only. */
+	int sr_error;
 };
 
+#define	P9FS_SLOWLOG		64
+#define	P9FS_SLOWMS_DEF		1000
+
+/* Treads kept in flight by each read; see p9fs_client_readv(). */
+#define	P9FS_READS_DEF		8
+#define	P9FS_READS_MAX		32
+
+/*
+ * A request sent with p9fs_msg_send_start(), to be waited for with
+ * p9fs_msg_send_wait().
+ */
+struct p9fs_msg_sync {
+	void *ps_msg;
+	int ps_error;
+	int ps_done;
+	struct p9fs_req *ps_req;
+	int ps_timo;			/* Ticks to wait for the reply. */
+	struct p9fs_slowreq ps_slow;	/* Finished by the sender. */
+};
+
+/*
+ * Per-CPU statistics for one T-message type, indexed as the estimates
+ * are; see struct p9fs_stats_op.
+ */
+struct p9fs_opstats {
+	counter_u64_t os_requests;
+	counter_u64_t os_errors;
+	counter_u64_t os_bytes_out;
+	counter_u64_t os_bytes_in;
+	counter_u64_t os_time_us;
+	counter_u64_t os_lat[P9FS_STATS_BUCKETS];
+};
+#define	P9FS_OPSTATS_COUNTERS						\
+	(P9FS_STATS_TYPES * sizeof (struct p9fs_opstats) /		\
+	sizeof (counter_u64_t))
+
+/*
+ * Bounds on request timeouts, in milliseconds; see p9fs_rtt_timeout().
+ * P9FS_RTO_INIT is used for a message type until its first reply.
+ */
+#define	P9FS_RTO_INIT		3000
+#define	P9FS_RTOMIN_DEF		1000
+#define	P9FS_RTOMAX_DEF		60000
+
+/*
+ * Retransmission timeouts on P9C_REXMT connections, in milliseconds.  They
+ * start at srtt + 4 * rttvar, without the rtomin floor, and double with
+ * each retransmission up to rtomax.  See p9fs_req_rexmt().
+ */
+#define	P9FS_REXMT_INIT		200
+#define	P9FS_REXMT_MIN		10
+
+/*
+ * Bounds on the in-flight window; see p9fs_wnd_update().  The request
+ * window is counted in requests, the byte window in units of msize.
+ * Replies whose queueing delay, their RTT over the lowest seen for their
+ * type, exceeds both that lowest RTT and P9FS_WND_TARGET microseconds
+ * are taken as a sign of congestion.
+ */
+#define	P9FS_WND_MIN		4
+#define	P9FS_WND_INIT		32
+#define	P9FS_WND_MAX		256
+#define	P9FS_WNDB_MIN		2
+#define	P9FS_WNDB_INIT		16
+#define	P9FS_WNDB_MAX		64
+#define	P9FS_WND_TARGET		2000
+
 #define	MAXUNAMELEN	32
 struct p9fs_session {
 	enum p9s_state p9s_state;
-	struct sockaddr p9s_sockaddr;
+	const struct p9fs_trans *p9s_trans;
+	struct sockaddr_storage p9s_sockaddr;
 	struct mtx p9s_lock;
-	struct p9fs_recv p9s_recv;
 	int p9s_sockaddr_len;
-	struct socket *p9s_sock;
 	int p9s_socktype;
 	int p9s_proto;
-	int p9s_threads;
+	int p9s_threads;		/* Requests in flight. */
+	int p9s_threads_max;
+	u_long p9s_inbytes;		/* Their size, as in p9c_outbytes. */
+	uint32_t p9s_msize;		/* Requested, then negotiated. */
+	int p9s_debug;			/* Level; see P9FS_DEBUG(). */
+
+	/* Connections to the server; fids are spread across them. */
+	u_int p9s_nconn;
+	u_int p9s_nbulk;		/* Of which bulk; 0 or half. */
+	struct p9fs_conn p9s_conns[P9FS_CONN_MAX];
 
 	uint32_t p9s_uid;
 	char p9s_uname[MAXUNAMELEN];
@@ -642,34 +920,88 @@ struct p9fs_session {
 	struct mount *p9s_mount;
 	struct p9fs_node p9s_rootnp;
 
-	/* Units for fids and tags; protected by p9s_lock. */
-	struct unrhdr *p9s_fids;
-	struct unrhdr *p9s_tags;
+	/* Fid allocator; p9s_fidfree is protected by p9s_fidlock. */
+	struct p9fs_fid_cache *p9s_fidcache;	/* Indexed by CPU. */
+	struct mtx p9s_fidlock;
+	struct p9fs_fid_chunk_list p9s_fidfree;
+	uint32_t p9s_fidnext;			/* Next never-used unit. */
+	counter_u64_t p9s_fids_inuse;
+	struct p9fs_fidrec_bucket *p9s_fidrecs;
+	u_int p9s_reconnects;			/* Under p9s_lock. */
+
+	/* Per-mount sysctl tree, vfs.p9fs.<unit>. */
+	struct sysctl_ctx_list p9s_sysctl_ctx;
+	struct sysctl_oid *p9s_sysctl_tree;
+	int p9s_unit;
+
+	/* Tag table and its free list; protected by p9s_lock. */
+	struct p9fs_tag_slot *p9s_tags;
+	uint16_t p9s_tag_free;
+	uint16_t p9s_tag_free_tail;
+	int p9s_tag_waiters;
+	u_int p9s_tags_inuse;
+	u_int p9s_tags_max;
+
+	/* Per-type statistics, exported by vfs.p9fs.<unit>.stats. */
+	struct p9fs_opstats p9s_opstats[P9FS_STATS_TYPES];
+
+	/* Ring of the last slow requests; protected by p9s_lock. */
+	struct p9fs_slowreq p9s_slowlog[P9FS_SLOWLOG];
+	u_int p9s_slowlog_next;		/* Entries ever logged. */
+	u_int p9s_slowms;		/* Threshold; 0 disables the log. */
+
+	u_int p9s_reads;		/* Treads in flight per read. */
+
+	/* Request timeouts; the estimates are protected by p9s_lock. */
+	struct p9fs_rtt p9s_rtt[P9FS_RTT_TYPES];
+	u_int p9s_rtomin;
+	u_int p9s_rtomax;
+	u_int p9s_timeouts;
+
+	/*
+	 * In-flight window, protected by p9s_lock.  Senders wait while
+	 * either window is full; p9s_wnd_acked counts replies towards the
+	 * next increase, p9s_wnd_hold replies until decreasing is allowed
+	 * again.
+	 */
+	u_int p9s_wnd;
+	u_int p9s_wndb;			/* In units of msize. */
+	u_int p9s_wnd_acked;
+	u_int p9s_wnd_hold;
+	u_int p9s_wnd_waiters;
+	u_long p9s_wnd_blocks;
+	u_long p9s_wnd_blocked_us;
 };
 
-typedef int (*io_callback)(void *, uint32_t, size_t *, struct uio *);
+typedef int (*io_callback)(void **, uint32_t, size_t *, struct uio *);
 
 /* Primary 9P2000.u client API calls. */
-int p9fs_client_version(struct p9fs_session *);
+int p9fs_client_version(struct p9fs_session *, struct p9fs_conn *);
 int p9fs_client_auth(struct p9fs_session *);
-int p9fs_client_attach(struct p9fs_session *);
+int p9fs_client_attach(struct p9fs_session *, struct p9fs_conn *);
 int p9fs_client_clunk(struct p9fs_session *, uint32_t);
 int p9fs_client_error(struct p9fs_session *, void **, enum p9fs_msg_type);
-int p9fs_client_flush(void);
-int p9fs_client_open(struct p9fs_session *, uint32_t, int);
+int p9fs_client_flush(struct p9fs_session *, struct p9fs_conn *, uint16_t);
+int p9fs_client_open(struct p9fs_session *, uint32_t, int, uint32_t *);
 int p9fs_client_create(void);
-int p9fs_client_read(struct p9fs_session *, uint32_t, io_callback, struct uio *);
-int p9fs_client_write(struct p9fs_session *, uint32_t, io_callback, struct uio *);
+int p9fs_client_readv(struct p9fs_session *, uint32_t, uint32_t, u_int,
+    struct uio *);
+int p9fs_client_read(struct p9fs_session *, uint32_t, uint32_t, io_callback,
+    struct uio *);
+int p9fs_client_write(struct p9fs_session *, uint32_t, uint32_t, io_callback,
+    struct uio *);
 int p9fs_client_remove(void);
 int p9fs_client_stat(struct p9fs_session *, uint32_t, struct vattr *);
 int p9fs_client_wstat(void);
 int p9fs_client_walk(struct p9fs_session *, uint32_t, uint32_t *, size_t,
     const char *, struct p9fs_qid *);
+int p9fs_client_walk_path(struct p9fs_session *, uint32_t, uint32_t);
+int p9fs_client_walkv(struct p9fs_session *, uint32_t, uint32_t, uint32_t,
+    uint16_t, const struct p9fs_str *, struct p9fs_qid *, uint16_t *, int *);
+int p9fs_client_replay(struct p9fs_session *, struct p9fs_conn *);
 
 /* Helpers for working with API data. */
-int p9fs_client_uio_callback(void *, uint32_t, size_t *, struct uio *);
-void p9fs_client_parse_std_stat(void *, struct p9fs_stat_payload *, size_t *);
-void p9fs_client_parse_u_stat(void *, struct p9fs_stat_u_payload *, size_t *);
+int p9fs_client_uio_callback(void **, uint32_t, size_t *, struct uio *);
 
 /* Wrapper API calls. */
 int p9fs_nget(struct p9fs_session *, uint32_t, struct p9fs_qid *,
@@ -677,7 +1009,9 @@ int p9fs_nget(struct p9fs_session *, uint32_t, struct p9fs_qid *,
 int p9fs_client_getnode(struct p9fs_node *, char *, struct p9fs_node **);
 
 /* Helpers for managing tags and fids. */
-uint32_t p9fs_getfid(struct p9fs_session *);
+uint32_t p9fs_getfid(struct p9fs_session *, u_int);
 void p9fs_relfid(struct p9fs_session *, uint32_t);
 
+#endif /* _KERNEL */
+
 #endif /* __P9FS_PROTO_H__ */
@@ -0,0 +1,75 @@
+/*-
+ * Copyright (c) 2015 Will Andrews.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Plan9 filesystem per-mount statistics, as exported to userland by the
+ * vfs.p9fs.<unit>.stats sysctl and read by p9fsstat(8).
+ */
+
+#ifndef	__P9FS_STATS_H__
+#define	__P9FS_STATS_H__
+
+/* Bumped whenever struct p9fs_stats changes. */
+#define	P9FS_STATS_VERSION	1
+
+/* One set of statistics per T-message type, Tversion through Twstat. */
+#define	P9FS_STATS_TYPES	14
+#define	P9FS_STATS_NAMES {						\
+	"version", "auth", "attach", "error", "flush", "walk", "open",	\
+	"create", "read", "write", "clunk", "remove", "stat", "wstat",	\
+}
+
+/*
+ * Latency histogram buckets.  Bucket 0 counts replies in under a
+ * microsecond; bucket i, for i > 0, those taking at least 2^(i-1) and
+ * less than 2^i microseconds.  The last bucket also counts anything
+ * slower, from about 4 seconds.
+ */
+#define	P9FS_STATS_BUCKETS	24
+#define	P9FS_STATS_BUCKET(us)	MIN(flsll(us), P9FS_STATS_BUCKETS - 1)
+
+struct p9fs_stats_op {
+	uint64_t so_requests;		/* Sent. */
+	uint64_t so_errors;		/* Rerror, or failed without reply. */
+	uint64_t so_bytes_out;		/* Request sizes. */
+	uint64_t so_bytes_in;		/* Reply sizes. */
+	uint64_t so_time_us;		/* Total latency of completions. */
+	uint64_t so_lat[P9FS_STATS_BUCKETS];
+};
+
+struct p9fs_stats {
+	uint32_t ps_version;
+	uint32_t ps_inflight;		/* Requests in flight now. */
+	uint32_t ps_inflight_max;	/* And at most, since mounting. */
+	uint32_t ps_tags_inuse;		/* Tags allocated now. */
+	uint32_t ps_tags_max;		/* And at most, since mounting. */
+	uint32_t ps_pad;
+	uint64_t ps_fids_inuse;		/* Fids allocated now. */
+	uint64_t ps_timeouts;		/* Requests that timed out. */
+	struct p9fs_stats_op ps_ops[P9FS_STATS_TYPES];
+};
+
+#endif /* __P9FS_STATS_H__ */
@@ -34,20 +34,27 @@ __FBSDID("$FreeBSD$");
 
 #include <sys/param.h>
 #include <sys/systm.h>
+#include <sys/endian.h>
 #include <sys/mbuf.h>
 #include <sys/types.h>
 #include <sys/lock.h>
 #include <sys/mutex.h>
 #include <sys/socket.h>
 #include <sys/socketvar.h>
+#include <sys/protosw.h>
 #include <sys/proc.h>
 #include <sys/uio.h>
 #include <sys/kernel.h>
 #include <sys/malloc.h>
 #include <sys/mount.h>
+#include <sys/sdt.h>
 #include <netinet/in.h>
 #include <sys/limits.h>
 #include <sys/vnode.h>
+#include <sys/counter.h>
+#include <sys/sysctl.h>
+#include <sys/callout.h>
+#include <sys/taskqueue.h>
 
 #include "p9fs_proto.h"
 #include "p9fs_subr.h"
@@ -55,365 +62,1861 @@ __FBSDID("$FreeBSD$");
 static MALLOC_DEFINE(M_P9REQ, "p9fsreq", "Request structures for p9fs");
 
 /*
- * Plan 9 message handling.  This is primarily intended as a means of
- * performing marshalling/unmarshalling.
- *
- * sosend()/sorecv() perform operations using struct uio or struct mbuf,
- * which manage I/O vectors.  Since each Plan9 message can be considered a
- * vector of arbitrary data, they fit the bill.
- *
- * mbufs perform their own internal memory management and therefore are
- * probably the better fit.
- *
- * XXX: Need to figure out how to enforce little endian ordering, since that
- *      is part of the spec.
+ * DTrace probes for requests: start fires when a request is sent, done when
+ * its reply (or failure) is handed back, with the latency in nanoseconds.
+ * Replies that match no outstanding request fire reply:stale.
+ */
+SDT_PROVIDER_DEFINE(p9fs);
+SDT_PROBE_DEFINE5(p9fs, , req, start, "struct p9fs_session *", "uint8_t",
+    "uint16_t", "uint32_t", "u_long");
+SDT_PROBE_DEFINE7(p9fs, , req, done, "struct p9fs_session *", "uint8_t",
+    "uint16_t", "uint32_t", "u_int", "int", "int64_t");
+SDT_PROBE_DEFINE3(p9fs, , reply, stale, "struct p9fs_conn *", "uint8_t",
+    "uint16_t");
+
+static task_fn_t p9fs_conn_recover;
+static task_fn_t p9fs_conn_rexmt;
+static void p9fs_conn_resend(struct p9fs_conn *, int);
+static int p9fs_rtt_rexmt_locked(struct p9fs_session *, uint8_t);
+static void p9fs_req_rexmt(void *);
+static void p9fs_fidrec_drop(struct p9fs_session *, uint32_t);
+static void p9fs_msg_sync_cb(struct p9fs_session *, void *, void *, int);
+
+/*
+ * Attach count bytes from uio as the message's trailing payload.  The data
+ * is copied straight into page-sized clusters and linked on as is.
+ */
+int
+p9fs_msg_add_uio(void *mp, struct uio *uio, uint32_t count)
+{
+	struct mbuf *m = mp;
+	struct mbuf *uiom;
+
+	uiom = m_uiotombuf(uio, M_WAITOK, count, /*align*/ 0, M_PKTHDR);
+	if (uiom == NULL)
+		return (EFAULT);
+	m->m_pkthdr.len += uiom->m_pkthdr.len;
+	m_demote_pkthdr(uiom);
+	m_last(m)->m_next = uiom;
+	return (0);
+}
+
+/*
+ * Return the tag table slot for the given tag, or NULL if it is invalid.
+ * NOTAG is per-connection, since each connection negotiates its version.
+ */
+static struct p9fs_tag_slot *
+p9fs_tag_slot(struct p9fs_session *p9s, struct p9fs_conn *conn, uint16_t tag)
+{
+
+	if (tag == NOTAG)
+		return (conn != NULL ? &conn->p9c_notag : NULL);
+	if (tag >= P9FS_TAGS)
+		return (NULL);
+	return (&p9s->p9s_tags[tag]);
+}
+
+/*
+ * Return a tag's slot to the tail of the free list, so that it is reused
+ * as late as possible.  Must hold p9s_lock.
+ */
+static void
+p9fs_tag_free_locked(struct p9fs_session *p9s, struct p9fs_conn *conn,
+    uint16_t tag)
+{
+	struct p9fs_tag_slot *ts = p9fs_tag_slot(p9s, conn, tag);
+
+	mtx_assert(&p9s->p9s_lock, MA_OWNED);
+	KASSERT(ts != NULL && ts->ts_state != P9TAG_FREE,
+	    ("%s: tag %u is not allocated", __func__, tag));
+	ts->ts_req = NULL;
+	ts->ts_state = P9TAG_FREE;
+	if (tag == NOTAG)
+		return;
+	p9s->p9s_tags_inuse--;
+	ts->ts_next = NOTAG;
+	if (p9s->p9s_tag_free == NOTAG)
+		p9s->p9s_tag_free = tag;
+	else
+		p9s->p9s_tags[p9s->p9s_tag_free_tail].ts_next = tag;
+	p9s->p9s_tag_free_tail = tag;
+	if (p9s->p9s_tag_waiters > 0)
+		wakeup_one(&p9s->p9s_tag_free);
+}
+
+/*
+ * Return the fid a T-message is about.  Every T-message except Tversion
+ * and Tflush leads with one; for those, return NOFID.
+ */
+static uint32_t
+p9fs_msg_fid(struct mbuf *m, uint8_t type)
+{
+	uint32_t fid;
+
+	if (type == Tversion || type == Tflush)
+		return (NOFID);
+	m_copydata(m, P9_HDRSZ, sizeof (fid), (void *)&fid);
+	return (le32toh(fid));
+}
+
+/*
+ * Pick the connection a message must travel on.  Fids belong to exactly
+ * one connection.  Tversion and Tflush, which have none, are sent via
+ * p9fs_msg_send_conn().
  */
+static struct p9fs_conn *
+p9fs_msg_route(struct p9fs_session *p9s, uint32_t fid)
+{
+
+	return (&p9s->p9s_conns[P9FS_FID_CONN(p9s, fid)]);
+}
 
-void *
-p9fs_msg_create(enum p9fs_msg_type p9_type, uint16_t tag)
+/*
+ * Return the connection with the least outstanding traffic.  Used to
+ * choose where new fids are created, since that decides where all later
+ * requests on them go.  Bulk connections are left for p9fs_open().
+ */
+struct p9fs_conn *
+p9fs_conn_pick(struct p9fs_session *p9s)
 {
-	struct mbuf *m;
+	struct p9fs_conn *conn, *best;
+	u_int i;
 
-	m = m_gethdr(M_WAITOK, MT_DATA);
-	/* Leave space to prepend the size of the packet. */
-	m->m_data += sizeof (uint32_t);
-	if (m != NULL) {
-		if (m_append(m, sizeof (uint8_t), (void *)&p9_type) == 0)
-			goto fail;
-		if (m_append(m, sizeof (tag), (void *)&tag) == 0)
-			goto fail;
+	best = &p9s->p9s_conns[0];
+	mtx_lock(&p9s->p9s_lock);
+	for (i = 1; i < P9FS_NCONN_META(p9s); i++) {
+		conn = &p9s->p9s_conns[i];
+		if (conn->p9c_outbytes < best->p9c_outbytes ||
+		    (conn->p9c_outbytes == best->p9c_outbytes &&
+		     conn->p9c_outreqs < best->p9c_outreqs))
+			best = conn;
 	}
-	return (m);
+	mtx_unlock(&p9s->p9s_lock);
 
-fail:
-	m_freem(m);
-	return (NULL);
+	return (best);
 }
 
-int
-p9fs_msg_add(void *mp, size_t len, void *cp)
+/*
+ * Detach a request from its tag slot and stop accounting for it.  A
+ * delivered reply keeps its tag until the reply is destroyed (except for
+ * NOTAG, which p9fs_msg_destroy() does not release).  An abandoned request
+ * keeps its tag until it has been flushed.  Otherwise the tag is released
+ * now.  Must hold p9s_lock.
+ */
+static void
+p9fs_req_detach_locked(struct p9fs_session *p9s, struct p9fs_req *req,
+    int flush)
 {
-	struct mbuf *m = mp;
+	struct p9fs_conn *conn = req->req_conn;
+	struct p9fs_tag_slot *ts = p9fs_tag_slot(p9s, conn, req->req_tag);
 
-	if (m_append(m, len, cp) == 0)
-		return (EINVAL);
-	return (0);
+	mtx_assert(&p9s->p9s_lock, MA_OWNED);
+	KASSERT(ts->ts_req == req, ("%s: tag %u not owned by request",
+	    __func__, req->req_tag));
+	ts->ts_req = NULL;
+	if (req->req_rexmt_timo != 0)
+		callout_stop(&req->req_rexmt);
+	if (req->req_tag == NOTAG)
+		p9fs_tag_free_locked(p9s, conn, req->req_tag);
+	else if (flush)
+		ts->ts_state = P9TAG_FLUSHING;
+	else if (req->req_msg != NULL)
+		ts->ts_state = P9TAG_REPLIED;
+	else
+		p9fs_tag_free_locked(p9s, conn, req->req_tag);
+	conn->p9c_outreqs--;
+	conn->p9c_outbytes -= req->req_size;
+	p9s->p9s_inbytes -= req->req_size;
+	if (--p9s->p9s_threads == 0)
+		wakeup(p9s);
+	if (p9s->p9s_wnd_waiters > 0)
+		wakeup(&p9s->p9s_wnd_waiters);
 }
 
-int
-p9fs_msg_add_string(void *mp, const char *str, uint16_t len)
+static void
+p9fs_req_free(struct p9fs_req *req)
 {
-	struct mbuf *m = mp;
 
-	if (m_append(m, 2, (uint8_t *)&len) == 0)
-		return (EINVAL);
-	if (m_append(m, len, str) == 0)
-		return (EINVAL);
-	return (0);
+	if (req->req_rmsg != NULL)
+		m_freem(req->req_rmsg);
+	free(req, M_P9REQ);
 }
 
-int
-p9fs_msg_add_uio(void *mp, struct uio *uio, uint32_t count)
+/*
+ * Count a request that has completed, or been given up on, in its type's
+ * statistics, and fire req:done.  An Rerror counts as an error.
+ */
+static void
+p9fs_req_account(struct p9fs_session *p9s, struct p9fs_req *req)
 {
-	struct mbuf *m = mp;
-	struct mbuf *uiom;
+	struct p9fs_opstats *os;
+	struct p9fs_msg_hdr hdr;
+	sbintime_t sbt;
+	uint64_t us;
+	u_int len;
 
-	uiom = m_uiotombuf(uio, M_WAITOK, count, /*align*/ 0, /*flags*/ 0);
-	m_cat(m, uiom);
+	/*
+	 * Replies from a stream socket have no packet header, so their
+	 * length is taken from their size field.
+	 */
+	sbt = sbinuptime() - req->req_start;
+	len = 0;
+	if (req->req_msg != NULL) {
+		p9fs_msg_hdr(req->req_msg, &hdr);
+		len = hdr.hdr_size;
+	}
+	SDT_PROBE7(p9fs, , req, done, p9s, req->req_type, req->req_tag,
+	    req->req_fid, len, req->req_error, sbttons(sbt));
+	if (req->req_type < Tversion || req->req_type > Twstat)
+		return;
 
-	return (0);
+	os = &p9s->p9s_opstats[P9FS_RTT_INDEX(req->req_type)];
+	us = sbttous(sbt);
+	counter_u64_add(os->os_time_us, us);
+	counter_u64_add(os->os_lat[P9FS_STATS_BUCKET(us)], 1);
+	if (req->req_msg != NULL) {
+		counter_u64_add(os->os_bytes_in, len);
+		if (hdr.hdr_type == Rerror)
+			counter_u64_add(os->os_errors, 1);
+	} else
+		counter_u64_add(os->os_errors, 1);
+}
+
+/* Describe a request for the slow request log. */
+static void
+p9fs_req_slowreq(struct p9fs_req *req, struct p9fs_slowreq *sr)
+{
+
+	sr->sr_tagwait = req->req_tagwait;
+	sr->sr_reserved = req->req_reserved;
+	sr->sr_enq = req->req_enq;
+	sr->sr_start = req->req_start;
+	sr->sr_sent = req->req_sent;
+	sr->sr_replied = req->req_replied;
+	sr->sr_done = 0;
+	sr->sr_fid = req->req_fid;
+	sr->sr_tag = req->req_tag;
+	sr->sr_type = req->req_type;
+	sr->sr_conn = req->req_conn->p9c_index;
+	sr->sr_state = 0;
+	sr->sr_error = req->req_error;
 }
 
 /*
- * mp is the Plan9 payload on input; on output it is the response payload.
+ * Finish a request's slow log entry as its sender is woken, and log it if
+ * it took at least slow_ms from asking for its tag.  Requests that never
+ * had a tag allocated (NOTAG) count from p9fs_msg_send_req().
+ */
+static void
+p9fs_slowlog_add(struct p9fs_session *p9s, struct p9fs_slowreq *sr)
+{
+	sbintime_t birth;
+	u_int slowms = p9s->p9s_slowms;
+
+	sr->sr_done = sbinuptime();
+	birth = sr->sr_reserved != 0 ? sr->sr_reserved : sr->sr_enq;
+	if (slowms == 0 ||
+	    sr->sr_done - birth + sr->sr_tagwait < slowms * SBT_1MS)
+		return;
+	mtx_lock(&p9s->p9s_lock);
+	p9s->p9s_slowlog[p9s->p9s_slowlog_next++ % P9FS_SLOWLOG] = *sr;
+	mtx_unlock(&p9s->p9s_lock);
+}
+
+/*
+ * Describe up to max of the session's allocated tags, for the outstanding
+ * requests sysctl: those not yet sent, sent and waiting for a reply,
+ * replied to but not yet released, and being flushed.  Tags not yet sent
+ * have no request, so only their tag and its times are known.  Returns the
+ * number described.
  */
 int
-p9fs_msg_send(struct p9fs_session *p9s, void **mp)
+p9fs_req_outstanding(struct p9fs_session *p9s, struct p9fs_slowreq *srs,
+    int max)
+{
+	struct p9fs_tag_slot *ts;
+	struct p9fs_slowreq *sr;
+	u_int i;
+	int n = 0;
+
+	mtx_lock(&p9s->p9s_lock);
+	for (i = 0; i < P9FS_TAGS + p9s->p9s_nconn && n < max; i++) {
+		if (i < P9FS_TAGS)
+			ts = &p9s->p9s_tags[i];
+		else
+			ts = &p9s->p9s_conns[i - P9FS_TAGS].p9c_notag;
+		if (ts->ts_state == P9TAG_FREE)
+			continue;
+		sr = &srs[n++];
+		if (ts->ts_req != NULL)
+			p9fs_req_slowreq(ts->ts_req, sr);
+		else {
+			bzero(sr, sizeof (*sr));
+			sr->sr_tagwait = ts->ts_tagwait;
+			sr->sr_reserved = ts->ts_reserved;
+			sr->sr_fid = NOFID;
+			sr->sr_tag = i < P9FS_TAGS ? i : NOTAG;
+			sr->sr_conn = i < P9FS_TAGS ? 0 : i - P9FS_TAGS;
+		}
+		sr->sr_state = ts->ts_state;
+	}
+	mtx_unlock(&p9s->p9s_lock);
+
+	return (n);
+}
+
+/*
+ * Hand a detached request's result to its callback and free it.  A
+ * synchronous sender finishes the request's slow log entry itself, once
+ * it is woken.
+ */
+static void
+p9fs_req_done(struct p9fs_session *p9s, struct p9fs_req *req)
 {
-	int error, flags;
-	struct uio *uio = NULL;
-	struct mbuf *m = *mp;
-	struct mbuf *control = NULL;
-	struct thread *td = curthread;
-	struct p9fs_recv *p9r = &p9s->p9s_recv;
+	struct p9fs_slowreq sr;
+	int sync;
+
+	p9fs_req_account(p9s, req);
+	sync = req->req_cb == p9fs_msg_sync_cb;
+	p9fs_req_slowreq(req, sync ?
+	    &((struct p9fs_msg_sync *)req->req_arg)->ps_slow : &sr);
+	req->req_cb(p9s, req->req_arg, req->req_msg, req->req_error);
+	if (!sync)
+		p9fs_slowlog_add(p9s, &sr);
+	p9fs_req_free(req);
+}
+
+/*
+ * Cancel a request that has not completed yet.  Returns 1 if the request
+ * was cancelled, in which case its callback will never be called and the
+ * caller must free it.  Returns 0 if completion is already under way.
+ *
+ * The server may still be working on a cancelled request, so its tag is
+ * not released; the caller must flush it with p9fs_client_flush() once it
+ * has dropped p9s_lock.  Must hold p9s_lock.
+ */
+static int
+p9fs_req_cancel_locked(struct p9fs_session *p9s, struct p9fs_req *req)
+{
+	struct p9fs_tag_slot *ts;
+
+	ts = p9fs_tag_slot(p9s, req->req_conn, req->req_tag);
+	if (ts->ts_req != req)
+		return (0);
+	p9fs_req_detach_locked(p9s, req, 1);
+	return (1);
+}
+
+/*
+ * Fail the requests outstanding on a connection; if park is set, those
+ * that can be resent are kept instead.  This scans the whole table, but
+ * only happens once per connection failure.  Callbacks are run after
+ * dropping the lock.
+ */
+static void
+p9fs_conn_fail_reqs(struct p9fs_conn *conn, int error, int park)
+{
+	struct p9fs_session *p9s = conn->p9c_session;
+	struct p9fs_req_list failed;
+	struct p9fs_tag_slot *ts;
 	struct p9fs_req *req;
-	int timo = 30 * hz;
+	int i;
+
+	STAILQ_INIT(&failed);
+	mtx_lock(&p9s->p9s_lock);
+	for (i = 0; i <= P9FS_TAGS; i++) {
+		ts = p9fs_tag_slot(p9s, conn, i < P9FS_TAGS ? i : NOTAG);
+		req = ts->ts_req;
+		if (ts->ts_state != P9TAG_SENT || req == NULL ||
+		    req->req_conn != conn)
+			continue;
+		if (park && req->req_rmsg != NULL)
+			continue;
+		req->req_error = error;
+		p9fs_req_detach_locked(p9s, req, 0);
+		STAILQ_INSERT_TAIL(&failed, req, req_link);
+	}
+	mtx_unlock(&p9s->p9s_lock);
+	while ((req = STAILQ_FIRST(&failed)) != NULL) {
+		STAILQ_REMOVE_HEAD(&failed, req_link);
+		p9fs_req_done(p9s, req);
+	}
+}
+
+/* Fail every request outstanding on a connection. */
+void
+p9fs_conn_fail(struct p9fs_conn *conn, int error)
+{
+
+	p9fs_conn_fail_reqs(conn, error, 0);
+}
+
+/*
+ * A flush went unanswered for its whole timeout; see p9fs_client_flush().
+ * The server is presumed hung, so give up on the connection.
+ */
+static void
+p9fs_conn_flush_timeout(void *arg, int pending __unused)
+{
+	struct p9fs_conn *conn = arg;
+
+	p9fs_conn_lost(conn, ETIMEDOUT);
+}
+
+/*
+ * Report that a connection has broken.  Once the mount is up, this
+ * starts recovering the connection in the background instead of failing
+ * everything on it; see p9fs_conn_recover().  Requests that can be resent
+ * are kept for that, and the rest fail now.  Any other request waits for
+ * recovery to finish before it is sent.
+ *
+ * May be called from the receive upcall, and more than once for the
+ * same failure.
+ */
+void
+p9fs_conn_lost(struct p9fs_conn *conn, int error)
+{
+	struct p9fs_session *p9s = conn->p9c_session;
+	int recover;
+
+	mtx_lock(&p9s->p9s_lock);
+	recover = p9s->p9s_state == P9S_RUNNING;
+	if (recover) {
+		conn->p9c_lostgen++;
+		if (!conn->p9c_recovering) {
+			conn->p9c_recovering = 1;
+			p9s->p9s_reconnects++;
+			taskqueue_enqueue(taskqueue_thread, &conn->p9c_rtask);
+		}
+	}
+	mtx_unlock(&p9s->p9s_lock);
+
+	p9fs_conn_fail_reqs(conn, error, recover);
+}
+
+/* Return a queued message's tag. */
+static uint16_t
+p9fs_msg_tag(struct mbuf *m)
+{
 	uint16_t tag;
 
-	req = malloc(sizeof (struct p9fs_req), M_P9REQ, M_WAITOK | M_ZERO);
+	m_copydata(m, sizeof (uint32_t) + 1, sizeof (tag), (void *)&tag);
+	return (le16toh(tag));
+}
 
-	/* Prepend the packet size, then re-fetch the tag. */
-	m->m_pkthdr.len = m_length(m, NULL);
-	M_PREPEND(m, sizeof (uint32_t), M_WAITOK);
-	*mtod(m, uint32_t *) = m->m_pkthdr.len;
-	m_copydata(m, offsetof(struct p9fs_msg_hdr, hdr_tag),
-	    sizeof (tag), (void *)&tag);
-	req->req_tag = tag;
+/*
+ * Stamp the requests of a batch of messages, given by their tags, as sent.
+ * A tag may have been answered and even reused by the time its batch is
+ * sent, so only requests on this connection that started no later than
+ * the batch was taken are stamped.
+ */
+static void
+p9fs_conn_stamp(struct p9fs_conn *conn, const uint16_t *tags, int ntags,
+    sbintime_t taken)
+{
+	struct p9fs_session *p9s = conn->p9c_session;
+	struct p9fs_tag_slot *ts;
+	struct p9fs_req *req;
+	sbintime_t now;
+	int i;
+
+	now = sbinuptime();
+	mtx_lock(&p9s->p9s_lock);
+	for (i = 0; i < ntags; i++) {
+		ts = p9fs_tag_slot(p9s, conn, tags[i]);
+		if (ts == NULL || ts->ts_state != P9TAG_SENT ||
+		    (req = ts->ts_req) == NULL || req->req_conn != conn ||
+		    req->req_start > taken)
+			continue;
+		req->req_sent = now;
+	}
+	mtx_unlock(&p9s->p9s_lock);
+}
+
+/*
+ * Fail the request a message that could not be sent belongs to, given by
+ * its tag, without failing the connection.  As in p9fs_conn_stamp(), the
+ * tag may already belong to a later request, which is left alone.
+ */
+static void
+p9fs_conn_fail_tag(struct p9fs_conn *conn, uint16_t tag, sbintime_t taken,
+    int error)
+{
+	struct p9fs_session *p9s = conn->p9c_session;
+	struct p9fs_tag_slot *ts;
+	struct p9fs_req *req;
 
 	mtx_lock(&p9s->p9s_lock);
-	if (p9s->p9s_state >= P9S_CLOSING) {
+	ts = p9fs_tag_slot(p9s, conn, tag);
+	if (ts == NULL || ts->ts_state != P9TAG_SENT ||
+	    (req = ts->ts_req) == NULL || req->req_conn != conn ||
+	    req->req_start > taken) {
 		mtx_unlock(&p9s->p9s_lock);
-		*mp = NULL;
-		p9fs_msg_destroy(p9s, m);
-		free(req, M_P9REQ);
-		return (ECONNABORTED);
+		return;
 	}
-	p9s->p9s_threads++;
-	TAILQ_INSERT_TAIL(&p9r->p9r_reqs, req, req_link);
+	req->req_error = error;
+	p9fs_req_detach_locked(p9s, req, 0);
 	mtx_unlock(&p9s->p9s_lock);
+	p9fs_req_done(p9s, req);
+}
 
-	flags = 0;
-	error = sosend(p9s->p9s_sock, &p9s->p9s_sockaddr, uio, m, control,
-	    flags, td);
-	*mp = NULL;
-	if (error == EMSGSIZE) {
-		SOCKBUF_LOCK(&p9s->p9s_sock->so_snd);
-		sbwait(&p9s->p9s_sock->so_snd);
-		SOCKBUF_UNLOCK(&p9s->p9s_sock->so_snd);
+/*
+ * Drain a connection's transmit queue.  Consecutive messages are joined
+ * into a single chain, so that one send (and, for TCP, as few segments as
+ * possible) carries everything that queued up during the previous one.
+ * A lone message goes out immediately, which together with TCP_NODELAY
+ * keeps latency low when the queue is shallow.  Datagram transports must
+ * send one message per datagram, so nothing is coalesced for them.
+ *
+ * Called with p9c_sndlock held and p9c_sending set; returns with the lock
+ * held.  If other threads are waiting for queue space, the drain stops
+ * after P9FS_SNDQ_MAX bytes and one of them becomes the sender, so no one
+ * thread is stuck sending for everybody else indefinitely.
+ */
+static void
+p9fs_conn_drain_locked(struct p9fs_conn *conn)
+{
+	const struct p9fs_trans *pt = conn->p9c_session->p9s_trans;
+	struct mbuf *chain, *m;
+	uint16_t tags[P9FS_SNDQ_STAMPS];
+	sbintime_t taken;
+	u_long len, sent;
+	int atomic, error, nmsgs;
+
+	mtx_assert(&conn->p9c_sndlock, MA_OWNED);
+	atomic = (conn->p9c_flags & P9C_ATOMIC) != 0;
+	sent = 0;
+	while ((chain = conn->p9c_sndq_head) != NULL &&
+	    conn->p9c_snderror == 0) {
+		if (sent >= P9FS_SNDQ_MAX && conn->p9c_sndq_waiters > 0)
+			break;
+
+		/* Take the head, and whatever else fits in one batch. */
+		taken = sbinuptime();
+		len = chain->m_pkthdr.len;
+		nmsgs = 1;
+		tags[0] = p9fs_msg_tag(chain);
+		conn->p9c_sndq_head = chain->m_nextpkt;
+		chain->m_nextpkt = NULL;
+		while (!atomic && (m = conn->p9c_sndq_head) != NULL &&
+		    len + m->m_pkthdr.len <= P9FS_SNDQ_BATCH) {
+			conn->p9c_sndq_head = m->m_nextpkt;
+			m->m_nextpkt = NULL;
+			len += m->m_pkthdr.len;
+			if (nmsgs < P9FS_SNDQ_STAMPS)
+				tags[nmsgs] = p9fs_msg_tag(m);
+			nmsgs++;
+			m_demote_pkthdr(m);
+			m_cat(chain, m);
+		}
+		chain->m_pkthdr.len = len;
+		if (conn->p9c_sndq_head == NULL)
+			conn->p9c_sndq_tail = NULL;
+		conn->p9c_sndq_bytes -= len;
+		if (conn->p9c_sndq_waiters > 0)
+			wakeup(&conn->p9c_sndq_head);
+		mtx_unlock(&conn->p9c_sndlock);
+
+		/*
+		 * The transport waits for buffer space, which is what pushes
+		 * back on the queue.
+		 */
+		error = pt->pt_send(conn, chain);
+		if (error == 0)
+			p9fs_conn_stamp(conn, tags,
+			    MIN(nmsgs, P9FS_SNDQ_STAMPS), taken);
+		else if (error == EMSGSIZE && atomic) {
+			/* Only this datagram is too big; fail its request. */
+			p9fs_conn_fail_tag(conn, tags[0], taken, error);
+			error = 0;
+		}
+
+		mtx_lock(&conn->p9c_sndlock);
+		conn->p9c_sndcalls++;
+		conn->p9c_sndmsgs += nmsgs;
+		sent += len;
+		if (error != 0 && conn->p9c_snderror == 0)
+			conn->p9c_snderror = error;
 	}
+}
 
-	mtx_lock(&p9s->p9s_lock);
-	/*
-	 * Check to see if a response was generated for this request while
-	 * waiting for the lock.
-	 */
-	if (req->req_error != 0 && error == 0)
-		error = req->req_error;
+/*
+ * Queue a message for transmission on a connection.  The message is always
+ * consumed.  An error means the connection can no longer send anything;
+ * every request on it is failed as well.
+ */
+static int
+p9fs_conn_send(struct p9fs_conn *conn, struct mbuf *m)
+{
+	struct mbuf *q;
+	int error;
 
-	if (error == 0 && req->req_msg == NULL)
-		error = msleep(req, &p9s->p9s_lock, PCATCH, "p9reqsend", timo);
+	mtx_lock(&conn->p9c_sndlock);
+	while (conn->p9c_sndq_bytes >= P9FS_SNDQ_MAX && conn->p9c_sending &&
+	    conn->p9c_snderror == 0) {
+		conn->p9c_sndq_waiters++;
+		(void) msleep(&conn->p9c_sndq_head, &conn->p9c_sndlock, 0,
+		    "p9sndq", 0);
+		conn->p9c_sndq_waiters--;
+	}
+	if ((error = conn->p9c_snderror) != 0) {
+		mtx_unlock(&conn->p9c_sndlock);
+		m_freem(m);
+		return (error);
+	}
 
-	TAILQ_REMOVE(&p9r->p9r_reqs, req, req_link);
-	if (error == 0)
-		error = req->req_error;
+	m->m_nextpkt = NULL;
+	if (conn->p9c_sndq_tail != NULL)
+		conn->p9c_sndq_tail->m_nextpkt = m;
+	else
+		conn->p9c_sndq_head = m;
+	conn->p9c_sndq_tail = m;
+	conn->p9c_sndq_bytes += m->m_pkthdr.len;
 
-	/* Ensure any response is disposed of in case of a local error. */
-	*mp = req->req_msg;
-	if (error != 0 && *mp != NULL) {
-		m_freem(*mp);
-		*mp = NULL;
+	/* If someone else is sending, they will pick this up. */
+	if (conn->p9c_sending) {
+		mtx_unlock(&conn->p9c_sndlock);
+		return (0);
 	}
 
-	p9s->p9s_threads--;
-	wakeup(p9s);
-	mtx_unlock(&p9s->p9s_lock);
+	conn->p9c_sending = 1;
+	p9fs_conn_drain_locked(conn);
+	conn->p9c_sending = 0;
+	wakeup(&conn->p9c_sending);
+	if (conn->p9c_sndq_waiters > 0)
+		wakeup(&conn->p9c_sndq_head);
 
-	free(req, M_P9REQ);
+	/* On error, drop what is left; its requests are failed below. */
+	error = conn->p9c_snderror;
+	if (error != 0) {
+		while ((q = conn->p9c_sndq_head) != NULL) {
+			conn->p9c_sndq_head = q->m_nextpkt;
+			m_freem(q);
+		}
+		conn->p9c_sndq_tail = NULL;
+		conn->p9c_sndq_bytes = 0;
+	}
+	mtx_unlock(&conn->p9c_sndlock);
 
+	if (error != 0)
+		p9fs_conn_lost(conn, error);
 	return (error);
 }
 
-void
-p9fs_msg_recv(struct p9fs_session *p9s)
+/*
+ * Requests that are safe to send again on a new connection, because
+ * whatever effect they had on the server was lost with the old one, or
+ * is harmless to repeat.
+ */
+static int
+p9fs_msg_retryable(uint8_t type)
 {
-	struct p9fs_recv *p9r = &p9s->p9s_recv;
-	struct mbuf *control, *m;
-	struct uio uio;
-	int error, rcvflag;
-	struct sockaddr **psa = NULL;
 
-	p9r->p9r_soupcalls++;
+	switch (type) {
+	case Twalk:
+	case Tread:
+	case Tstat:
+	case Tclunk:
+		return (1);
+	default:
+		return (0);
+	}
+}
 
-again:
-	/* Is the socket still waiting for a new record's size? */
-	if (p9r->p9r_resid == 0) {
-		if (sbavail(&p9s->p9s_sock->so_rcv) < sizeof (p9r->p9r_resid)
-		 || (p9s->p9s_sock->so_rcv.sb_state & SBS_CANTRCVMORE) != 0
-		 || p9s->p9s_sock->so_error != 0)
-			goto out;
+/*
+ * Wait until the session's in-flight window has room for req: fewer than
+ * p9s_wnd requests, and no more than p9s_wndb * msize bytes, are allowed
+ * out at once.  A request larger than the byte window may go out alone.
+ * Must hold p9s_lock.
+ */
+static int
+p9fs_wnd_wait_locked(struct p9fs_session *p9s, struct p9fs_req *req)
+{
+	sbintime_t start;
+	int error;
 
-		uio.uio_resid = sizeof (p9r->p9r_resid);
-	} else {
-		uio.uio_resid = p9r->p9r_resid;
+	mtx_assert(&p9s->p9s_lock, MA_OWNED);
+	error = 0;
+	start = 0;
+	while (p9s->p9s_state < P9S_CLOSING && error == 0 &&
+	    (p9s->p9s_threads >= p9s->p9s_wnd || (p9s->p9s_threads > 0 &&
+	    p9s->p9s_inbytes + req->req_size >
+	    (u_long)p9s->p9s_wndb * p9s->p9s_msize))) {
+		if (start == 0) {
+			start = sbinuptime();
+			p9s->p9s_wnd_blocks++;
+		}
+		p9s->p9s_wnd_waiters++;
+		error = msleep(&p9s->p9s_wnd_waiters, &p9s->p9s_lock, PCATCH,
+		    "p9wnd", 0);
+		p9s->p9s_wnd_waiters--;
 	}
+	if (start != 0)
+		p9s->p9s_wnd_blocked_us += sbttous(sbinuptime() - start);
+	return (error);
+}
 
-	/* Drop the sockbuf lock and do the soreceive call. */
-	SOCKBUF_UNLOCK(&p9s->p9s_sock->so_rcv);
-	rcvflag = MSG_DONTWAIT | MSG_SOCALLBCK;
-	error = soreceive(p9s->p9s_sock, psa, &uio, &m, &control, &rcvflag);
-	SOCKBUF_LOCK(&p9s->p9s_sock->so_rcv);
+/*
+ * Adjust the in-flight window after a reply that took us microseconds,
+ * in the manner of delay-based congestion control: grow both windows by
+ * one step for every window's worth of replies that show no queueing,
+ * and shrink them by an eighth, at most once per window, when a reply
+ * shows more queueing than P9FS_WND_TARGET and the type's uncongested
+ * RTT allow.  Must hold p9s_lock.
+ *
+ * XXX rtt_min never ages, so a path that gets slower for good is taken
+ *     as congested until the window bottoms out.
+ */
+static void
+p9fs_wnd_update(struct p9fs_session *p9s, struct p9fs_rtt *rtt, int us)
+{
+	int qdelay;
 
-	/* Process errors from soreceive(). */
-	if (error == EWOULDBLOCK)
-		goto out;
-	if (error != 0 || uio.uio_resid > 0) {
-		struct p9fs_req *req;
+	mtx_assert(&p9s->p9s_lock, MA_OWNED);
+	qdelay = us - rtt->rtt_min;
+	if (p9s->p9s_wnd_hold > 0)
+		p9s->p9s_wnd_hold--;
+	if (qdelay > rtt->rtt_min && qdelay > P9FS_WND_TARGET) {
+		if (p9s->p9s_wnd_hold > 0)
+			return;
+		p9s->p9s_wnd = MAX(p9s->p9s_wnd - p9s->p9s_wnd / 8,
+		    P9FS_WND_MIN);
+		p9s->p9s_wndb = MAX(p9s->p9s_wndb - p9s->p9s_wndb / 8,
+		    P9FS_WNDB_MIN);
+		p9s->p9s_wnd_acked = 0;
+		p9s->p9s_wnd_hold = p9s->p9s_wnd;
+		return;
+	}
+	if (++p9s->p9s_wnd_acked < p9s->p9s_wnd)
+		return;
+	p9s->p9s_wnd_acked = 0;
+	p9s->p9s_wnd = MIN(p9s->p9s_wnd + 1, P9FS_WND_MAX);
+	p9s->p9s_wndb = MIN(p9s->p9s_wndb + 1, P9FS_WNDB_MAX);
+	if (p9s->p9s_wnd_waiters > 0)
+		wakeup(&p9s->p9s_wnd_waiters);
+}
 
-		if (error == 0)
-			error = ECONNRESET;
+/*
+ * Queue a message and return without waiting for the reply.  If conn is
+ * NULL, the message is routed to the connection that owns its fid.
+ *
+ * The message is always consumed.  If an error is returned, the callback
+ * will not be called; otherwise it is called exactly once, possibly before
+ * this returns.  Callbacks may run from the socket upcall, so they must not
+ * sleep.  If reqp is not NULL, it returns the request for use with
+ * p9fs_req_cancel_locked().
+ */
+static int
+p9fs_msg_send_req(struct p9fs_session *p9s, struct p9fs_conn *conn,
+    struct mbuf *m, p9fs_msg_cb cb, void *arg, struct p9fs_req **reqp)
+{
+	int error;
+	struct p9fs_tag_slot *ts;
+	struct p9fs_req *req;
+	struct p9fs_opstats *os;
+	struct p9fs_msg_hdr hdr;
+	struct p9fs_msg_Tread tr;
+	uint32_t size;
+	u_int gen;
+	uint8_t type;
+	uint16_t tag;
+
+	req = malloc(sizeof (struct p9fs_req), M_P9REQ, M_WAITOK | M_ZERO);
+	req->req_enq = sbinuptime();
 
+	/* Fill in the packet size, then re-fetch the type and tag. */
+	KASSERT(m->m_pkthdr.len == m_length(m, NULL),
+	    ("p9fs: message length %d out of sync", m->m_pkthdr.len));
+	size = m->m_pkthdr.len;
+	le32enc(mtod(m, void *), size);
+	p9fs_msg_hdr(m, &hdr);
+	type = hdr.hdr_type;
+	tag = hdr.hdr_tag;
+	req->req_fid = p9fs_msg_fid(m, type);
+	if (conn == NULL)
+		conn = p9fs_msg_route(p9s, req->req_fid);
+	req->req_tag = tag;
+	req->req_type = type;
+	req->req_conn = conn;
+	req->req_cb = cb;
+	req->req_arg = arg;
+
+	/* Account for the reply's payload too, where it is known. */
+	req->req_size = size;
+	if (type == Tread && p9fs_msg_parse(m, Tread, &tr) == 0)
+		req->req_size += tr.Tread_count;
+
+	/*
+	 * Keep a copy of requests that can be resent if the connection is
+	 * lost.  Those sent while recovering it are not kept; they are
+	 * simply sent again if recovery has to start over.
+	 */
+	if ((p9fs_msg_retryable(type) && conn->p9c_rtd != curthread) ||
+	    (conn->p9c_flags & P9C_REXMT) != 0)
+		req->req_rmsg = m_copym(m, 0, M_COPYALL, M_WAITOK);
+
+	mtx_lock(&p9s->p9s_lock);
+	error = 0;
+	while (conn->p9c_recovering && conn->p9c_rtd != curthread &&
+	    p9s->p9s_state < P9S_CLOSING && error == 0)
+		error = msleep(&conn->p9c_recovering, &p9s->p9s_lock, PCATCH,
+		    "p9recov", 0);
+	/*
+	 * Wait for room in the window.  Flushes and version requests are
+	 * exempt, since they are what frees things up, as is recovery.
+	 */
+	if (error == 0 && type != Tflush && tag != NOTAG &&
+	    conn->p9c_rtd != curthread)
+		error = p9fs_wnd_wait_locked(p9s, req);
+	ts = p9fs_tag_slot(p9s, conn, tag);
+	if (error == 0 &&
+	    (p9s->p9s_state >= P9S_CLOSING || !conn->p9c_connected))
+		error = ECONNABORTED;
+	if (error != 0) {
+		mtx_unlock(&p9s->p9s_lock);
+		p9fs_msg_destroy(p9s, m);
+		p9fs_req_free(req);
+		return (error);
+	}
+	/* NOTAG is never allocated, so claim it here. */
+	if (tag == NOTAG && ts->ts_state == P9TAG_FREE) {
+		ts->ts_state = P9TAG_RESERVED;
+		ts->ts_reserved = ts->ts_tagwait = 0;
+	}
+	KASSERT(ts != NULL && ts->ts_state == P9TAG_RESERVED,
+	    ("%s: tag %u was not reserved", __func__, tag));
+	req->req_reserved = ts->ts_reserved;
+	req->req_tagwait = ts->ts_tagwait;
+	ts->ts_req = req;
+	ts->ts_state = P9TAG_SENT;
+	req->req_start = sbinuptime();
+	SDT_PROBE5(p9fs, , req, start, p9s, type, tag, req->req_fid, size);
+	if (type >= Tversion && type <= Twstat) {
+		os = &p9s->p9s_opstats[P9FS_RTT_INDEX(type)];
+		counter_u64_add(os->os_requests, 1);
+		counter_u64_add(os->os_bytes_out, size);
+	}
+	if ((conn->p9c_flags & P9C_REXMT) != 0) {
+		callout_init_mtx(&req->req_rexmt, &p9s->p9s_lock, 0);
+		req->req_rexmt_timo = p9fs_rtt_rexmt_locked(p9s, type);
+		callout_reset(&req->req_rexmt, req->req_rexmt_timo,
+		    p9fs_req_rexmt, req);
+	}
+	conn->p9c_outreqs++;
+	conn->p9c_outbytes += req->req_size;
+	p9s->p9s_inbytes += req->req_size;
+	if (++p9s->p9s_threads > p9s->p9s_threads_max)
+		p9s->p9s_threads_max = p9s->p9s_threads;
+	gen = conn->p9c_lostgen;
+	if (reqp != NULL)
+		*reqp = req;
+	mtx_unlock(&p9s->p9s_lock);
+
+	if (p9s->p9s_debug >= 3)
+		p9fs_msg_print(m);
+
+	/* From here on, the reply may complete and free req at any time. */
+	error = p9fs_conn_send(conn, m);
+	if (error != 0) {
+		/*
+		 * Fail the request, unless something else already did, or
+		 * it is being kept for resending since the connection was
+		 * lost after it was queued.
+		 */
 		mtx_lock(&p9s->p9s_lock);
-		p9r->p9r_error = error;
-		TAILQ_FOREACH(req, &p9r->p9r_reqs, req_link) {
+		if (ts->ts_req == req && (req->req_rmsg == NULL ||
+		    (!conn->p9c_recovering && conn->p9c_lostgen == gen))) {
 			req->req_error = error;
-			wakeup(req);
-		}
+			p9fs_req_detach_locked(p9s, req, 0);
+		} else
+			req = NULL;
 		mtx_unlock(&p9s->p9s_lock);
-		goto out;
+		if (req != NULL)
+			p9fs_req_done(p9s, req);
 	}
 
-	if (p9r->p9r_resid == 0) {
-		/* Copy in the size, subtract itself, and reclaim the mbuf. */
-		m_copydata(m, 0, sizeof (p9r->p9r_size),
-		    (uint8_t *)&p9r->p9r_size);
-		if (p9r->p9r_size < sizeof (struct p9fs_msg_hdr)) {
-			/* XXX Reject the packet as illegal? */
-		}
-		p9r->p9r_resid = p9r->p9r_size - sizeof (p9r->p9r_size);
-		p9r->p9r_msg = m;
+	return (0);
+}
+
+int
+p9fs_msg_send_async(struct p9fs_session *p9s, struct p9fs_conn *conn,
+    void *mp, p9fs_msg_cb cb, void *arg)
+{
+
+	return (p9fs_msg_send_req(p9s, conn, mp, cb, arg, NULL));
+}
+
+static void
+p9fs_msg_sync_cb(struct p9fs_session *p9s, void *arg, void *m, int error)
+{
+	struct p9fs_msg_sync *ps = arg;
+
+	mtx_lock(&p9s->p9s_lock);
+	ps->ps_msg = m;
+	ps->ps_error = error;
+	ps->ps_done = 1;
+	wakeup(ps);
+	mtx_unlock(&p9s->p9s_lock);
+}
+
+/*
+ * mp is the Plan9 payload on input; on output it is the response payload.
+ */
+int
+p9fs_msg_send(struct p9fs_session *p9s, void **mp)
+{
+
+	return (p9fs_msg_send_conn(p9s, NULL, mp));
+}
+
+/*
+ * Fold a reply's round-trip time into the estimate for its message type,
+ * as TCP does (RFC 6298): srtt and rttvar follow the samples with gains of
+ * 1/8 and 1/4.  The sample also drives the in-flight window.  Must hold
+ * p9s_lock.
+ */
+static void
+p9fs_rtt_sample(struct p9fs_session *p9s, uint8_t type, sbintime_t start)
+{
+	struct p9fs_rtt *rtt;
+	int delta, us;
 
-		/* Record size is known now; retrieve the rest. */
-		goto again;
+	mtx_assert(&p9s->p9s_lock, MA_OWNED);
+	if (type < Tversion || type > Twstat)
+		return;
+	rtt = &p9s->p9s_rtt[P9FS_RTT_INDEX(type)];
+	us = (int)MIN(sbttous(sbinuptime() - start), INT_MAX / 16);
+	if (us < 1)
+		us = 1;
+	if (rtt->rtt_samples++ == 0) {
+		rtt->rtt_srtt = us << 3;
+		rtt->rtt_rttvar = us << 1;
+		rtt->rtt_min = us;
+	} else {
+		delta = us - (rtt->rtt_srtt >> 3);
+		rtt->rtt_srtt += delta;
+		if (delta < 0)
+			delta = -delta;
+		rtt->rtt_rttvar += delta - (rtt->rtt_rttvar >> 2);
+		rtt->rtt_min = MIN(rtt->rtt_min, us);
 	}
+	p9fs_wnd_update(p9s, rtt, us);
+}
 
-	/* Chain the message to the end. */
-	m_last(p9r->p9r_msg)->m_next = m;
+/*
+ * The timeout for n messages' worth of the given type, in ticks: n times
+ * srtt + 4 * rttvar, bounded by the mount's rtomin and rtomax.
+ * Retransmission has its own, unfloored, timer in p9fs_rtt_rexmt_locked().
+ */
+static int
+p9fs_rtt_timeout_n(struct p9fs_session *p9s, uint8_t type, u_long n)
+{
+	struct p9fs_rtt *rtt;
+	uint64_t ms;
 
-	/* If we have a complete record, match it to a request via tag. */
-	p9r->p9r_resid = uio.uio_resid;
-	if (p9r->p9r_resid == 0) {
-		int found = 0;
-		uint16_t tag;
-		struct p9fs_req *req;
+	mtx_lock(&p9s->p9s_lock);
+	ms = P9FS_RTO_INIT;
+	if (type >= Tversion && type <= Twstat) {
+		rtt = &p9s->p9s_rtt[P9FS_RTT_INDEX(type)];
+		if (rtt->rtt_samples != 0)
+			ms = ((rtt->rtt_srtt >> 3) + rtt->rtt_rttvar) / 1000;
+	}
+	ms *= MAX(n, 1);
+	ms = MAX(ms, p9s->p9s_rtomin);
+	ms = MIN(ms, p9s->p9s_rtomax);
+	mtx_unlock(&p9s->p9s_lock);
 
-		m_copydata(p9r->p9r_msg, offsetof(struct p9fs_msg_hdr, hdr_tag),
-		    sizeof (uint16_t), (void *)&tag);
+	return (MAX((int)(ms * hz / 1000), 1));
+}
 
-		mtx_lock(&p9s->p9s_lock);
-		TAILQ_FOREACH(req, &p9r->p9r_reqs, req_link) {
-			if (req->req_tag == tag) {
-				found = 1;
-				req->req_msg = m_pullup(p9r->p9r_msg,
-				    p9r->p9r_size);
-				/* Zero tag to skip any duplicate replies. */
-				req->req_tag = 0;
-				wakeup(req);
-				break;
-			}
-		}
-		mtx_unlock(&p9s->p9s_lock);
-		if (found == 0) {
-			m_freem(p9r->p9r_msg);
-		}
-		p9r->p9r_msg = NULL;
+/* The timeout for a message of the given type, in ticks. */
+int
+p9fs_rtt_timeout(struct p9fs_session *p9s, uint8_t type)
+{
+
+	return (p9fs_rtt_timeout_n(p9s, type, 1));
+}
+
+/*
+ * How long a sender waits for the reply to a message before failing it
+ * with ETIMEDOUT, in ticks.  The estimate is allowed once for each msize
+ * worth of the request and its reply, so that large transfers over slow
+ * links get longer, but never more than rtomax.
+ */
+static int
+p9fs_req_deadline(struct p9fs_session *p9s, uint8_t type, u_long size)
+{
+
+	return (p9fs_rtt_timeout_n(p9s, type,
+	    howmany(size, p9s->p9s_msize)));
+}
+
+/*
+ * The first retransmission timeout for a message of the given type, in
+ * ticks.  Must hold p9s_lock.
+ */
+static int
+p9fs_rtt_rexmt_locked(struct p9fs_session *p9s, uint8_t type)
+{
+	struct p9fs_rtt *rtt;
+	u_int ms;
+
+	mtx_assert(&p9s->p9s_lock, MA_OWNED);
+	ms = P9FS_REXMT_INIT;
+	if (type >= Tversion && type <= Twstat) {
+		rtt = &p9s->p9s_rtt[P9FS_RTT_INDEX(type)];
+		if (rtt->rtt_samples != 0)
+			ms = ((rtt->rtt_srtt >> 3) + rtt->rtt_rttvar) / 1000;
 	}
+	ms = MAX(ms, P9FS_REXMT_MIN);
+	ms = MIN(ms, p9s->p9s_rtomax);
 
-out:
-	p9r->p9r_soupcalls--;
-	return;
+	return (MAX((int)((uint64_t)ms * hz / 1000), 1));
 }
 
-void
-p9fs_msg_get(void *mp, size_t *offp, void **ptr, size_t data_sz)
+/*
+ * Retransmission timer for requests on P9C_REXMT connections.  Runs with
+ * p9s_lock held; p9fs_req_detach_locked() stops it, so the request is
+ * still waiting for its reply.  Marks the request due, backs off, and
+ * leaves the sending to p9fs_conn_rexmt().
+ */
+static void
+p9fs_req_rexmt(void *arg)
+{
+	struct p9fs_req *req = arg;
+	struct p9fs_conn *conn = req->req_conn;
+	struct p9fs_session *p9s = conn->p9c_session;
+	int max;
+
+	mtx_assert(&p9s->p9s_lock, MA_OWNED);
+	req->req_rexmt_due = 1;
+	max = MAX((int)((uint64_t)p9s->p9s_rtomax * hz / 1000), 1);
+	req->req_rexmt_timo = MIN(req->req_rexmt_timo * 2, max);
+	callout_reset(&req->req_rexmt, req->req_rexmt_timo, p9fs_req_rexmt,
+	    req);
+	taskqueue_enqueue(taskqueue_thread, &conn->p9c_xtask);
+}
+
+/*
+ * Send a message on a specific connection and wait for its reply.  If conn
+ * is NULL, the message is routed to the connection that owns its fid.
+ */
+int
+p9fs_msg_send_conn(struct p9fs_session *p9s, struct p9fs_conn *conn,
+    void **mp)
+{
+	struct p9fs_msg_sync ps;
+	int error;
+
+	error = p9fs_msg_send_start(p9s, conn, mp, &ps);
+	if (error != 0)
+		return (error);
+	return (p9fs_msg_send_wait(p9s, &ps, mp));
+}
+
+/*
+ * Send a message as p9fs_msg_send_conn() does, but return once it is
+ * queued; p9fs_msg_send_wait() then collects the reply.  Several messages
+ * can be started before waiting for any of them, so that their round trips
+ * overlap.  Unless this fails, the message must be waited for.
+ */
+int
+p9fs_msg_send_start(struct p9fs_session *p9s, struct p9fs_conn *conn,
+    void **mp, struct p9fs_msg_sync *ps)
 {
-	*ptr = mtod((struct mbuf *)mp, uint8_t *) + *offp;
-	*offp += data_sz;
+	struct p9fs_msg_Tread tr;
+	struct p9fs_msg_hdr hdr;
+	u_long size;
+	int error;
+
+	bzero(ps, sizeof (*ps));
+	p9fs_msg_hdr(*mp, &hdr);
+	size = m_length(*mp, NULL);
+	if (hdr.hdr_type == Tread && p9fs_msg_parse(*mp, Tread, &tr) == 0)
+		size += tr.Tread_count;
+	ps->ps_timo = p9fs_req_deadline(p9s, hdr.hdr_type, size);
+	error = p9fs_msg_send_req(p9s, conn, *mp, p9fs_msg_sync_cb, ps,
+	    &ps->ps_req);
+	*mp = NULL;
+	return (error);
 }
 
+/*
+ * Wait for the reply to a message started with p9fs_msg_send_start(), and
+ * return it in mp.  The wait for each reply is timed from when this is
+ * called.
+ */
+int
+p9fs_msg_send_wait(struct p9fs_session *p9s, struct p9fs_msg_sync *ps,
+    void **mp)
+{
+	struct p9fs_req *req = ps->ps_req;
+	int error;
+
+	*mp = NULL;
+
+	/*
+	 * If the wait is interrupted or times out, cancel the request so the
+	 * callback never runs, and ask the server to abandon it; the flush is
+	 * not waited for.  If the reply is already being delivered, it is too
+	 * late to cancel, so wait for it instead.  An untagged request cannot
+	 * be flushed; if it times out, the server is presumed hung and the
+	 * connection is torn down.
+	 */
+	mtx_lock(&p9s->p9s_lock);
+	while (ps->ps_done == 0) {
+		error = msleep(ps, &p9s->p9s_lock, PCATCH, "p9reqsend",
+		    ps->ps_timo);
+		if (error != 0 && ps->ps_done == 0 &&
+		    p9fs_req_cancel_locked(p9s, req)) {
+			if (error == EWOULDBLOCK) {
+				error = ETIMEDOUT;
+				p9s->p9s_timeouts++;
+			}
+			mtx_unlock(&p9s->p9s_lock);
+			if (req->req_tag == NOTAG) {
+				if (error == ETIMEDOUT)
+					p9fs_conn_lost(req->req_conn, error);
+			} else
+				(void) p9fs_client_flush(p9s, req->req_conn,
+				    req->req_tag);
+			req->req_error = error;
+			p9fs_req_account(p9s, req);
+			p9fs_req_slowreq(req, &ps->ps_slow);
+			p9fs_slowlog_add(p9s, &ps->ps_slow);
+			p9fs_req_free(req);
+			return (error);
+		}
+	}
+	mtx_unlock(&p9s->p9s_lock);
+	p9fs_slowlog_add(p9s, &ps->ps_slow);
+
+	*mp = ps->ps_msg;
+	return (ps->ps_msg != NULL ? 0 : ps->ps_error);
+}
+
+/*
+ * Hand a complete reply, received on conn, to the request waiting for it.
+ * Called by transports; replies that match no outstanding request on this
+ * connection are dropped.
+ */
 void
-p9fs_msg_get_str(void *mp, size_t *offp, struct p9fs_str *str)
+p9fs_msg_deliver(struct p9fs_conn *conn, struct mbuf *m)
 {
-	uint8_t *buf;
+	struct p9fs_session *p9s = conn->p9c_session;
+	struct p9fs_tag_slot *ts;
+	struct p9fs_req *req = NULL;
+	struct p9fs_msg_hdr hdr;
+
+	p9fs_msg_hdr(m, &hdr);
+	if (p9s->p9s_debug >= 3)
+		p9fs_msg_print(m);
+
+	/*
+	 * Only a slot still waiting for its reply may claim it, only if the
+	 * reply arrived on the connection it was sent on, and only with a
+	 * reply of the right type.  Over a datagram transport, the same reply
+	 * can arrive more than once; the copies find the slot no longer
+	 * waiting.  Tags are reused in FIFO order, so a copy late enough to
+	 * find its tag reused must have been outrun by thousands of others.
+	 */
+	mtx_lock(&p9s->p9s_lock);
+	ts = p9fs_tag_slot(p9s, conn, hdr.hdr_tag);
+	if (ts != NULL && ts->ts_state == P9TAG_SENT &&
+	    ts->ts_req != NULL && ts->ts_req->req_conn == conn &&
+	    (hdr.hdr_type == ts->ts_req->req_type + 1 ||
+	    hdr.hdr_type == Rerror)) {
+		req = ts->ts_req;
+		req->req_replied = sbinuptime();
+		/* Karn: a resent request's reply could be for either send. */
+		if (!req->req_resent)
+			p9fs_rtt_sample(p9s, req->req_type, req->req_start);
+		req->req_msg = m;
+		p9fs_req_detach_locked(p9s, req, 0);
+	} else {
+		SDT_PROBE3(p9fs, , reply, stale, conn, hdr.hdr_type,
+		    hdr.hdr_tag);
+		m_freem(m);
+	}
+	mtx_unlock(&p9s->p9s_lock);
 
-	p9fs_msg_get(mp, offp, (void **)&buf, sizeof (uint16_t));
-	str->p9str_size = *(uint16_t *)buf;
-	str->p9str_str = (char *)(buf + sizeof (str->p9str_size));
-	*offp += str->p9str_size;
+	if (req != NULL)
+		p9fs_req_done(p9s, req);
 }
 
-int32_t
-p9fs_msg_payload_len(void *mp)
+/*
+ * Copy count bytes at offset off of a message into a uio, straight out of
+ * each mbuf in the chain.
+ */
+int
+p9fs_msg_uiomove(void *mp, size_t off, uint32_t count, struct uio *uio)
 {
-	return (((struct mbuf *)mp)->m_len);
+	struct mbuf *m = mp;
+	int error, len;
+
+	while (m != NULL && off >= m->m_len) {
+		off -= m->m_len;
+		m = m->m_next;
+	}
+	for (; count > 0 && m != NULL; m = m->m_next) {
+		len = MIN(m->m_len - off, count);
+		error = uiomove(mtod(m, uint8_t *) + off, len, uio);
+		if (error != 0)
+			return (error);
+		count -= len;
+		off = 0;
+	}
+
+	/* The server claimed more data than it sent. */
+	return (count == 0 ? 0 : EIO);
 }
 
 void
 p9fs_msg_destroy(struct p9fs_session *p9s, void *mp)
 {
-	struct mbuf *m = mp;
-	uint16_t *tag;
-	size_t off = offsetof(struct p9fs_msg_hdr, hdr_tag);
+	struct p9fs_msg_hdr hdr;
 
-	p9fs_msg_get(mp, &off, (void **)&tag, sizeof (*tag));
-	if (*tag != NOTAG)
-		p9fs_reltag(p9s, *tag);
-	m_freem(m);
+	p9fs_msg_hdr(mp, &hdr);
+	if (hdr.hdr_tag != NOTAG)
+		p9fs_reltag(p9s, hdr.hdr_tag);
+	m_freem(mp);
 }
 
 void
 p9fs_init_session(struct p9fs_session *p9s)
 {
+	struct p9fs_conn *conn;
+	counter_u64_t *stats;
+	int i;
+
 	mtx_init(&p9s->p9s_lock, "p9s->p9s_lock", NULL, MTX_DEF);
-	TAILQ_INIT(&p9s->p9s_recv.p9r_reqs);
 	(void) strlcpy(p9s->p9s_uname, "root", sizeof ("root"));
 	p9s->p9s_uid = 0;
 	p9s->p9s_afid = NOFID;
-	/*
-	 * XXX Although there can be more FIDs, the unit accounting subroutines
-	 *     flatten these values to int arguments rather than u_int.
-	 *     This will limit the number of outstanding vnodes for a p9fs
-	 *     mount to 64k.
-	 */
-	p9s->p9s_fids = new_unrhdr(1, UINT16_MAX, &p9s->p9s_lock);
-	p9s->p9s_tags = new_unrhdr(1, UINT16_MAX - 1, &p9s->p9s_lock);
+	/* Fid unit 0 is reserved for the connections' root fids. */
+	mtx_init(&p9s->p9s_fidlock, "p9s->p9s_fidlock", NULL, MTX_DEF);
+	p9s->p9s_fidcache = malloc((mp_maxid + 1) *
+	    sizeof (struct p9fs_fid_cache), M_P9REQ, M_WAITOK | M_ZERO);
+	SLIST_INIT(&p9s->p9s_fidfree);
+	p9s->p9s_fidnext = 1;
+	p9s->p9s_fids_inuse = counter_u64_alloc(M_WAITOK);
+	p9s->p9s_fidrecs = malloc(P9FS_FIDREC_BUCKETS *
+	    sizeof (struct p9fs_fidrec_bucket), M_P9REQ, M_WAITOK | M_ZERO);
+	for (i = 0; i < P9FS_FIDREC_BUCKETS; i++) {
+		mtx_init(&p9s->p9s_fidrecs[i].frb_lock, "p9s->p9s_fidrecs",
+		    NULL, MTX_DEF);
+		LIST_INIT(&p9s->p9s_fidrecs[i].frb_head);
+	}
+
+	/* Thread every tag onto the free list, lowest tag first. */
+	CTASSERT(P9FS_TAGS < NOTAG);
+	p9s->p9s_tags = malloc(P9FS_TAGS * sizeof (struct p9fs_tag_slot),
+	    M_P9REQ, M_WAITOK | M_ZERO);
+	for (i = 0; i < P9FS_TAGS; i++)
+		p9s->p9s_tags[i].ts_next = i + 1 < P9FS_TAGS ? i + 1 : NOTAG;
+	p9s->p9s_tag_free = 0;
+	p9s->p9s_tag_free_tail = P9FS_TAGS - 1;
+
+	/* The statistics are nothing but counters, so treat them as such. */
+	CTASSERT(P9FS_STATS_TYPES == P9FS_RTT_TYPES);
+	stats = (counter_u64_t *)p9s->p9s_opstats;
+	for (i = 0; i < P9FS_OPSTATS_COUNTERS; i++)
+		stats[i] = counter_u64_alloc(M_WAITOK);
+
+	p9s->p9s_nconn = 1;
+	p9s->p9s_msize = P9_MSG_MAX;
+	p9s->p9s_rtomin = P9FS_RTOMIN_DEF;
+	p9s->p9s_rtomax = P9FS_RTOMAX_DEF;
+	p9s->p9s_slowms = P9FS_SLOWMS_DEF;
+	p9s->p9s_reads = P9FS_READS_DEF;
+	p9s->p9s_wnd = P9FS_WND_INIT;
+	p9s->p9s_wndb = P9FS_WNDB_INIT;
+	for (i = 0; i < P9FS_CONN_MAX; i++) {
+		conn = &p9s->p9s_conns[i];
+		conn->p9c_session = p9s;
+		conn->p9c_index = i;
+		mtx_init(&conn->p9c_sndlock, "p9c->p9c_sndlock", NULL,
+		    MTX_DEF);
+		TASK_INIT(&conn->p9c_rtask, 0, p9fs_conn_recover, conn);
+		TASK_INIT(&conn->p9c_xtask, 0, p9fs_conn_rexmt, conn);
+		TASK_INIT(&conn->p9c_ftask, 0, p9fs_conn_flush_timeout, conn);
+	}
+
+	p9s->p9s_trans = &p9fs_trans_sock;
 	p9s->p9s_socktype = SOCK_STREAM;
 	p9s->p9s_proto = IPPROTO_TCP;
 }
 
-void
-p9fs_close_session(struct p9fs_session *p9s)
+/* Stop all I/O on a connection and close its transport. */
+static void
+p9fs_conn_stop(struct p9fs_conn *conn)
+{
+	const struct p9fs_trans *pt = conn->p9c_session->p9s_trans;
+
+	if (!conn->p9c_connected)
+		return;
+
+	/*
+	 * Stop new transmissions, and wait for the current sender to give
+	 * up; shutting the transport down wakes it if it is blocked.
+	 */
+	mtx_lock(&conn->p9c_sndlock);
+	if (conn->p9c_snderror == 0)
+		conn->p9c_snderror = ECONNABORTED;
+	mtx_unlock(&conn->p9c_sndlock);
+	pt->pt_shutdown(conn);
+	mtx_lock(&conn->p9c_sndlock);
+	while (conn->p9c_sending)
+		(void) msleep(&conn->p9c_sending, &conn->p9c_sndlock, 0,
+		    "p9sndcl", 0);
+	mtx_unlock(&conn->p9c_sndlock);
+
+	pt->pt_close(conn);
+	conn->p9c_connected = 0;
+}
+
+static void
+p9fs_close_conn(struct p9fs_conn *conn)
+{
+
+	p9fs_conn_stop(conn);
+
+	/* Nothing can answer the requests still outstanding now. */
+	p9fs_conn_fail(conn, ECONNABORTED);
+}
+
+/*
+ * Send the requests whose retransmission timer has fired.  Runs from
+ * taskqueue_thread, since the timers run where sending cannot sleep.
+ * Recovery resends everything anyway, so nothing is done meanwhile.
+ */
+static void
+p9fs_conn_rexmt(void *arg, int pending __unused)
+{
+	struct p9fs_conn *conn = arg;
+	struct p9fs_session *p9s = conn->p9c_session;
+	int skip;
+
+	mtx_lock(&p9s->p9s_lock);
+	skip = conn->p9c_recovering || !conn->p9c_connected ||
+	    p9s->p9s_state >= P9S_CLOSING;
+	mtx_unlock(&p9s->p9s_lock);
+	if (!skip)
+		p9fs_conn_resend(conn, 1);
+}
+
+/*
+ * Resend the requests kept when the connection was lost, now that it is
+ * back, or if due is set, only those whose retransmission timer fired.
+ * Each is sent from a copy of the one kept, so that it can be sent again
+ * should the new connection fail too.
+ */
+static void
+p9fs_conn_resend(struct p9fs_conn *conn, int due)
+{
+	struct p9fs_session *p9s = conn->p9c_session;
+	struct p9fs_req_list failed;
+	struct p9fs_tag_slot *ts;
+	struct p9fs_req *req;
+	struct mbuf *head, **tailp, *m;
+	int i;
+
+	STAILQ_INIT(&failed);
+	head = NULL;
+	tailp = &head;
+	mtx_lock(&p9s->p9s_lock);
+	for (i = 0; i < P9FS_TAGS; i++) {
+		ts = &p9s->p9s_tags[i];
+		req = ts->ts_req;
+		if (ts->ts_state != P9TAG_SENT || req == NULL ||
+		    req->req_conn != conn || req->req_rmsg == NULL ||
+		    (due && !req->req_rexmt_due))
+			continue;
+		m = m_copym(req->req_rmsg, 0, M_COPYALL, M_NOWAIT);
+		/* A retransmission can wait for the timer to fire again. */
+		if (m == NULL && due)
+			continue;
+		if (m == NULL) {
+			req->req_error = ENOBUFS;
+			p9fs_req_detach_locked(p9s, req, 0);
+			STAILQ_INSERT_TAIL(&failed, req, req_link);
+			continue;
+		}
+		req->req_resent = 1;
+		if (due) {
+			req->req_rexmt_due = 0;
+			conn->p9c_rexmits++;
+		}
+		*tailp = m;
+		tailp = &m->m_nextpkt;
+	}
+	mtx_unlock(&p9s->p9s_lock);
+
+	while ((req = STAILQ_FIRST(&failed)) != NULL) {
+		STAILQ_REMOVE_HEAD(&failed, req_link);
+		p9fs_req_done(p9s, req);
+	}
+	while ((m = head) != NULL) {
+		head = m->m_nextpkt;
+		m->m_nextpkt = NULL;
+		(void) p9fs_conn_send(conn, m);
+	}
+}
+
+/*
+ * Recover a lost connection: reconnect, negotiate the version, reattach
+ * the root fid, rebuild the connection's other fids with
+ * p9fs_client_replay(), and resend the requests kept when it was lost.
+ * If the connection is lost again meanwhile, start over.  Attempts are
+ * retried with exponential backoff, like a hard NFS mount, until one
+ * succeeds or the mount goes away.  Runs from taskqueue_thread.
+ *
+ * XXX A connect attempt to an unreachable server blocks unmount until it
+ *     times out.
+ */
+static void
+p9fs_conn_recover(void *arg, int pending __unused)
 {
+	struct p9fs_conn *conn = arg;
+	struct p9fs_session *p9s = conn->p9c_session;
+	const struct p9fs_trans *pt = p9s->p9s_trans;
+	u_int gen;
+	int delay, error, tries;
+
 	mtx_lock(&p9s->p9s_lock);
-	if (p9s->p9s_sock != NULL) {
-		struct p9fs_recv *p9r = &p9s->p9s_recv;
-		struct sockbuf *rcv = &p9s->p9s_sock->so_rcv;
+	conn->p9c_rtd = curthread;
+	mtx_unlock(&p9s->p9s_lock);
 
-		p9s->p9s_state = P9S_CLOSING;
+	delay = MAX(hz / 100, 1);
+	for (tries = 1;; tries++) {
+		p9fs_conn_stop(conn);
+		/* Anything sent since the loss was noticed failed as well. */
+		p9fs_conn_fail_reqs(conn, ECONNRESET, 1);
+
+		mtx_lock(&p9s->p9s_lock);
+		if (p9s->p9s_state >= P9S_CLOSING) {
+			mtx_unlock(&p9s->p9s_lock);
+			error = ECONNABORTED;
+			break;
+		}
+		gen = conn->p9c_lostgen;
 		mtx_unlock(&p9s->p9s_lock);
 
-		SOCKBUF_LOCK(rcv);
-		soupcall_clear(p9s->p9s_sock, SO_RCV);
-		while (p9r->p9r_soupcalls > 0)
-			(void) msleep(&p9r->p9r_soupcalls, SOCKBUF_MTX(rcv),
-			    0, "p9rcvup", 0);
-		SOCKBUF_UNLOCK(rcv);
-		(void) soclose(p9s->p9s_sock);
+		mtx_lock(&conn->p9c_sndlock);
+		conn->p9c_snderror = 0;
+		mtx_unlock(&conn->p9c_sndlock);
+		error = pt->pt_connect(conn);
+		if (error == 0) {
+			conn->p9c_connected = 1;
+			error = p9fs_client_version(p9s, conn);
+		}
+		if (error == 0)
+			error = p9fs_client_attach(p9s, conn);
+		if (error == 0)
+			error = p9fs_client_replay(p9s, conn);
+		if (error == 0)
+			p9fs_conn_resend(conn, 0);
 
-		/*
-		 * XXX Can there really be any such threads?  If vflush()
-		 *     has completed, there shouldn't be.  See if we can
-		 *     remove this and related code later.
-		 */
 		mtx_lock(&p9s->p9s_lock);
-		while (p9s->p9s_threads > 0)
-			msleep(p9s, &p9s->p9s_lock, 0, "p9sclose", 0);
-		p9s->p9s_state = P9S_CLOSED;
+		if (error == 0 && conn->p9c_lostgen == gen) {
+			mtx_unlock(&p9s->p9s_lock);
+			break;
+		}
+		if (tries == 1)
+			printf("p9fs: %s: connection %u lost, reconnecting\n",
+			    p9s->p9s_mount->mnt_stat.f_mntonname,
+			    conn->p9c_index);
+		if (p9s->p9s_state < P9S_CLOSING)
+			(void) msleep(&conn->p9c_rtask, &p9s->p9s_lock, 0,
+			    "p9recon", delay);
+		mtx_unlock(&p9s->p9s_lock);
+		delay = MIN(delay * 2, 5 * hz);
+	}
+
+	if (error != 0)
+		p9fs_conn_fail(conn, error);
+	else if (tries > 1)
+		printf("p9fs: %s: connection %u restored\n",
+		    p9s->p9s_mount->mnt_stat.f_mntonname, conn->p9c_index);
+
+	mtx_lock(&p9s->p9s_lock);
+	conn->p9c_recovering = 0;
+	conn->p9c_rtd = NULL;
+	wakeup(&conn->p9c_recovering);
+	mtx_unlock(&p9s->p9s_lock);
+}
+
+void
+p9fs_close_session(struct p9fs_session *p9s)
+{
+	struct p9fs_fidrec_bucket *frb;
+	struct p9fs_fidrec *fr;
+	struct p9fs_fid_chunk *fch;
+	struct p9fs_conn *conn;
+	counter_u64_t *stats;
+	u_int i;
+
+	/*
+	 * Stop any recovery under way: wake it and everyone waiting for it,
+	 * fail the requests it is waiting on, and wait for it to give up.
+	 */
+	mtx_lock(&p9s->p9s_lock);
+	p9s->p9s_state = P9S_CLOSING;
+	wakeup(&p9s->p9s_wnd_waiters);
+	for (i = 0; i < p9s->p9s_nconn; i++) {
+		conn = &p9s->p9s_conns[i];
+		wakeup(&conn->p9c_rtask);
+		wakeup(&conn->p9c_recovering);
+	}
+	mtx_unlock(&p9s->p9s_lock);
+	for (i = 0; i < p9s->p9s_nconn; i++) {
+		conn = &p9s->p9s_conns[i];
+		p9fs_conn_fail(conn, ECONNABORTED);
+		taskqueue_drain(taskqueue_thread, &conn->p9c_rtask);
+		taskqueue_drain(taskqueue_thread, &conn->p9c_xtask);
+		taskqueue_drain(taskqueue_thread, &conn->p9c_ftask);
+		p9fs_close_conn(conn);
 	}
+
+	/*
+	 * XXX Can there really be any such threads?  If vflush()
+	 *     has completed, there shouldn't be.  See if we can
+	 *     remove this and related code later.
+	 */
+	mtx_lock(&p9s->p9s_lock);
+	while (p9s->p9s_threads > 0)
+		msleep(p9s, &p9s->p9s_lock, 0, "p9sclose", 0);
+	p9s->p9s_state = P9S_CLOSED;
 	mtx_unlock(&p9s->p9s_lock);
 
 	/* Would like to explicitly clunk ROOTFID here, but soupcall gone. */
-	delete_unrhdr(p9s->p9s_fids);
-	delete_unrhdr(p9s->p9s_tags);
+	while ((fch = SLIST_FIRST(&p9s->p9s_fidfree)) != NULL) {
+		SLIST_REMOVE_HEAD(&p9s->p9s_fidfree, fch_link);
+		free(fch, M_P9REQ);
+	}
+	free(p9s->p9s_fidcache, M_P9REQ);
+	counter_u64_free(p9s->p9s_fids_inuse);
+	stats = (counter_u64_t *)p9s->p9s_opstats;
+	for (i = 0; i < P9FS_OPSTATS_COUNTERS; i++)
+		counter_u64_free(stats[i]);
+	for (i = 0; i < P9FS_FIDREC_BUCKETS; i++) {
+		frb = &p9s->p9s_fidrecs[i];
+		while ((fr = LIST_FIRST(&frb->frb_head)) != NULL) {
+			LIST_REMOVE(fr, fr_link);
+			free(fr, M_P9REQ);
+		}
+		mtx_destroy(&frb->frb_lock);
+	}
+	free(p9s->p9s_fidrecs, M_P9REQ);
+	mtx_destroy(&p9s->p9s_fidlock);
+	free(p9s->p9s_tags, M_P9REQ);
+	for (i = 0; i < P9FS_CONN_MAX; i++)
+		mtx_destroy(&p9s->p9s_conns[i].p9c_sndlock);
 }
 
-/* FID & tag management.  Makes use of subr_unit, since it's the best fit. */
+/*
+ * FID management.  Each fid unit yields one fid per connection, so that
+ * the fid identifies its connection; unit 0 is reserved for the
+ * connections' root fids.  Units cover the whole 32-bit fid space, short
+ * of NOFID.
+ *
+ * Freed units go to the current CPU's cache, and allocations are served
+ * from it, without taking any lock.  A full cache spills into a chunk on
+ * the session's free list, and an empty one refills from there.  Units
+ * that were never used are handed out only once the free list is empty.
+ *
+ * Returns NOFID if every fid is in use.  XXX Units sitting in other CPUs'
+ * caches are not stolen, so that can happen slightly early.
+ */
 uint32_t
-p9fs_getfid(struct p9fs_session *p9s)
+p9fs_getfid(struct p9fs_session *p9s, u_int conn)
 {
-	return (alloc_unr(p9s->p9s_fids));
+	struct p9fs_fid_cache *fc;
+	struct p9fs_fid_chunk *fch;
+	uint32_t unit, max;
+	int refilled;
+
+	KASSERT(conn < p9s->p9s_nconn, ("%s: bad connection %u",
+	    __func__, conn));
+
+	critical_enter();
+	fc = &p9s->p9s_fidcache[curcpu];
+	if (fc->fc_count > 0) {
+		unit = fc->fc_units[--fc->fc_count];
+		critical_exit();
+		goto out;
+	}
+	critical_exit();
+
+	/* Refill this CPU's cache from the free list. */
+	mtx_lock(&p9s->p9s_fidlock);
+	fch = SLIST_FIRST(&p9s->p9s_fidfree);
+	if (fch != NULL)
+		SLIST_REMOVE_HEAD(&p9s->p9s_fidfree, fch_link);
+	mtx_unlock(&p9s->p9s_fidlock);
+	if (fch != NULL) {
+		critical_enter();
+		fc = &p9s->p9s_fidcache[curcpu];
+		refilled = fc->fc_count == 0;
+		if (refilled) {
+			bcopy(fch->fch_units, fc->fc_units,
+			    sizeof (fc->fc_units));
+			fc->fc_count = P9FS_FIDCACHE_SIZE;
+		}
+		unit = fc->fc_units[--fc->fc_count];
+		critical_exit();
+
+		if (refilled)
+			free(fch, M_P9REQ);
+		else {
+			/* Another thread refilled the cache; keep the chunk. */
+			mtx_lock(&p9s->p9s_fidlock);
+			SLIST_INSERT_HEAD(&p9s->p9s_fidfree, fch, fch_link);
+			mtx_unlock(&p9s->p9s_fidlock);
+		}
+		goto out;
+	}
+
+	/* Take a unit that has never been used. */
+	max = (NOFID - p9s->p9s_nconn) / p9s->p9s_nconn;
+	do {
+		unit = p9s->p9s_fidnext;
+		if (unit > max)
+			return (NOFID);
+	} while (atomic_cmpset_32(&p9s->p9s_fidnext, unit, unit + 1) == 0);
+
+out:
+	counter_u64_add(p9s->p9s_fids_inuse, 1);
+	return (unit * p9s->p9s_nconn + conn);
 }
+
 void
 p9fs_relfid(struct p9fs_session *p9s, uint32_t fid)
 {
-	free_unr(p9s->p9s_fids, fid);
+	struct p9fs_fid_cache *fc;
+	struct p9fs_fid_chunk *fch;
+	uint32_t unit = fid / p9s->p9s_nconn;
+
+	KASSERT(unit != 0 && fid != NOFID, ("%s: bad fid %u", __func__, fid));
+	counter_u64_add(p9s->p9s_fids_inuse, -1);
+	p9fs_fidrec_drop(p9s, fid);
+
+	critical_enter();
+	fc = &p9s->p9s_fidcache[curcpu];
+	if (fc->fc_count < P9FS_FIDCACHE_SIZE) {
+		fc->fc_units[fc->fc_count++] = unit;
+		critical_exit();
+		return;
+	}
+	critical_exit();
+
+	/* The cache is full; move its contents onto the free list. */
+	fch = malloc(sizeof (*fch), M_P9REQ, M_WAITOK);
+	critical_enter();
+	fc = &p9s->p9s_fidcache[curcpu];
+	if (fc->fc_count < P9FS_FIDCACHE_SIZE) {
+		fc->fc_units[fc->fc_count++] = unit;
+		critical_exit();
+		free(fch, M_P9REQ);
+		return;
+	}
+	bcopy(fc->fc_units, fch->fch_units, sizeof (fch->fch_units));
+	fc->fc_units[0] = unit;
+	fc->fc_count = 1;
+	critical_exit();
+
+	mtx_lock(&p9s->p9s_fidlock);
+	SLIST_INSERT_HEAD(&p9s->p9s_fidfree, fch, fch_link);
+	mtx_unlock(&p9s->p9s_fidlock);
+}
+
+/*
+ * Fid records, for p9fs_client_replay().  Every fid walked from a root fid
+ * or from another recorded fid is recorded, along with the open mode once
+ * it is opened; the record goes away when the fid is released.
+ */
+static struct p9fs_fidrec *
+p9fs_fidrec_lookup(struct p9fs_fidrec_bucket *frb, uint32_t fid)
+{
+	struct p9fs_fidrec *fr;
+
+	mtx_assert(&frb->frb_lock, MA_OWNED);
+	LIST_FOREACH(fr, &frb->frb_head, fr_link)
+		if (fr->fr_fid == fid)
+			return (fr);
+	return (NULL);
+}
+
+/*
+ * Record that newfid was walked to from fid, through the nwname names in
+ * wnames, with qid as the result.  A clone inherits fid's qid.  The caller
+ * holds fid, so its record cannot go away meanwhile.
+ */
+void
+p9fs_fidrec_walkv(struct p9fs_session *p9s, uint32_t fid, uint32_t newfid,
+    const struct p9fs_str *wnames, uint16_t nwname, struct p9fs_qid *qid)
+{
+	struct p9fs_fidrec_bucket *frb;
+	struct p9fs_fidrec *fr, *pfr;
+	struct p9fs_qid pqid;
+	size_t off, pathlen;
+	uint16_t i, n;
+
+	if (P9FS_FID_ROOT(p9s, fid)) {
+		pfr = NULL;
+		pathlen = 0;
+		n = 0;
+		pqid = p9s->p9s_rootnp.p9n_qid;
+	} else {
+		frb = P9FS_FIDREC_BUCKET(p9s, fid);
+		mtx_lock(&frb->frb_lock);
+		pfr = p9fs_fidrec_lookup(frb, fid);
+		mtx_unlock(&frb->frb_lock);
+		if (pfr == NULL)
+			return;
+		pathlen = pfr->fr_pathlen;
+		n = pfr->fr_nwname;
+		pqid = pfr->fr_qid;
+	}
+	off = pathlen;
+	for (i = 0; i < nwname; i++)
+		pathlen += wnames[i].p9str_size + 1;
+	if (pathlen > UINT16_MAX || n + nwname > UINT16_MAX)
+		return;
+
+	fr = malloc(sizeof (*fr) + pathlen, M_P9REQ, M_WAITOK);
+	fr->fr_fid = newfid;
+	fr->fr_mode = -1;
+	fr->fr_nwname = n + nwname;
+	fr->fr_pathlen = pathlen;
+	fr->fr_qid = qid != NULL ? *qid : pqid;
+	if (pfr != NULL)
+		bcopy(pfr->fr_path, fr->fr_path, pfr->fr_pathlen);
+	for (i = 0; i < nwname; i++) {
+		bcopy(wnames[i].p9str_str, fr->fr_path + off,
+		    wnames[i].p9str_size);
+		off += wnames[i].p9str_size;
+		fr->fr_path[off++] = '\0';
+	}
+
+	p9fs_fidrec_drop(p9s, newfid);
+	frb = P9FS_FIDREC_BUCKET(p9s, newfid);
+	mtx_lock(&frb->frb_lock);
+	LIST_INSERT_HEAD(&frb->frb_head, fr, fr_link);
+	mtx_unlock(&frb->frb_lock);
+}
+
+/* Record a walk of one name, or a clone if name is NULL. */
+void
+p9fs_fidrec_walk(struct p9fs_session *p9s, uint32_t fid, uint32_t newfid,
+    const char *name, uint16_t namelen, struct p9fs_qid *qid)
+{
+	struct p9fs_str wname;
+
+	wname.p9str_str = __DECONST(char *, name);
+	wname.p9str_size = namelen;
+	p9fs_fidrec_walkv(p9s, fid, newfid, &wname, name != NULL ? 1 : 0,
+	    qid);
 }
+
+/*
+ * Return a copy of the path recorded for fid, in M_TEMP, along with its
+ * number of names and the qid it leads to.  A root fid's path is empty.
+ * The caller holds fid, as for p9fs_fidrec_walk().
+ */
+int
+p9fs_fidrec_path(struct p9fs_session *p9s, uint32_t fid, char **pathp,
+    uint16_t *nwnamep, struct p9fs_qid *qidp)
+{
+	struct p9fs_fidrec_bucket *frb;
+	struct p9fs_fidrec *fr;
+
+	if (P9FS_FID_ROOT(p9s, fid)) {
+		*pathp = NULL;
+		*nwnamep = 0;
+		*qidp = p9s->p9s_rootnp.p9n_qid;
+		return (0);
+	}
+	frb = P9FS_FIDREC_BUCKET(p9s, fid);
+	mtx_lock(&frb->frb_lock);
+	fr = p9fs_fidrec_lookup(frb, fid);
+	mtx_unlock(&frb->frb_lock);
+	if (fr == NULL)
+		return (ENOENT);
+	*pathp = malloc(fr->fr_pathlen + 1, M_TEMP, M_WAITOK);
+	bcopy(fr->fr_path, *pathp, fr->fr_pathlen);
+	*nwnamep = fr->fr_nwname;
+	*qidp = fr->fr_qid;
+	return (0);
+}
+
+/*
+ * Record the mode a fid was opened in.  OTRUNC is left out, so that
+ * reopening the file on a new connection does not truncate it again.
+ */
+void
+p9fs_fidrec_open(struct p9fs_session *p9s, uint32_t fid, uint8_t mode)
+{
+	struct p9fs_fidrec_bucket *frb = P9FS_FIDREC_BUCKET(p9s, fid);
+	struct p9fs_fidrec *fr;
+
+	mtx_lock(&frb->frb_lock);
+	fr = p9fs_fidrec_lookup(frb, fid);
+	if (fr != NULL)
+		fr->fr_mode = mode & ~OTRUNC;
+	mtx_unlock(&frb->frb_lock);
+}
+
+static void
+p9fs_fidrec_drop(struct p9fs_session *p9s, uint32_t fid)
+{
+	struct p9fs_fidrec_bucket *frb = P9FS_FIDREC_BUCKET(p9s, fid);
+	struct p9fs_fidrec *fr;
+
+	mtx_lock(&frb->frb_lock);
+	fr = p9fs_fidrec_lookup(frb, fid);
+	if (fr != NULL)
+		LIST_REMOVE(fr, fr_link);
+	mtx_unlock(&frb->frb_lock);
+	if (fr != NULL)
+		free(fr, M_P9REQ);
+}
+
+/*
+ * Tag management.  Tags come off the head of the session's free list;
+ * if every tag is in use, wait for a reply to release one.
+ */
 uint16_t
 p9fs_gettag(struct p9fs_session *p9s)
 {
-	return (alloc_unr(p9s->p9s_tags));
+	struct p9fs_tag_slot *ts;
+	sbintime_t asked = 0;
+	uint16_t tag;
+
+	mtx_lock(&p9s->p9s_lock);
+	while ((tag = p9s->p9s_tag_free) == NOTAG) {
+		if (asked == 0)
+			asked = sbinuptime();
+		p9s->p9s_tag_waiters++;
+		(void) msleep(&p9s->p9s_tag_free, &p9s->p9s_lock, 0, "p9tag",
+		    0);
+		p9s->p9s_tag_waiters--;
+	}
+	ts = &p9s->p9s_tags[tag];
+	p9s->p9s_tag_free = ts->ts_next;
+	ts->ts_state = P9TAG_RESERVED;
+	ts->ts_reserved = sbinuptime();
+	ts->ts_tagwait = asked != 0 ? ts->ts_reserved - asked : 0;
+	if (++p9s->p9s_tags_inuse > p9s->p9s_tags_max)
+		p9s->p9s_tags_max = p9s->p9s_tags_inuse;
+	mtx_unlock(&p9s->p9s_lock);
+
+	return (tag);
 }
 void
 p9fs_reltag(struct p9fs_session *p9s, uint16_t tag)
 {
-	free_unr(p9s->p9s_tags, tag);
+	mtx_lock(&p9s->p9s_lock);
+	p9fs_tag_free_locked(p9s, NULL, tag);
+	mtx_unlock(&p9s->p9s_lock);
 }
@@ -32,21 +32,67 @@
 #define	__P9FS_SUBR_H__
 
 /* Plan9 message handling routines using opaque handles */
-void *p9fs_msg_create(enum p9fs_msg_type, uint16_t);
+void *p9fs_msg_create(enum p9fs_msg_type, uint16_t, size_t);
 int p9fs_msg_add(void *, size_t, void *);
-int p9fs_msg_add_string(void *, const char *, uint16_t);
+
+/* Message codec, generated from the message specifications */
+const char *p9fs_msg_name(enum p9fs_msg_type);
+size_t p9fs_msg_fields_size(enum p9fs_msg_type, const void *);
+void *p9fs_msg_build(enum p9fs_msg_type, uint16_t, const void *);
+void p9fs_msg_hdr(void *, struct p9fs_msg_hdr *);
+int p9fs_msg_parse(void *, enum p9fs_msg_type, void *);
+void p9fs_msg_print(void *);
+size_t p9fs_stat_size(const struct p9fs_stat *);
+int p9fs_stat_pack(void *, const struct p9fs_stat *);
+int p9fs_stat_parse(void *, size_t *, size_t, struct p9fs_stat *);
+size_t p9fs_str_copy(const struct p9fs_str *, char *, size_t);
+int p9fs_str_eq(const struct p9fs_str *, const char *);
+
+#ifdef _KERNEL
+/*
+ * Console output for the mount's debug level: 1 traces vnode operations
+ * and server errors, 2 adds directory entries and attributes, and 3 adds
+ * every message sent and received.
+ */
+#define	P9FS_DEBUG(p9s, level, ...) do {				\
+	if ((p9s)->p9s_debug >= (level))				\
+		printf(__VA_ARGS__);					\
+} while (0)
+
 int p9fs_msg_add_uio(void *, struct uio *, uint32_t);
 int p9fs_msg_send(struct p9fs_session *, void **);
-void p9fs_msg_recv(struct p9fs_session *);
-void p9fs_msg_get(void *, size_t *, void **, size_t);
-void p9fs_msg_get_str(void *, size_t *, struct p9fs_str *);
+int p9fs_msg_send_conn(struct p9fs_session *, struct p9fs_conn *, void **);
+int p9fs_msg_send_start(struct p9fs_session *, struct p9fs_conn *, void **,
+    struct p9fs_msg_sync *);
+int p9fs_msg_send_wait(struct p9fs_session *, struct p9fs_msg_sync *,
+    void **);
+int p9fs_msg_send_async(struct p9fs_session *, struct p9fs_conn *, void *,
+    p9fs_msg_cb, void *);
+void p9fs_msg_deliver(struct p9fs_conn *, struct mbuf *);
 void p9fs_msg_destroy(struct p9fs_session *, void *);
-int32_t p9fs_msg_payload_len(void *);
+int p9fs_msg_uiomove(void *, size_t, uint32_t, struct uio *);
 void p9fs_init_session(struct p9fs_session *);
 void p9fs_close_session(struct p9fs_session *);
-uint32_t p9fs_getfid(struct p9fs_session *);
+uint32_t p9fs_getfid(struct p9fs_session *, u_int);
 void p9fs_relfid(struct p9fs_session *, uint32_t);
+void p9fs_fidrec_walk(struct p9fs_session *, uint32_t, uint32_t, const char *,
+    uint16_t, struct p9fs_qid *);
+void p9fs_fidrec_walkv(struct p9fs_session *, uint32_t, uint32_t,
+    const struct p9fs_str *, uint16_t, struct p9fs_qid *);
+int p9fs_fidrec_path(struct p9fs_session *, uint32_t, char **, uint16_t *,
+    struct p9fs_qid *);
+void p9fs_fidrec_open(struct p9fs_session *, uint32_t, uint8_t);
+struct p9fs_conn *p9fs_conn_pick(struct p9fs_session *);
+void p9fs_conn_fail(struct p9fs_conn *, int);
+void p9fs_conn_lost(struct p9fs_conn *, int);
+int p9fs_rtt_timeout(struct p9fs_session *, uint8_t);
+int p9fs_req_outstanding(struct p9fs_session *, struct p9fs_slowreq *, int);
 uint16_t p9fs_gettag(struct p9fs_session *);
 void p9fs_reltag(struct p9fs_session *, uint16_t);
 
+/* Transports */
+extern const struct p9fs_trans p9fs_trans_sock;
+extern const struct p9fs_trans p9fs_trans_loop;
+#endif /* _KERNEL */
+
 #endif
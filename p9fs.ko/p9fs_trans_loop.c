@@ -0,0 +1,488 @@
+/*-
+ * Copyright (c) 2015 Will Andrews.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS        
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR       
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS        
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR           
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF             
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS         
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN          
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)          
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       
+ * POSSIBILITY OF SUCH DAMAGE.                                                      
+ */
+
+/*
+ * Plan9 filesystem (9P2000.u) loopback transport.  Requests are answered
+ * in memory, as they are sent, by a tiny synthetic server.  With no network
+ * or server in the way, this measures the client's own cost per request.
+ *
+ * The synthetic tree is a root directory holding a single file, "zero",
+ * which reads as P9FS_LOOP_ZEROLEN zero bytes.  Only what is needed to
+ * attach, walk, open, read, stat and clunk is implemented; anything else
+ * fails with EOPNOTSUPP.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/endian.h>
+#include <sys/mbuf.h>
+#include <sys/types.h>
+#include <sys/malloc.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+#include <sys/mount.h>
+#include <sys/queue.h>
+#include <sys/vnode.h>
+#include <sys/counter.h>
+#include <sys/sysctl.h>
+#include <sys/callout.h>
+#include <sys/taskqueue.h>
+
+#include "p9fs_proto.h"
+#include "p9fs_subr.h"
+
+static MALLOC_DEFINE(M_P9LOOP, "p9fsloop", "Loopback transport for p9fs");
+
+#define	P9FS_LOOP_ZEROLEN	((uint64_t)1 << 40)
+#define	P9FS_LOOP_HASHSIZE	256
+#define	P9FS_LOOP_HASH(fid)	((fid) & (P9FS_LOOP_HASHSIZE - 1))
+
+struct p9fs_loop_node {
+	const char *ln_name;
+	uint64_t ln_path;
+	uint8_t ln_qtype;
+	uint32_t ln_mode;
+	uint64_t ln_length;
+};
+
+static const struct p9fs_loop_node p9fs_loop_root = {
+	"/", 1, QTDIR, DMDIR | 0555, 0
+};
+static const struct p9fs_loop_node p9fs_loop_zero = {
+	"zero", 2, QTFILE, 0444, P9FS_LOOP_ZEROLEN
+};
+
+struct p9fs_loop_fid {
+	LIST_ENTRY(p9fs_loop_fid) lf_link;
+	uint32_t lf_fid;
+	const struct p9fs_loop_node *lf_node;
+};
+LIST_HEAD(p9fs_loop_fid_list, p9fs_loop_fid);
+
+/*
+ * Per-connection server state.  Only the connection's sender runs the
+ * server, so no lock is needed.
+ */
+struct p9fs_loop {
+	struct p9fs_loop_fid_list pl_fids[P9FS_LOOP_HASHSIZE];
+};
+
+static char p9fs_loop_zeroes[PAGE_SIZE];
+
+static struct p9fs_loop_fid *
+p9fs_loop_fid_lookup(struct p9fs_loop *pl, uint32_t fid)
+{
+	struct p9fs_loop_fid *lf;
+
+	LIST_FOREACH(lf, &pl->pl_fids[P9FS_LOOP_HASH(fid)], lf_link)
+		if (lf->lf_fid == fid)
+			return (lf);
+	return (NULL);
+}
+
+/* Point fid at node, creating it if it does not exist yet. */
+static void
+p9fs_loop_fid_bind(struct p9fs_loop *pl, uint32_t fid,
+    const struct p9fs_loop_node *node)
+{
+	struct p9fs_loop_fid *lf;
+
+	lf = p9fs_loop_fid_lookup(pl, fid);
+	if (lf == NULL) {
+		lf = malloc(sizeof (*lf), M_P9LOOP, M_WAITOK);
+		lf->lf_fid = fid;
+		LIST_INSERT_HEAD(&pl->pl_fids[P9FS_LOOP_HASH(fid)], lf,
+		    lf_link);
+	}
+	lf->lf_node = node;
+}
+
+static int
+p9fs_loop_fid_drop(struct p9fs_loop *pl, uint32_t fid)
+{
+	struct p9fs_loop_fid *lf;
+
+	if ((lf = p9fs_loop_fid_lookup(pl, fid)) == NULL)
+		return (EBADF);
+	LIST_REMOVE(lf, lf_link);
+	free(lf, M_P9LOOP);
+	return (0);
+}
+
+static void
+p9fs_loop_qid(const struct p9fs_loop_node *node, struct p9fs_qid *qid)
+{
+
+	qid->qid_mode = node->ln_qtype;
+	qid->qid_version = 0;
+	qid->qid_path = node->ln_path;
+}
+
+/* A node's stat entry; uid, gid, muid and the extension are all empty. */
+static void
+p9fs_loop_stat_fill(const struct p9fs_loop_node *node, struct p9fs_stat *st)
+{
+
+	bzero(st, sizeof (*st));
+	p9fs_loop_qid(node, &st->stat_qid);
+	st->stat_mode = node->ln_mode;
+	st->stat_length = node->ln_length;
+	st->stat_name.p9str_str = __DECONST(char *, node->ln_name);
+	st->stat_name.p9str_size = strlen(node->ln_name);
+	st->stat_uid.p9str_str = st->stat_gid.p9str_str =
+	    st->stat_muid.p9str_str = st->stat_extension.p9str_str = "";
+}
+
+/* Reply with msg, of the given type, or fail if it cannot be built. */
+static int
+p9fs_loop_reply(struct mbuf **rp, enum p9fs_msg_type type, uint16_t tag,
+    const void *msg)
+{
+
+	*rp = p9fs_msg_build(type, tag, msg);
+	return (*rp != NULL ? 0 : ENOBUFS);
+}
+
+static int
+p9fs_loop_version(struct p9fs_loop *pl __unused, const union p9fs_msg *t,
+    struct mbuf **rp)
+{
+	const struct p9fs_msg_Tversion *tv = &t->p9msg_Tversion;
+	struct p9fs_msg_Rversion rv;
+
+	rv.Rversion_max_size = tv->Tversion_max_size;
+	rv.Rversion_version = tv->Tversion_version;
+	if (!p9fs_str_eq(&tv->Tversion_version, UN_VERS)) {
+		rv.Rversion_version.p9str_str = "unknown";
+		rv.Rversion_version.p9str_size = strlen("unknown");
+	}
+	return (p9fs_loop_reply(rp, Rversion, tv->Tversion_tag, &rv));
+}
+
+static int
+p9fs_loop_attach(struct p9fs_loop *pl, const union p9fs_msg *t,
+    struct mbuf **rp)
+{
+	const struct p9fs_msg_Tattach *ta = &t->p9msg_Tattach;
+	struct p9fs_msg_Rattach ra;
+
+	p9fs_loop_fid_bind(pl, ta->Tattach_fid, &p9fs_loop_root);
+	p9fs_loop_qid(&p9fs_loop_root, &ra.Rattach_qid);
+	return (p9fs_loop_reply(rp, Rattach, ta->Tattach_tag, &ra));
+}
+
+static int
+p9fs_loop_walk(struct p9fs_loop *pl, const union p9fs_msg *t,
+    struct mbuf **rp)
+{
+	const struct p9fs_msg_Twalk *tw = &t->p9msg_Twalk;
+	const struct p9fs_wnames *wn = &tw->Twalk_wnames;
+	struct p9fs_msg_Rwalk rw;
+	const struct p9fs_loop_node *node;
+	struct p9fs_loop_fid *lf;
+	uint16_t i;
+
+	if ((lf = p9fs_loop_fid_lookup(pl, tw->Twalk_fid)) == NULL)
+		return (EBADF);
+
+	/* Walk as far as possible; a partial walk leaves newfid unbound. */
+	node = lf->lf_node;
+	for (i = 0; i < wn->wn_nwname; i++) {
+		if (p9fs_str_eq(&wn->wn_wname[i], ".."))
+			node = &p9fs_loop_root;
+		else if (node == &p9fs_loop_root &&
+		    p9fs_str_eq(&wn->wn_wname[i], p9fs_loop_zero.ln_name))
+			node = &p9fs_loop_zero;
+		else
+			break;
+		p9fs_loop_qid(node, &rw.Rwalk_wqids.wq_qid[i]);
+	}
+	if (i == 0 && wn->wn_nwname > 0)
+		return (ENOENT);
+	if (i == wn->wn_nwname)
+		p9fs_loop_fid_bind(pl, tw->Twalk_newfid, node);
+
+	rw.Rwalk_wqids.wq_nwqid = i;
+	return (p9fs_loop_reply(rp, Rwalk, tw->Twalk_tag, &rw));
+}
+
+static int
+p9fs_loop_open(struct p9fs_loop *pl, const union p9fs_msg *t,
+    struct mbuf **rp)
+{
+	const struct p9fs_msg_Topen *to = &t->p9msg_Topen;
+	struct p9fs_msg_Ropen ro;
+	struct p9fs_loop_fid *lf;
+
+	if ((lf = p9fs_loop_fid_lookup(pl, to->Topen_fid)) == NULL)
+		return (EBADF);
+	p9fs_loop_qid(lf->lf_node, &ro.Ropen_qid);
+	ro.Ropen_iounit = 0;
+	return (p9fs_loop_reply(rp, Ropen, to->Topen_tag, &ro));
+}
+
+/*
+ * Directories read as the stat entries of their contents, all returned at
+ * offset 0; files read as zeroes.
+ */
+static int
+p9fs_loop_read(struct p9fs_loop *pl, const union p9fs_msg *t,
+    struct mbuf **rp)
+{
+	const struct p9fs_msg_Tread *tr = &t->p9msg_Tread;
+	struct p9fs_msg_Rread rr;
+	const struct p9fs_loop_node *node;
+	struct p9fs_loop_fid *lf;
+	struct p9fs_stat st;
+	uint32_t count, len;
+	int error;
+
+	if ((lf = p9fs_loop_fid_lookup(pl, tr->Tread_fid)) == NULL)
+		return (EBADF);
+	node = lf->lf_node;
+
+	count = tr->Tread_count;
+	if (node->ln_qtype & QTDIR) {
+		p9fs_loop_stat_fill(&p9fs_loop_zero, &st);
+		if (tr->Tread_offset != 0 || count < p9fs_stat_size(&st))
+			count = 0;
+		else
+			count = p9fs_stat_size(&st);
+	} else if (tr->Tread_offset >= node->ln_length)
+		count = 0;
+	else if (count > node->ln_length - tr->Tread_offset)
+		count = node->ln_length - tr->Tread_offset;
+
+	rr.Rread_data.pd_count = count;
+	error = p9fs_loop_reply(rp, Rread, tr->Tread_tag, &rr);
+	if (error == 0 && count > 0 && (node->ln_qtype & QTDIR))
+		error = p9fs_stat_pack(*rp, &st);
+	else {
+		while (error == 0 && count > 0) {
+			len = MIN(count, sizeof (p9fs_loop_zeroes));
+			error = p9fs_msg_add(*rp, len, p9fs_loop_zeroes);
+			count -= len;
+		}
+	}
+	if (error != 0) {
+		m_freem(*rp);
+		*rp = NULL;
+	}
+	return (error);
+}
+
+static int
+p9fs_loop_stat(struct p9fs_loop *pl, const union p9fs_msg *t,
+    struct mbuf **rp)
+{
+	const struct p9fs_msg_Tstat *ts = &t->p9msg_Tstat;
+	struct p9fs_msg_Rstat rs;
+	struct p9fs_loop_fid *lf;
+
+	if ((lf = p9fs_loop_fid_lookup(pl, ts->Tstat_fid)) == NULL)
+		return (EBADF);
+	p9fs_loop_stat_fill(lf->lf_node, &rs.Rstat_stat);
+	return (p9fs_loop_reply(rp, Rstat, ts->Tstat_tag, &rs));
+}
+
+static int
+p9fs_loop_clunk(struct p9fs_loop *pl, const union p9fs_msg *t,
+    struct mbuf **rp)
+{
+	const struct p9fs_msg_Tclunk *tc = &t->p9msg_Tclunk;
+	struct p9fs_msg_Rclunk rc;
+	int error;
+
+	error = p9fs_loop_fid_drop(pl, tc->Tclunk_fid);
+	if (error != 0)
+		return (error);
+	return (p9fs_loop_reply(rp, Rclunk, tc->Tclunk_tag, &rc));
+}
+
+/* Tremove fails, but still clunks the fid. */
+static int
+p9fs_loop_remove(struct p9fs_loop *pl, const union p9fs_msg *t,
+    struct mbuf **rp __unused)
+{
+	int error;
+
+	error = p9fs_loop_fid_drop(pl, t->p9msg_Tremove.Tremove_fid);
+	return (error != 0 ? error : EACCES);
+}
+
+static int
+p9fs_loop_flush(struct p9fs_loop *pl __unused, const union p9fs_msg *t,
+    struct mbuf **rp)
+{
+	struct p9fs_msg_Rflush rf;
+
+	/* Every request is answered as it is sent; there is nothing to do. */
+	return (p9fs_loop_reply(rp, Rflush, t->p9msg_Tflush.Tflush_tag, &rf));
+}
+
+typedef int (*p9fs_loop_handler)(struct p9fs_loop *, const union p9fs_msg *,
+    struct mbuf **);
+
+static const struct {
+	enum p9fs_msg_type lh_type;
+	p9fs_loop_handler lh_func;
+} p9fs_loop_handlers[] = {
+	{ Tversion,	p9fs_loop_version },
+	{ Tattach,	p9fs_loop_attach },
+	{ Tflush,	p9fs_loop_flush },
+	{ Twalk,	p9fs_loop_walk },
+	{ Topen,	p9fs_loop_open },
+	{ Tread,	p9fs_loop_read },
+	{ Tclunk,	p9fs_loop_clunk },
+	{ Tremove,	p9fs_loop_remove },
+	{ Tstat,	p9fs_loop_stat },
+};
+
+/*
+ * Answer a single request, which is consumed.  Returns NULL if no reply
+ * could be built.
+ */
+static struct mbuf *
+p9fs_loop_handle(struct p9fs_loop *pl, struct mbuf *req)
+{
+	static const char ename[] = "p9fs loopback error";
+	struct p9fs_msg_hdr hdr;
+	struct p9fs_msg_Rerror re;
+	union p9fs_msg t;
+	struct mbuf *m = NULL;
+	u_int i;
+	int error;
+
+	p9fs_msg_hdr(req, &hdr);
+	error = p9fs_msg_parse(req, hdr.hdr_type, &t);
+	if (error == 0) {
+		error = EOPNOTSUPP;
+		for (i = 0; i < nitems(p9fs_loop_handlers); i++) {
+			if (p9fs_loop_handlers[i].lh_type == hdr.hdr_type) {
+				error = p9fs_loop_handlers[i].lh_func(pl, &t,
+				    &m);
+				break;
+			}
+		}
+	}
+	m_freem(req);
+	if (error != 0) {
+		re.Rerror_ename.p9str_str = __DECONST(char *, ename);
+		re.Rerror_ename.p9str_size = sizeof (ename) - 1;
+		re.Rerror_errnum = error;
+		m = p9fs_msg_build(Rerror, hdr.hdr_tag, &re);
+		if (m == NULL)
+			return (NULL);
+	}
+
+	le32enc(mtod(m, void *), m->m_pkthdr.len);
+	return (m);
+}
+
+static int
+p9fs_loop_connect(struct p9fs_conn *conn)
+{
+	struct p9fs_loop *pl;
+	int i;
+
+	pl = malloc(sizeof (*pl), M_P9LOOP, M_WAITOK);
+	for (i = 0; i < P9FS_LOOP_HASHSIZE; i++)
+		LIST_INIT(&pl->pl_fids[i]);
+	conn->p9c_tpriv = pl;
+	return (0);
+}
+
+/*
+ * Split the chain back into its messages and answer each in turn.  The
+ * replies are delivered before this returns, so the requester may already
+ * be done with a request by the time its send completes.
+ */
+static int
+p9fs_loop_send(struct p9fs_conn *conn, struct mbuf *m)
+{
+	struct p9fs_loop *pl = conn->p9c_tpriv;
+	struct mbuf *next, *reply;
+	uint32_t size;
+
+	while (m != NULL) {
+		m_copydata(m, 0, sizeof (size), (void *)&size);
+		size = le32toh(size);
+		if (size < P9_HDRSZ ||
+		    size > m_length(m, NULL)) {
+			m_freem(m);
+			return (EINVAL);
+		}
+		next = NULL;
+		if (size < m_length(m, NULL)) {
+			next = m_split(m, size, M_WAITOK);
+			if (next == NULL) {
+				m_freem(m);
+				return (ENOBUFS);
+			}
+		}
+
+		reply = p9fs_loop_handle(pl, m);
+		if (reply != NULL)
+			p9fs_msg_deliver(conn, reply);
+		m = next;
+	}
+	return (0);
+}
+
+static void
+p9fs_loop_shutdown(struct p9fs_conn *conn __unused)
+{
+
+	/* Sends never block, so there is no sender to wake. */
+}
+
+static void
+p9fs_loop_close(struct p9fs_conn *conn)
+{
+	struct p9fs_loop *pl = conn->p9c_tpriv;
+	struct p9fs_loop_fid *lf;
+	int i;
+
+	for (i = 0; i < P9FS_LOOP_HASHSIZE; i++) {
+		while ((lf = LIST_FIRST(&pl->pl_fids[i])) != NULL) {
+			LIST_REMOVE(lf, lf_link);
+			free(lf, M_P9LOOP);
+		}
+	}
+	free(pl, M_P9LOOP);
+	conn->p9c_tpriv = NULL;
+}
+
+const struct p9fs_trans p9fs_trans_loop = {
+	.pt_name =	"loop",
+	.pt_connect =	p9fs_loop_connect,
+	.pt_send =	p9fs_loop_send,
+	.pt_shutdown =	p9fs_loop_shutdown,
+	.pt_close =	p9fs_loop_close,
+};
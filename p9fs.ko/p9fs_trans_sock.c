@@ -0,0 +1,439 @@
+/*-
+ * Copyright (c) 2015 Will Andrews.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS        
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED   
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR       
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS        
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR           
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF             
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS         
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN          
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)          
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE       
+ * POSSIBILITY OF SUCH DAMAGE.                                                      
+ */
+
+/*
+ * Plan9 filesystem (9P2000.u) socket transport.  Carries messages over a
+ * connected TCP, UDP or local-domain socket, and reassembles replies from
+ * the socket's receive upcall.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/endian.h>
+#include <sys/mbuf.h>
+#include <sys/types.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+#include <sys/mount.h>
+#include <sys/proc.h>
+#include <sys/protosw.h>
+#include <sys/sdt.h>
+#include <sys/socket.h>
+#include <sys/socketvar.h>
+#include <sys/sockopt.h>
+#include <sys/uio.h>
+#include <sys/vnode.h>
+#include <sys/counter.h>
+#include <sys/sysctl.h>
+#include <sys/callout.h>
+#include <sys/taskqueue.h>
+#include <netinet/in.h>
+#include <netinet/in_pcb.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <netinet/tcp_var.h>
+#include <netinet/udp.h>
+
+#include "p9fs_proto.h"
+#include "p9fs_subr.h"
+
+/*
+ * DTrace probes for the receive path: rcv:data fires for each soreceive()
+ * with the bytes taken, rcv:drop for each datagram discarded, and
+ * rcv:upcall once per upcall with the messages delivered and any error.
+ */
+SDT_PROVIDER_DECLARE(p9fs);
+SDT_PROBE_DEFINE2(p9fs, sock, rcv, data, "struct p9fs_conn *", "u_int");
+SDT_PROBE_DEFINE2(p9fs, sock, rcv, drop, "struct p9fs_conn *", "u_int");
+SDT_PROBE_DEFINE3(p9fs, sock, rcv, upcall, "struct p9fs_conn *", "u_int",
+    "int");
+
+static void
+p9fs_sock_setopt(struct socket *so, int sopt_level, int sopt_name)
+{
+	struct sockopt sopt = { 0 };
+	int one = 1;
+
+	sopt.sopt_dir = SOPT_SET;
+	sopt.sopt_level = sopt_level;
+	sopt.sopt_name = sopt_name;
+	sopt.sopt_val = &one;
+	sopt.sopt_valsize = sizeof(one);
+	sosetopt(so, &sopt);
+}
+
+/*
+ * Receive from a datagram socket, where each datagram holds one message.
+ * Datagrams whose size field disagrees with their length, or that are too
+ * large, are dropped; a retransmission may yet get the reply through.
+ * Called with the receive sockbuf locked.
+ */
+static int
+p9fs_sock_rcv_dgram(struct p9fs_conn *conn, struct socket *so,
+    u_int *nmsgsp)
+{
+	struct p9fs_session *p9s = conn->p9c_session;
+	struct p9fs_recv *p9r = &conn->p9c_recv;
+	struct mbuf *m;
+	struct uio uio;
+	uint32_t size;
+	u_int avail, len;
+	int error, rcvflag;
+
+	while ((avail = sbavail(&so->so_rcv)) > 0) {
+		uio.uio_resid = avail;
+		SOCKBUF_UNLOCK(&so->so_rcv);
+		rcvflag = MSG_DONTWAIT | MSG_SOCALLBCK;
+		error = soreceive(so, NULL, &uio, &m, NULL, &rcvflag);
+		SOCKBUF_LOCK(&so->so_rcv);
+		if (error == EWOULDBLOCK)
+			break;
+		if (error != 0)
+			return (error);
+		if (m == NULL)
+			break;
+
+		len = avail - uio.uio_resid;
+		SDT_PROBE2(p9fs, sock, rcv, data, conn, len);
+		p9r->p9r_rcvcalls++;
+		p9r->p9r_rcvbytes += len;
+		size = 0;
+		if (len >= sizeof (size)) {
+			m_copydata(m, 0, sizeof (size), (void *)&size);
+			size = le32toh(size);
+		}
+		if ((rcvflag & MSG_TRUNC) != 0 || size != len ||
+		    size < P9_HDRSZ ||
+		    size > p9s->p9s_msize) {
+			SDT_PROBE2(p9fs, sock, rcv, drop, conn, len);
+			p9r->p9r_rcvdrops++;
+			m_freem(m);
+			continue;
+		}
+		(*nmsgsp)++;
+		p9fs_msg_deliver(conn, m);
+	}
+	return (0);
+}
+
+/*
+ * Receive from a stream socket.  Takes everything the socket holds, in
+ * one soreceive(), and appends it to whatever partial record was left
+ * over from the last upcall.  Each complete record is then split off the
+ * chain and delivered.  Called with the receive sockbuf locked.
+ */
+static int
+p9fs_sock_rcv_stream(struct p9fs_conn *conn, struct socket *so,
+    u_int *nmsgsp)
+{
+	struct p9fs_session *p9s = conn->p9c_session;
+	struct p9fs_recv *p9r = &conn->p9c_recv;
+	struct mbuf *m;
+	struct uio uio;
+	uint32_t size;
+	u_int avail;
+	int error, rcvflag;
+
+	while ((avail = sbavail(&so->so_rcv)) > 0) {
+		uio.uio_resid = avail;
+		SOCKBUF_UNLOCK(&so->so_rcv);
+		rcvflag = MSG_DONTWAIT | MSG_SOCALLBCK;
+		error = soreceive(so, NULL, &uio, &m, NULL, &rcvflag);
+		SOCKBUF_LOCK(&so->so_rcv);
+		if (error == EWOULDBLOCK)
+			break;
+		if (error != 0)
+			return (error);
+		if (m == NULL)
+			break;
+
+		SDT_PROBE2(p9fs, sock, rcv, data, conn, avail - uio.uio_resid);
+		p9r->p9r_rcvcalls++;
+		p9r->p9r_rcvbytes += avail - uio.uio_resid;
+		p9r->p9r_len += avail - uio.uio_resid;
+		if (p9r->p9r_msg == NULL)
+			p9r->p9r_msg = m;
+		else {
+			if (m->m_flags & M_PKTHDR)
+				m_demote_pkthdr(m);
+			m_cat(p9r->p9r_msg, m);
+		}
+	}
+
+	/* Hand over each complete record. */
+	while (p9r->p9r_len >= sizeof (size)) {
+		m_copydata(p9r->p9r_msg, 0, sizeof (size), (void *)&size);
+		size = le32toh(size);
+		if (size < P9_HDRSZ ||
+		    size > p9s->p9s_msize)
+			return (EMSGSIZE);
+		if (size > p9r->p9r_len)
+			break;
+
+		m = p9r->p9r_msg;
+		if (size < p9r->p9r_len) {
+			p9r->p9r_msg = m_split(m, size, M_NOWAIT);
+			if (p9r->p9r_msg == NULL) {
+				p9r->p9r_msg = m;
+				return (ENOBUFS);
+			}
+		} else
+			p9r->p9r_msg = NULL;
+		p9r->p9r_len -= size;
+		(*nmsgsp)++;
+		p9fs_msg_deliver(conn, m);
+	}
+	return (0);
+}
+
+/*
+ * Receive upcall.  Delivers every complete message the socket holds.
+ * Called with the receive sockbuf locked.
+ */
+static int
+p9fs_sock_upcall(struct socket *so, void *arg, int waitflag __unused)
+{
+	struct p9fs_conn *conn = arg;
+	struct p9fs_recv *p9r = &conn->p9c_recv;
+	u_int nmsgs;
+	int error;
+
+	p9r->p9r_soupcalls++;
+
+	/* Once the connection has failed, ignore it until it is closed. */
+	if (p9r->p9r_error != 0)
+		goto out;
+
+	nmsgs = 0;
+	if ((conn->p9c_flags & P9C_ATOMIC) != 0)
+		error = p9fs_sock_rcv_dgram(conn, so, &nmsgs);
+	else
+		error = p9fs_sock_rcv_stream(conn, so, &nmsgs);
+	SDT_PROBE3(p9fs, sock, rcv, upcall, conn, nmsgs, error);
+	if (nmsgs > 0) {
+		p9r->p9r_rcvmsgs += nmsgs;
+		p9r->p9r_rcvbatch[MIN(fls(nmsgs), P9FS_RCVBATCH_HIST) - 1]++;
+	}
+	if (error != 0)
+		goto fail;
+
+	if ((so->so_rcv.sb_state & SBS_CANTRCVMORE) != 0 ||
+	    so->so_error != 0) {
+		error = so->so_error != 0 ? so->so_error : ECONNRESET;
+		goto fail;
+	}
+	goto out;
+
+fail:
+	p9r->p9r_error = error;
+	p9fs_conn_lost(conn, error);
+out:
+	if (--p9r->p9r_soupcalls == 0)
+		wakeup(&p9r->p9r_soupcalls);
+	return (SU_OK);
+}
+
+/*
+ * Return the largest message that fits in one datagram on the path to the
+ * server without fragmentation, going by the MTU of the route to it, or 0
+ * if that is unknown.
+ */
+static u_int
+p9fs_sock_dgram_max(struct p9fs_session *p9s)
+{
+	struct in_conninfo inc;
+	u_int mtu;
+
+	bzero(&inc, sizeof (inc));
+	switch (p9s->p9s_sockaddr.ss_family) {
+	case AF_INET:
+		inc.inc_faddr =
+		    ((struct sockaddr_in *)&p9s->p9s_sockaddr)->sin_addr;
+		mtu = tcp_maxmtu(&inc, NULL);
+		if (mtu <= sizeof (struct ip) + sizeof (struct udphdr))
+			return (0);
+		return (mtu - sizeof (struct ip) - sizeof (struct udphdr));
+	case AF_INET6:
+		inc.inc_flags |= INC_ISIPV6;
+		inc.inc6_faddr =
+		    ((struct sockaddr_in6 *)&p9s->p9s_sockaddr)->sin6_addr;
+		mtu = tcp_maxmtu6(&inc, NULL);
+		if (mtu <= sizeof (struct ip6_hdr) + sizeof (struct udphdr))
+			return (0);
+		return (mtu - sizeof (struct ip6_hdr) - sizeof (struct udphdr));
+	default:
+		return (0);
+	}
+}
+
+/*
+ * Report a connect failure against the mount while it is being mounted;
+ * reconnects happen after mount options are gone.
+ */
+static void
+p9fs_sock_error(struct p9fs_conn *conn, const char *what, int error)
+{
+	struct p9fs_session *p9s = conn->p9c_session;
+
+	if (p9s->p9s_state == P9S_INIT)
+		vfs_mount_error(p9s->p9s_mount, "%s", what);
+	else
+		printf("p9fs: %s: %s: error %d\n",
+		    p9s->p9s_mount->mnt_stat.f_mntonname, what, error);
+}
+
+static int
+p9fs_sock_connect(struct p9fs_conn *conn)
+{
+	struct p9fs_session *p9s = conn->p9c_session;
+	struct socket *so;
+	u_int dmax;
+	int error;
+
+	conn->p9c_recv.p9r_error = 0;
+	conn->p9c_recv.p9r_len = 0;
+	error = socreate(p9s->p9s_sockaddr.ss_family, &conn->p9c_sock,
+	    p9s->p9s_socktype, p9s->p9s_proto, curthread->td_ucred, curthread);
+	if (error != 0) {
+		p9fs_sock_error(conn, "socreate", error);
+		conn->p9c_sock = NULL;
+		goto out;
+	}
+
+	so = conn->p9c_sock;
+	error = soconnect(so, (struct sockaddr *)&p9s->p9s_sockaddr, curthread);
+	SOCK_LOCK(so);
+	while ((so->so_state & SS_ISCONNECTING) && so->so_error == 0) {
+		error = msleep(&so->so_timeo, SOCK_MTX(so), PSOCK | PCATCH,
+		    "connec", 0);
+		if (error)
+			break;
+	}
+	if (error == 0) {
+		error = so->so_error;
+		so->so_error = 0;
+	}
+	SOCK_UNLOCK(so);
+	if (error) {
+		p9fs_sock_error(conn, "soconnect", error);
+		if (error == EINTR)
+			so->so_state &= ~SS_ISCONNECTING;
+		(void) soclose(so);
+		conn->p9c_sock = NULL;
+		goto out;
+	}
+
+	if (so->so_proto->pr_flags & PR_CONNREQUIRED)
+		p9fs_sock_setopt(so, SOL_SOCKET, SO_KEEPALIVE);
+	if (so->so_proto->pr_protocol == IPPROTO_TCP)
+		p9fs_sock_setopt(so, IPPROTO_TCP, TCP_NODELAY);
+	if (so->so_proto->pr_flags & PR_ATOMIC)
+		conn->p9c_flags |= P9C_ATOMIC;
+
+	/*
+	 * Over UDP, each message is a datagram, so msize may not exceed what
+	 * one datagram carries unfragmented, and requests are retransmitted
+	 * until answered.  Give the socket room for a window's worth of
+	 * replies.
+	 */
+	if (so->so_proto->pr_protocol == IPPROTO_UDP) {
+		conn->p9c_flags |= P9C_REXMT;
+		dmax = p9fs_sock_dgram_max(p9s);
+		if (dmax >= P9FS_MSIZE_DGRAM_MIN && dmax < p9s->p9s_msize)
+			p9s->p9s_msize = dmax;
+		(void) soreserve(so, so->so_snd.sb_hiwat,
+		    MAX(so->so_rcv.sb_hiwat, P9FS_WND_MAX * p9s->p9s_msize));
+	}
+
+	SOCKBUF_LOCK(&so->so_rcv);
+	soupcall_set(so, SO_RCV, p9fs_sock_upcall, conn);
+	SOCKBUF_UNLOCK(&so->so_rcv);
+
+	error = 0;
+
+out:
+	return (error);
+}
+
+/*
+ * Connections are established up front, so no address is needed.  For
+ * stream sockets, sosend() waits for space in the send buffer.  A UDP
+ * datagram dropped for want of buffers is as good as lost in the network,
+ * so leave it to be retransmitted.  Anything else is reported; resending
+ * a datagram that is too big would only fail again.
+ */
+static int
+p9fs_sock_send(struct p9fs_conn *conn, struct mbuf *m)
+{
+	int error;
+
+	error = sosend(conn->p9c_sock, NULL, NULL, m, NULL, 0, curthread);
+	if ((conn->p9c_flags & P9C_REXMT) != 0 &&
+	    (error == ENOBUFS || error == EAGAIN))
+		error = 0;
+	return (error);
+}
+
+static void
+p9fs_sock_shutdown(struct p9fs_conn *conn)
+{
+
+	(void) soshutdown(conn->p9c_sock, SHUT_RDWR);
+}
+
+/* Stop the receive upcall, waiting for any running one, and close. */
+static void
+p9fs_sock_close(struct p9fs_conn *conn)
+{
+	struct p9fs_recv *p9r = &conn->p9c_recv;
+	struct sockbuf *rcv = &conn->p9c_sock->so_rcv;
+
+	SOCKBUF_LOCK(rcv);
+	soupcall_clear(conn->p9c_sock, SO_RCV);
+	while (p9r->p9r_soupcalls > 0)
+		(void) msleep(&p9r->p9r_soupcalls, SOCKBUF_MTX(rcv),
+		    0, "p9rcvup", 0);
+	SOCKBUF_UNLOCK(rcv);
+	(void) soclose(conn->p9c_sock);
+	conn->p9c_sock = NULL;
+	if (p9r->p9r_msg != NULL) {
+		m_freem(p9r->p9r_msg);
+		p9r->p9r_msg = NULL;
+		p9r->p9r_len = 0;
+	}
+}
+
+const struct p9fs_trans p9fs_trans_sock = {
+	.pt_name =	"sock",
+	.pt_connect =	p9fs_sock_connect,
+	.pt_send =	p9fs_sock_send,
+	.pt_shutdown =	p9fs_sock_shutdown,
+	.pt_close =	p9fs_sock_close,
+};
@@ -48,20 +48,31 @@ __FBSDID("$FreeBSD$");
 #include <sys/proc.h>
 #include <sys/vnode.h>
 #include <sys/fnv_hash.h>
+#include <sys/limits.h>
+#include <sys/counter.h>
+#include <sys/sysctl.h>
+#include <sys/sbuf.h>
+#include <sys/callout.h>
+#include <sys/taskqueue.h>
 
 #include "p9fs_proto.h"
 #include "p9fs_subr.h"
 
 static const char *p9_opts[] = {
 	"addr",
+	"bulk",
 	"debug",
 	"hostname",
+	"msize",
+	"nconnect",
 	"path",
 	"proto",
+	"reads",
+	"rtomax",
+	"rtomin",
 };
 
 struct p9fsmount {
-	int p9_debuglevel;
 	struct p9fs_session p9_session;
 	struct mount *p9_mountp;
 	char p9_hostname[256];
@@ -70,12 +81,461 @@ struct p9fsmount {
 
 static MALLOC_DEFINE(M_P9MNT, "p9fsmount", "Mount structures for p9fs");
 
+SYSCTL_NODE(_vfs, OID_AUTO, p9fs, CTLFLAG_RW, 0, "Plan9 filesystem");
+
+/* Unit numbers for the per-mount sysctl trees. */
+static struct unrhdr *p9fs_units;
+
+/* Report the round-trip time estimates, one line per message type. */
 static int
-p9fs_mount_parse_opts(struct mount *mp)
+p9fs_sysctl_rtt(SYSCTL_HANDLER_ARGS)
+{
+	static const char *names[P9FS_RTT_TYPES] = P9FS_STATS_NAMES;
+	struct p9fs_session *p9s = arg1;
+	struct p9fs_rtt rtt[P9FS_RTT_TYPES];
+	struct sbuf *sb;
+	int error, i;
+
+	mtx_lock(&p9s->p9s_lock);
+	bcopy(p9s->p9s_rtt, rtt, sizeof (rtt));
+	mtx_unlock(&p9s->p9s_lock);
+
+	sb = sbuf_new_for_sysctl(NULL, NULL, 128, req);
+	sbuf_printf(sb, "\n%-8s %10s %10s %10s %8s", "type", "samples",
+	    "srtt_us", "rttvar_us", "rto_ms");
+	for (i = 0; i < P9FS_RTT_TYPES; i++) {
+		if (rtt[i].rtt_samples == 0)
+			continue;
+		sbuf_printf(sb, "\n%-8s %10lu %10d %10d %8d", names[i],
+		    rtt[i].rtt_samples, rtt[i].rtt_srtt >> 3,
+		    rtt[i].rtt_rttvar >> 2,
+		    p9fs_rtt_timeout(p9s, Tversion + 2 * i) * 1000 / hz);
+	}
+	error = sbuf_finish(sb);
+	sbuf_delete(sb);
+	return (error);
+}
+
+/* Append the time from one stage of a request to another, or '-'. */
+static void
+p9fs_sbuf_stage(struct sbuf *sb, sbintime_t from, sbintime_t to)
+{
+
+	if (from == 0 || to == 0)
+		sbuf_printf(sb, " %9s", "-");
+	else
+		sbuf_printf(sb, " %9jd", (intmax_t)sbttous(to - from));
+}
+
+/* Append a request's type, tag, fid and connection. */
+static void
+p9fs_sbuf_req(struct sbuf *sb, const struct p9fs_slowreq *sr)
+{
+
+	sbuf_printf(sb, "%-8s %5u %10d %4u",
+	    sr->sr_type != 0 ? p9fs_msg_name(sr->sr_type) : "-",
+	    sr->sr_tag, sr->sr_fid == NOFID ? -1 : (int)sr->sr_fid,
+	    sr->sr_conn);
+}
+
+/*
+ * Report the slow request log, newest first, with the time each request
+ * spent in each stage in microseconds:
+ *   tagwait	waiting for a free tag
+ *   queue	from then until sent, e.g. waiting for the window or recovery
+ *   send	in the transmit queue and the transport, e.g. sbwait
+ *   server	from then until its reply was matched to it
+ *   wake	from then until its sender ran again
+ */
+static int
+p9fs_sysctl_slowlog(SYSCTL_HANDLER_ARGS)
+{
+	struct p9fs_session *p9s = arg1;
+	struct p9fs_slowreq *srs, *sr;
+	struct sbuf *sb;
+	sbintime_t birth, now;
+	u_int i, n, next;
+	int error;
+
+	srs = malloc(sizeof (p9s->p9s_slowlog), M_TEMP, M_WAITOK);
+	mtx_lock(&p9s->p9s_lock);
+	bcopy(p9s->p9s_slowlog, srs, sizeof (p9s->p9s_slowlog));
+	next = p9s->p9s_slowlog_next;
+	mtx_unlock(&p9s->p9s_lock);
+	now = sbinuptime();
+
+	sb = sbuf_new_for_sysctl(NULL, NULL, 128, req);
+	sbuf_printf(sb, "\n%8s %-8s %5s %10s %4s %5s %9s %9s %9s %9s %9s %9s",
+	    "ago_ms", "type", "tag", "fid", "conn", "error", "tagwait",
+	    "queue", "send", "server", "wake", "total");
+	n = MIN(next, P9FS_SLOWLOG);
+	for (i = 0; i < n; i++) {
+		sr = &srs[(next - 1 - i) % P9FS_SLOWLOG];
+		birth = sr->sr_reserved != 0 ? sr->sr_reserved : sr->sr_enq;
+		sbuf_printf(sb, "\n%8jd ",
+		    (intmax_t)sbttoms(now - sr->sr_done));
+		p9fs_sbuf_req(sb, sr);
+		sbuf_printf(sb, " %5d %9jd", sr->sr_error,
+		    (intmax_t)sbttous(sr->sr_tagwait));
+		p9fs_sbuf_stage(sb, birth, sr->sr_start);
+		p9fs_sbuf_stage(sb, sr->sr_start, sr->sr_sent);
+		p9fs_sbuf_stage(sb, sr->sr_sent, sr->sr_replied);
+		p9fs_sbuf_stage(sb, sr->sr_replied, sr->sr_done);
+		sbuf_printf(sb, " %9jd",
+		    (intmax_t)sbttous(sr->sr_done - birth + sr->sr_tagwait));
+	}
+	error = sbuf_finish(sb);
+	sbuf_delete(sb);
+	free(srs, M_TEMP);
+	return (error);
+}
+
+/* Outstanding requests reported, at most. */
+#define	P9FS_OUTSTANDING_MAX	512
+
+static int
+p9fs_outstanding_cmp(const void *a, const void *b)
+{
+	const struct p9fs_slowreq *sa = a, *sb = b;
+	sbintime_t ba, bb;
+
+	ba = sa->sr_reserved != 0 ? sa->sr_reserved : sa->sr_enq;
+	bb = sb->sr_reserved != 0 ? sb->sr_reserved : sb->sr_enq;
+	return (ba < bb ? -1 : ba > bb);
+}
+
+/*
+ * Report the requests outstanding now, oldest first, with their age and
+ * the stage they are in.
+ */
+static int
+p9fs_sysctl_outstanding(SYSCTL_HANDLER_ARGS)
+{
+	static const char *states[] = {
+		"free", "building", "sent", "replied", "flushing",
+	};
+	struct p9fs_session *p9s = arg1;
+	struct p9fs_slowreq *srs, *sr;
+	struct sbuf *sb;
+	sbintime_t birth, now;
+	const char *state;
+	int error, i, n;
+
+	srs = malloc(P9FS_OUTSTANDING_MAX * sizeof (*srs), M_TEMP, M_WAITOK);
+	n = p9fs_req_outstanding(p9s, srs, P9FS_OUTSTANDING_MAX);
+	now = sbinuptime();
+	qsort(srs, n, sizeof (*srs), p9fs_outstanding_cmp);
+
+	sb = sbuf_new_for_sysctl(NULL, NULL, 128, req);
+	sbuf_printf(sb, "\n%8s %-8s %5s %10s %4s %-8s", "age_ms", "type",
+	    "tag", "fid", "conn", "state");
+	for (i = 0; i < n; i++) {
+		sr = &srs[i];
+		birth = sr->sr_reserved != 0 ? sr->sr_reserved : sr->sr_enq;
+		state = sr->sr_state < nitems(states) ?
+		    states[sr->sr_state] : "?";
+		/* A sent request is either still going out or at the server. */
+		if (sr->sr_state == P9TAG_SENT)
+			state = sr->sr_sent != 0 ? "server" : "sending";
+		sbuf_printf(sb, "\n%8jd ", (intmax_t)sbttoms(now - birth));
+		p9fs_sbuf_req(sb, sr);
+		sbuf_printf(sb, " %-8s", state);
+	}
+	error = sbuf_finish(sb);
+	sbuf_delete(sb);
+	free(srs, M_TEMP);
+	return (error);
+}
+
+/*
+ * Export the mount's statistics as a struct p9fs_stats, for p9fsstat(8).
+ * The counters are summed across CPUs as they are read, so the snapshot
+ * is not atomic.
+ */
+static int
+p9fs_sysctl_stats(SYSCTL_HANDLER_ARGS)
+{
+	struct p9fs_session *p9s = arg1;
+	struct p9fs_stats *ps;
+	struct p9fs_stats_op *so;
+	struct p9fs_opstats *os;
+	int error, i, j;
+
+	ps = malloc(sizeof (*ps), M_TEMP, M_WAITOK | M_ZERO);
+	ps->ps_version = P9FS_STATS_VERSION;
+	mtx_lock(&p9s->p9s_lock);
+	ps->ps_inflight = p9s->p9s_threads;
+	ps->ps_inflight_max = p9s->p9s_threads_max;
+	ps->ps_tags_inuse = p9s->p9s_tags_inuse;
+	ps->ps_tags_max = p9s->p9s_tags_max;
+	ps->ps_timeouts = p9s->p9s_timeouts;
+	mtx_unlock(&p9s->p9s_lock);
+	ps->ps_fids_inuse = counter_u64_fetch(p9s->p9s_fids_inuse);
+	for (i = 0; i < P9FS_STATS_TYPES; i++) {
+		so = &ps->ps_ops[i];
+		os = &p9s->p9s_opstats[i];
+		so->so_requests = counter_u64_fetch(os->os_requests);
+		so->so_errors = counter_u64_fetch(os->os_errors);
+		so->so_bytes_out = counter_u64_fetch(os->os_bytes_out);
+		so->so_bytes_in = counter_u64_fetch(os->os_bytes_in);
+		so->so_time_us = counter_u64_fetch(os->os_time_us);
+		for (j = 0; j < P9FS_STATS_BUCKETS; j++)
+			so->so_lat[j] = counter_u64_fetch(os->os_lat[j]);
+	}
+	error = SYSCTL_OUT(req, ps, sizeof (*ps));
+	free(ps, M_TEMP);
+	return (error);
+}
+
+/*
+ * Add the per-type request counters under vfs.p9fs.<unit>.ops.<type>.
+ * The latency histograms are only in vfs.p9fs.<unit>.stats.
+ */
+static void
+p9fs_sysctl_ops(struct p9fs_session *p9s)
+{
+	static const char *names[P9FS_STATS_TYPES] = P9FS_STATS_NAMES;
+	struct sysctl_ctx_list *ctx = &p9s->p9s_sysctl_ctx;
+	struct sysctl_oid_list *children;
+	struct sysctl_oid *oid;
+	struct p9fs_opstats *os;
+	int i;
+
+	oid = SYSCTL_ADD_NODE(ctx, SYSCTL_CHILDREN(p9s->p9s_sysctl_tree),
+	    OID_AUTO, "ops", CTLFLAG_RD, NULL, "Requests by message type");
+	for (i = 0; i < P9FS_STATS_TYPES; i++) {
+		os = &p9s->p9s_opstats[i];
+		children = SYSCTL_CHILDREN(SYSCTL_ADD_NODE(ctx,
+		    SYSCTL_CHILDREN(oid), OID_AUTO, names[i], CTLFLAG_RD, NULL,
+		    "Message type"));
+		SYSCTL_ADD_COUNTER_U64(ctx, children, OID_AUTO, "requests",
+		    CTLFLAG_RD, &os->os_requests, "Requests sent");
+		SYSCTL_ADD_COUNTER_U64(ctx, children, OID_AUTO, "errors",
+		    CTLFLAG_RD, &os->os_errors,
+		    "Requests answered by Rerror or failed");
+		SYSCTL_ADD_COUNTER_U64(ctx, children, OID_AUTO, "bytes_out",
+		    CTLFLAG_RD, &os->os_bytes_out, "Bytes sent");
+		SYSCTL_ADD_COUNTER_U64(ctx, children, OID_AUTO, "bytes_in",
+		    CTLFLAG_RD, &os->os_bytes_in, "Bytes received in replies");
+		SYSCTL_ADD_COUNTER_U64(ctx, children, OID_AUTO, "time_us",
+		    CTLFLAG_RD, &os->os_time_us,
+		    "Total latency of completed requests (us)");
+	}
+}
+
+/*
+ * Create the mount's sysctl tree, vfs.p9fs.<unit>.  Mounts are told apart
+ * by their mntonname.
+ */
+static void
+p9fs_sysctl_init(struct mount *mp)
+{
+	struct p9fsmount *p9mp = VFSTOP9(mp);
+	struct p9fs_session *p9s = &p9mp->p9_session;
+	struct sysctl_oid_list *children;
+	char name[16];
+
+	p9s->p9s_unit = alloc_unr(p9fs_units);
+	snprintf(name, sizeof (name), "%d", p9s->p9s_unit);
+	sysctl_ctx_init(&p9s->p9s_sysctl_ctx);
+	p9s->p9s_sysctl_tree = SYSCTL_ADD_NODE(&p9s->p9s_sysctl_ctx,
+	    SYSCTL_STATIC_CHILDREN(_vfs_p9fs), OID_AUTO, name, CTLFLAG_RD,
+	    NULL, "p9fs mount");
+	children = SYSCTL_CHILDREN(p9s->p9s_sysctl_tree);
+
+	SYSCTL_ADD_STRING(&p9s->p9s_sysctl_ctx, children, OID_AUTO,
+	    "mntonname", CTLFLAG_RD, mp->mnt_stat.f_mntonname, 0,
+	    "Mount point");
+	SYSCTL_ADD_UINT(&p9s->p9s_sysctl_ctx, children, OID_AUTO,
+	    "nconnect", CTLFLAG_RD, &p9s->p9s_nconn, 0,
+	    "Connections to the server");
+	SYSCTL_ADD_UINT(&p9s->p9s_sysctl_ctx, children, OID_AUTO,
+	    "nbulk", CTLFLAG_RD, &p9s->p9s_nbulk, 0,
+	    "Of which used for reads and writes only");
+	SYSCTL_ADD_UINT(&p9s->p9s_sysctl_ctx, children, OID_AUTO,
+	    "msize", CTLFLAG_RD, &p9s->p9s_msize, 0,
+	    "Maximum message size granted by the server");
+	SYSCTL_ADD_COUNTER_U64(&p9s->p9s_sysctl_ctx, children, OID_AUTO,
+	    "fids_inuse", CTLFLAG_RD, &p9s->p9s_fids_inuse,
+	    "Fids allocated");
+	SYSCTL_ADD_UINT(&p9s->p9s_sysctl_ctx, children, OID_AUTO,
+	    "reconnects", CTLFLAG_RD, &p9s->p9s_reconnects, 0,
+	    "Connections lost and recovered");
+	SYSCTL_ADD_UINT(&p9s->p9s_sysctl_ctx, children, OID_AUTO,
+	    "reads", CTLFLAG_RD, &p9s->p9s_reads, 0,
+	    "Treads in flight per read");
+	SYSCTL_ADD_UINT(&p9s->p9s_sysctl_ctx, children, OID_AUTO,
+	    "rtomin", CTLFLAG_RD, &p9s->p9s_rtomin, 0,
+	    "Minimum request timeout (ms)");
+	SYSCTL_ADD_UINT(&p9s->p9s_sysctl_ctx, children, OID_AUTO,
+	    "rtomax", CTLFLAG_RD, &p9s->p9s_rtomax, 0,
+	    "Maximum request timeout (ms)");
+	SYSCTL_ADD_UINT(&p9s->p9s_sysctl_ctx, children, OID_AUTO,
+	    "timeouts", CTLFLAG_RD, &p9s->p9s_timeouts, 0,
+	    "Requests that timed out");
+	SYSCTL_ADD_INT(&p9s->p9s_sysctl_ctx, children, OID_AUTO,
+	    "inflight", CTLFLAG_RD, &p9s->p9s_threads, 0,
+	    "Requests in flight");
+	SYSCTL_ADD_INT(&p9s->p9s_sysctl_ctx, children, OID_AUTO,
+	    "inflight_max", CTLFLAG_RD, &p9s->p9s_threads_max, 0,
+	    "Most requests in flight at once");
+	SYSCTL_ADD_UINT(&p9s->p9s_sysctl_ctx, children, OID_AUTO,
+	    "tags_inuse", CTLFLAG_RD, &p9s->p9s_tags_inuse, 0,
+	    "Tags allocated");
+	SYSCTL_ADD_UINT(&p9s->p9s_sysctl_ctx, children, OID_AUTO,
+	    "tags_max", CTLFLAG_RD, &p9s->p9s_tags_max, 0,
+	    "Most tags allocated at once");
+	SYSCTL_ADD_ULONG(&p9s->p9s_sysctl_ctx, children, OID_AUTO,
+	    "inbytes", CTLFLAG_RD, &p9s->p9s_inbytes,
+	    "Bytes in flight, counting expected read data");
+	SYSCTL_ADD_UINT(&p9s->p9s_sysctl_ctx, children, OID_AUTO,
+	    "wnd", CTLFLAG_RD, &p9s->p9s_wnd, 0,
+	    "In-flight window, in requests");
+	SYSCTL_ADD_UINT(&p9s->p9s_sysctl_ctx, children, OID_AUTO,
+	    "wnd_msizes", CTLFLAG_RD, &p9s->p9s_wndb, 0,
+	    "In-flight window, in units of msize");
+	SYSCTL_ADD_UINT(&p9s->p9s_sysctl_ctx, children, OID_AUTO,
+	    "wnd_waiters", CTLFLAG_RD, &p9s->p9s_wnd_waiters, 0,
+	    "Senders waiting for the window");
+	SYSCTL_ADD_ULONG(&p9s->p9s_sysctl_ctx, children, OID_AUTO,
+	    "wnd_blocks", CTLFLAG_RD, &p9s->p9s_wnd_blocks,
+	    "Sends that waited for the window");
+	SYSCTL_ADD_ULONG(&p9s->p9s_sysctl_ctx, children, OID_AUTO,
+	    "wnd_blocked_us", CTLFLAG_RD, &p9s->p9s_wnd_blocked_us,
+	    "Time spent waiting for the window (us)");
+	SYSCTL_ADD_PROC(&p9s->p9s_sysctl_ctx, children, OID_AUTO,
+	    "rtt", CTLTYPE_STRING | CTLFLAG_RD, p9s, 0, p9fs_sysctl_rtt,
+	    "A", "Round-trip time estimates by message type");
+	SYSCTL_ADD_PROC(&p9s->p9s_sysctl_ctx, children, OID_AUTO,
+	    "stats", CTLTYPE_OPAQUE | CTLFLAG_RD, p9s, 0, p9fs_sysctl_stats,
+	    "S,p9fs_stats", "Statistics, as read by p9fsstat(8)");
+	SYSCTL_ADD_UINT(&p9s->p9s_sysctl_ctx, children, OID_AUTO,
+	    "slow_ms", CTLFLAG_RW, &p9s->p9s_slowms, 0,
+	    "Log requests taking at least this long (ms); 0 disables");
+	SYSCTL_ADD_PROC(&p9s->p9s_sysctl_ctx, children, OID_AUTO,
+	    "slowlog", CTLTYPE_STRING | CTLFLAG_RD, p9s, 0,
+	    p9fs_sysctl_slowlog, "A", "Recent slow requests, by stage (us)");
+	SYSCTL_ADD_PROC(&p9s->p9s_sysctl_ctx, children, OID_AUTO,
+	    "outstanding", CTLTYPE_STRING | CTLFLAG_RD, p9s, 0,
+	    p9fs_sysctl_outstanding, "A", "Requests outstanding now");
+	p9fs_sysctl_ops(p9s);
+}
+
+/*
+ * Add per-connection statistics under vfs.p9fs.<unit>.conn.<index>, once
+ * the number of connections is known.  The counters are read unlocked.
+ */
+static void
+p9fs_sysctl_conns(struct mount *mp)
+{
+	static const char *batchnames[P9FS_RCVBATCH_HIST] = {
+		"rcvbatch_1", "rcvbatch_2", "rcvbatch_4", "rcvbatch_8",
+		"rcvbatch_16", "rcvbatch_32",
+	};
+	struct p9fsmount *p9mp = VFSTOP9(mp);
+	struct p9fs_session *p9s = &p9mp->p9_session;
+	struct sysctl_ctx_list *ctx = &p9s->p9s_sysctl_ctx;
+	struct sysctl_oid_list *children;
+	struct sysctl_oid *oid;
+	struct p9fs_conn *conn;
+	char name[16];
+	u_int i, j;
+
+	oid = SYSCTL_ADD_NODE(ctx, SYSCTL_CHILDREN(p9s->p9s_sysctl_tree),
+	    OID_AUTO, "conn", CTLFLAG_RD, NULL, "Connections");
+	for (i = 0; i < p9s->p9s_nconn; i++) {
+		conn = &p9s->p9s_conns[i];
+		snprintf(name, sizeof (name), "%u", i);
+		children = SYSCTL_CHILDREN(SYSCTL_ADD_NODE(ctx,
+		    SYSCTL_CHILDREN(oid), OID_AUTO, name, CTLFLAG_RD, NULL,
+		    "Connection"));
+		SYSCTL_ADD_ULONG(ctx, children, OID_AUTO, "sndcalls",
+		    CTLFLAG_RD, &conn->p9c_sndcalls, "Transport sends");
+		SYSCTL_ADD_ULONG(ctx, children, OID_AUTO, "sndmsgs",
+		    CTLFLAG_RD, &conn->p9c_sndmsgs, "Messages sent");
+		SYSCTL_ADD_ULONG(ctx, children, OID_AUTO, "rcvcalls",
+		    CTLFLAG_RD, &conn->p9c_recv.p9r_rcvcalls,
+		    "soreceive() calls");
+		SYSCTL_ADD_ULONG(ctx, children, OID_AUTO, "rcvbytes",
+		    CTLFLAG_RD, &conn->p9c_recv.p9r_rcvbytes, "Bytes received");
+		SYSCTL_ADD_ULONG(ctx, children, OID_AUTO, "rcvmsgs",
+		    CTLFLAG_RD, &conn->p9c_recv.p9r_rcvmsgs,
+		    "Messages received");
+		SYSCTL_ADD_ULONG(ctx, children, OID_AUTO, "rcvdrops",
+		    CTLFLAG_RD, &conn->p9c_recv.p9r_rcvdrops,
+		    "Malformed datagrams dropped");
+		SYSCTL_ADD_ULONG(ctx, children, OID_AUTO, "rexmits",
+		    CTLFLAG_RD, &conn->p9c_rexmits,
+		    "Requests retransmitted");
+		for (j = 0; j < P9FS_RCVBATCH_HIST; j++)
+			SYSCTL_ADD_ULONG(ctx, children, OID_AUTO,
+			    batchnames[j], CTLFLAG_RD,
+			    &conn->p9c_recv.p9r_rcvbatch[j],
+			    "Receive upcalls delivering this many messages");
+	}
+}
+
+static void
+p9fs_sysctl_fini(struct mount *mp)
+{
+	struct p9fsmount *p9mp = VFSTOP9(mp);
+	struct p9fs_session *p9s = &p9mp->p9_session;
+
+	sysctl_ctx_free(&p9s->p9s_sysctl_ctx);
+	free_unr(p9fs_units, p9s->p9s_unit);
+}
+
+/* Fetch and check the server's socket address. */
+static int
+p9fs_mount_parse_addr(struct mount *mp)
 {
 	struct p9fsmount *p9mp = VFSTOP9(mp);
 	struct p9fs_session *p9s = &p9mp->p9_session;
 	struct sockaddr *saddr = NULL;
+	int error = EINVAL;
+	int ret;
+
+	ret = vfs_getopt(mp->mnt_optnew, "addr", (void **)&saddr,
+	    &p9s->p9s_sockaddr_len);
+	if (ret != 0 || saddr == NULL) {
+		vfs_mount_error(mp, "No server address");
+		goto out;
+	}
+	if (p9s->p9s_sockaddr_len > sizeof (p9s->p9s_sockaddr)) {
+		error = ENAMETOOLONG;
+		goto out;
+	}
+	if (p9s->p9s_sockaddr_len < offsetof(struct sockaddr, sa_data)) {
+		vfs_mount_error(mp, "Truncated server address");
+		goto out;
+	}
+	bcopy(saddr, &p9s->p9s_sockaddr, p9s->p9s_sockaddr_len);
+	switch (p9s->p9s_sockaddr.ss_family) {
+	case AF_INET:
+	case AF_INET6:
+		break;
+	case AF_LOCAL:
+		/* A server on this host, reached through a socket file. */
+		p9s->p9s_socktype = SOCK_STREAM;
+		p9s->p9s_proto = 0;
+		break;
+	default:
+		vfs_mount_error(mp, "Unsupported address family %d",
+		    p9s->p9s_sockaddr.ss_family);
+		goto out;
+	}
+
+	error = 0;
+
+out:
+	return (error);
+}
+
+static int
+p9fs_mount_parse_opts(struct mount *mp)
+{
+	struct p9fsmount *p9mp = VFSTOP9(mp);
+	struct p9fs_session *p9s = &p9mp->p9_session;
 	char *opt;
 	int error = EINVAL;
 	int fromnamelen, ret;
@@ -85,8 +545,8 @@ p9fs_mount_parse_opts(struct mount *mp)
 			vfs_mount_error(mp, "must specify value for debug");
 			goto out;
 		}
-		ret = sscanf(opt, "%d", &p9mp->p9_debuglevel);
-		if (ret != 1 || p9mp->p9_debuglevel < 0) {
+		ret = sscanf(opt, "%d", &p9s->p9s_debug);
+		if (ret != 1 || p9s->p9s_debug < 0) {
 			vfs_mount_error(mp, "illegal debug value: %s", opt);
 			goto out;
 		}
@@ -96,17 +556,13 @@ p9fs_mount_parse_opts(struct mount *mp)
 	if (mp->mnt_flag & MNT_UPDATE)
 		return (0);
 
-	ret = vfs_getopt(mp->mnt_optnew, "addr", (void **)&saddr,
-	    &p9s->p9s_sockaddr_len);
-	if (ret != 0 || saddr == NULL) {
-		vfs_mount_error(mp, "No server address");
-		goto out;
-	}
-	if (p9s->p9s_sockaddr_len > SOCK_MAXADDRLEN) {
-		error = ENAMETOOLONG;
+	/* The loopback transport answers locally, so it has no address. */
+	if (vfs_getopt(mp->mnt_optnew, "proto", (void **)&opt, NULL) == 0 &&
+	    strcasecmp(opt, "loop") == 0)
+		p9s->p9s_trans = &p9fs_trans_loop;
+	else if ((error = p9fs_mount_parse_addr(mp)) != 0)
 		goto out;
-	}
-	bcopy(saddr, &p9s->p9s_sockaddr, p9s->p9s_sockaddr_len);
+	error = EINVAL;
 
 	ret = vfs_getopt(mp->mnt_optnew, "hostname", (void **)&opt, NULL);
 	if (ret != 0) {
@@ -139,100 +595,116 @@ p9fs_mount_parse_opts(struct mount *mp)
 	}
 
 	if (vfs_getopt(mp->mnt_optnew, "proto", (void **)&opt, NULL) == 0) {
+		if (p9s->p9s_sockaddr.ss_family == AF_LOCAL) {
+			vfs_mount_error(mp, "proto is not used with unix:");
+			goto out;
+		}
 		if (strcasecmp(opt, "tcp") == 0) {
 			p9s->p9s_socktype = SOCK_STREAM;
 			p9s->p9s_proto = IPPROTO_TCP;
 		} else if (strcasecmp(opt, "udp") == 0) {
 			p9s->p9s_socktype = SOCK_DGRAM;
 			p9s->p9s_proto = IPPROTO_UDP;
+		} else if (strcasecmp(opt, "loop") == 0) {
+			/* Handled above. */
 		} else {
 			vfs_mount_error(mp, "illegal proto: %s", opt);
 			goto out;
 		}
 	}
 
-	error = 0;
+	/* The connections cannot be changed once the mount is up. */
+	if ((mp->mnt_flag & MNT_UPDATE) == 0 &&
+	    vfs_getopt(mp->mnt_optnew, "nconnect", (void **)&opt, NULL) == 0) {
+		ret = sscanf(opt, "%u", &p9s->p9s_nconn);
+		if (ret != 1 || p9s->p9s_nconn < 1 ||
+		    p9s->p9s_nconn > P9FS_NCONNECT_MAX) {
+			vfs_mount_error(mp, "illegal nconnect: %s (1-%d)",
+			    opt, P9FS_NCONNECT_MAX);
+			goto out;
+		}
+	}
+	if ((mp->mnt_flag & MNT_UPDATE) == 0 &&
+	    vfs_getopt(mp->mnt_optnew, "bulk", (void **)&opt, NULL) == 0) {
+		ret = sscanf(opt, "%u", &p9s->p9s_nbulk);
+		if (ret != 1 || p9s->p9s_nbulk > 1) {
+			vfs_mount_error(mp, "illegal bulk: %s (0-1)", opt);
+			goto out;
+		}
+		/* Pair each connection with a bulk one. */
+		if (p9s->p9s_nbulk != 0) {
+			p9s->p9s_nbulk = p9s->p9s_nconn;
+			p9s->p9s_nconn *= 2;
+		}
+	}
 
-out:
-	return (error);
-}
+	if (vfs_getopt(mp->mnt_optnew, "msize", (void **)&opt, NULL) == 0) {
+		ret = sscanf(opt, "%u", &p9s->p9s_msize);
+		if (ret != 1 || p9s->p9s_msize < P9FS_MSIZE_MIN ||
+		    p9s->p9s_msize > P9FS_MSIZE_MAX) {
+			vfs_mount_error(mp, "illegal msize: %s (%d-%d)",
+			    opt, P9FS_MSIZE_MIN, P9FS_MSIZE_MAX);
+			goto out;
+		}
+	}
 
-static void
-p9fs_setsockopt(struct socket *so, int sopt_name)
-{
-	struct sockopt sopt = { 0 };
-	int one = 1;
-
-	sopt.sopt_dir = SOPT_SET;
-	sopt.sopt_level = SOL_SOCKET;
-	sopt.sopt_name = sopt_name;
-	sopt.sopt_val = &one;
-	sopt.sopt_valsize = sizeof(one);
-	sosetopt(so, &sopt);
-}
+	if (vfs_getopt(mp->mnt_optnew, "reads", (void **)&opt, NULL) == 0) {
+		ret = sscanf(opt, "%u", &p9s->p9s_reads);
+		if (ret != 1 || p9s->p9s_reads < 1 ||
+		    p9s->p9s_reads > P9FS_READS_MAX) {
+			vfs_mount_error(mp, "illegal reads: %s (1-%d)",
+			    opt, P9FS_READS_MAX);
+			goto out;
+		}
+	}
 
-static int
-p9fs_client_upcall(struct socket *so, void *arg, int waitflag __unused)
-{
-	struct p9fsmount *p9mp = arg;
+	/* Request timeout bounds, in milliseconds. */
+	if (vfs_getopt(mp->mnt_optnew, "rtomin", (void **)&opt, NULL) == 0) {
+		ret = sscanf(opt, "%u", &p9s->p9s_rtomin);
+		if (ret != 1 || p9s->p9s_rtomin < 1) {
+			vfs_mount_error(mp, "illegal rtomin: %s", opt);
+			goto out;
+		}
+	}
+	if (vfs_getopt(mp->mnt_optnew, "rtomax", (void **)&opt, NULL) == 0) {
+		ret = sscanf(opt, "%u", &p9s->p9s_rtomax);
+		if (ret != 1 || p9s->p9s_rtomax < 1) {
+			vfs_mount_error(mp, "illegal rtomax: %s", opt);
+			goto out;
+		}
+	}
+	if (p9s->p9s_rtomin > p9s->p9s_rtomax) {
+		vfs_mount_error(mp, "rtomin %u exceeds rtomax %u",
+		    p9s->p9s_rtomin, p9s->p9s_rtomax);
+		goto out;
+	}
 
-	p9fs_msg_recv(&p9mp->p9_session);
-	return (SU_OK);
+	error = 0;
+
+out:
+	return (error);
 }
 
 /*
- * XXX Need to implement reconnecting as necessary.  If that were to be
- *     needed, most likely all current vnodes would have to be renegotiated
- *     or otherwise invalidated (a la NFS "stale file handle").
+ * Connections lost after the mount is up are re-established in the
+ * background; see p9fs_conn_lost().
  */
 static int
 p9fs_connect(struct mount *mp)
 {
 	struct p9fsmount *p9mp = VFSTOP9(mp);
 	struct p9fs_session *p9s = &p9mp->p9_session;
-	struct socket *so;
-	int error;
+	struct p9fs_conn *conn;
+	int error = 0;
+	u_int i;
 
-	error = socreate(p9s->p9s_sockaddr.sa_family, &p9s->p9s_sock,
-	    p9s->p9s_socktype, p9s->p9s_proto, curthread->td_ucred, curthread);
-	if (error != 0) {
-		vfs_mount_error(mp, "socreate");
-		goto out;
-	}
-
-	so = p9s->p9s_sock;
-	error = soconnect(so, &p9s->p9s_sockaddr, curthread);
-	SOCK_LOCK(so);
-	while ((so->so_state & SS_ISCONNECTING) && so->so_error == 0) {
-		error = msleep(&so->so_timeo, SOCK_MTX(so), PSOCK | PCATCH,
-		    "connec", 0);
-		if (error)
-			break;
-	}
-	if (error == 0) {
-		error = so->so_error;
-		so->so_error = 0;
-	}
-	SOCK_UNLOCK(so);
-	if (error) {
-		vfs_mount_error(mp, "soconnect");
-		if (error == EINTR)
-			so->so_state &= ~SS_ISCONNECTING;
-		goto out;
+	for (i = 0; error == 0 && i < p9s->p9s_nconn; i++) {
+		conn = &p9s->p9s_conns[i];
+		error = p9s->p9s_trans->pt_connect(conn);
+		if (error == 0)
+			conn->p9c_connected = 1;
 	}
 
-	if (so->so_proto->pr_flags & PR_CONNREQUIRED)
-		p9fs_setsockopt(so, SO_KEEPALIVE);
-	if (so->so_proto->pr_protocol == IPPROTO_TCP)
-		p9fs_setsockopt(so, TCP_NODELAY);
-
-	SOCKBUF_LOCK(&so->so_rcv);
-	soupcall_set(so, SO_RCV, p9fs_client_upcall, p9mp);
-	SOCKBUF_UNLOCK(&so->so_rcv);
-
-	error = 0;
-
-out:
 	return (error);
 }
 
@@ -263,6 +735,7 @@ p9fs_unmount(struct mount *mp, int mntflags)
 	if (error != 0)
 		goto out;
 
+	p9fs_sysctl_fini(mp);
 	p9fs_close_session(&p9mp->p9_session);
 	free(p9mp, M_P9MNT);
 	mp->mnt_data = NULL;
@@ -280,6 +753,7 @@ p9fs_mount(struct mount *mp)
 	struct p9fsmount *p9mp;
 	struct p9fs_session *p9s;
 	int error;
+	u_int i;
 
 	error = EINVAL;
 	if (vfs_filteropt(mp->mnt_optnew, p9_opts))
@@ -295,10 +769,12 @@ p9fs_mount(struct mount *mp)
 	p9fs_init_session(&p9mp->p9_session);
 	p9s = &p9mp->p9_session;
 	p9s->p9s_mount = mp;
+	p9fs_sysctl_init(mp);
 
 	error = p9fs_mount_parse_opts(mp);
 	if (error != 0)
 		goto out;
+	p9fs_sysctl_conns(mp);
 
 	error = p9fs_connect(mp);
 	if (error != 0) {
@@ -306,7 +782,8 @@ p9fs_mount(struct mount *mp)
 	}
 
 	/* Negotiate with the remote service.  XXX: Add auth call. */
-	error = p9fs_client_version(p9s);
+	for (i = 0; error == 0 && i < p9s->p9s_nconn; i++)
+		error = p9fs_client_version(p9s, &p9s->p9s_conns[i]);
 	if (error == 0) {
 		/* Initialize the root vnode just before attaching. */
 		struct vnode *vp, *ivp;
@@ -333,8 +810,8 @@ p9fs_mount(struct mount *mp)
 			VOP_UNLOCK(vp, 0);
 		}
 	}
-	if (error == 0)
-		error = p9fs_client_attach(p9s);
+	for (i = 0; error == 0 && i < p9s->p9s_nconn; i++)
+		error = p9fs_client_attach(p9s, &p9s->p9s_conns[i]);
 	if (error == 0)
 		p9s->p9s_state = P9S_RUNNING;
 
@@ -360,6 +837,7 @@ p9fs_root(struct mount *mp, int lkflags, struct vnode **vpp)
 static int
 p9fs_statfs(struct mount *mp, struct statfs *sbp)
 {
+	struct p9fsmount *p9mp = VFSTOP9(mp);
 
 	/*
 	 * XXX Uhhh..???
@@ -368,7 +846,8 @@ p9fs_statfs(struct mount *mp, struct statfs *sbp)
 	 */
 	sbp->f_version = STATFS_VERSION;
 	sbp->f_bsize = DEV_BSIZE;
-	sbp->f_iosize = MAXPHYS;
+	/* The largest read or write that fits in one message. */
+	sbp->f_iosize = p9mp->p9_session.p9s_msize - P9_IOHDRSZ;
 	sbp->f_blocks = 2; /* from devfs: 1K to keep df happy */
 	return (0);
 }
@@ -385,7 +864,25 @@ p9fs_sync(struct mount *mp, int waitfor)
 	return (0);
 }
 
+static int
+p9fs_init(struct vfsconf *vfsp)
+{
+
+	p9fs_units = new_unrhdr(0, INT_MAX, NULL);
+	return (0);
+}
+
+static int
+p9fs_uninit(struct vfsconf *vfsp)
+{
+
+	delete_unrhdr(p9fs_units);
+	return (0);
+}
+
 struct vfsops p9fs_vfsops = {
+	.vfs_init =	p9fs_init,
+	.vfs_uninit =	p9fs_uninit,
 	.vfs_mount =	p9fs_mount,
 	.vfs_unmount =	p9fs_unmount,
 	.vfs_root =	p9fs_root,
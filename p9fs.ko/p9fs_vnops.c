@@ -38,9 +38,14 @@ __FBSDID("$FreeBSD$");
 #include <sys/types.h>
 #include <sys/malloc.h>
 #include <sys/kernel.h>
+#include <sys/sdt.h>
 #include <sys/systm.h>
 #include <sys/dirent.h>
 #include <sys/namei.h>
+#include <sys/counter.h>
+#include <sys/sysctl.h>
+#include <sys/callout.h>
+#include <sys/taskqueue.h>
 
 #include "p9fs_proto.h"
 #include "p9fs_subr.h"
@@ -48,6 +53,45 @@ __FBSDID("$FreeBSD$");
 struct vop_vector p9fs_vnops;
 static MALLOC_DEFINE(M_P9NODE, "p9fs_node", "p9fs node structures");
 
+/*
+ * DTrace probes.  vop:start and vop:done bracket the vnode operations that
+ * go to the server, giving the node's fid; node:hit and node:miss report
+ * whether p9fs_nget() found the fid's vnode already in the hash.
+ */
+SDT_PROVIDER_DECLARE(p9fs);
+SDT_PROBE_DEFINE3(p9fs, , vop, start, "struct vnode *", "uint32_t",
+    "char *");
+SDT_PROBE_DEFINE4(p9fs, , vop, done, "struct vnode *", "uint32_t",
+    "char *", "int");
+SDT_PROBE_DEFINE3(p9fs, , node, hit, "struct p9fs_session *", "uint32_t",
+    "struct vnode *");
+SDT_PROBE_DEFINE2(p9fs, , node, miss, "struct p9fs_session *", "uint32_t");
+
+#define	P9FS_VOP_START(vp, np)						\
+	SDT_PROBE3(p9fs, , vop, start, (vp), (np)->p9n_fid, __func__)
+#define	P9FS_VOP_DONE(vp, np, error)					\
+	SDT_PROBE4(p9fs, , vop, done, (vp), (np)->p9n_fid, __func__, (error))
+
+/*
+ * The vnode type a qid gives, as p9fs_client_stat() would find it, or VNON
+ * if only the file's stat can tell.
+ */
+static enum vtype
+p9fs_qid_vtype(const struct p9fs_qid *qid)
+{
+
+	switch (qid->qid_mode) {
+	case QTDIR:
+		return (VDIR);
+	case QTLINK:
+		return (VLNK);
+	case QTFILE:
+		return (VREG);
+	default:
+		return (VNON);
+	}
+}
+
 /*
  * Get a p9node.  Nodes are represented by (fid, qid) tuples in 9P2000.
  * Fids are assigned by the client, while qids are assigned by the server.
@@ -70,9 +114,11 @@ p9fs_nget(struct p9fs_session *p9s, uint32_t fid, struct p9fs_qid *qid,
 	if (error != 0)
 		return (error);
 	if (vp != NULL) {
+		SDT_PROBE3(p9fs, , node, hit, p9s, fid, vp);
 		*npp = vp->v_data;
 		return (0);
 	}
+	SDT_PROBE2(p9fs, , node, miss, p9s, fid);
 
 	np = malloc(sizeof (struct p9fs_node), M_P9NODE, M_WAITOK | M_ZERO);
 	getnewvnode_reserve(1);
@@ -104,7 +150,10 @@ p9fs_nget(struct p9fs_session *p9s, uint32_t fid, struct p9fs_qid *qid,
 		return (0);
 	}
 
-	error = p9fs_client_stat(p9s, fid, &vattr);
+	/* Most files' qids give their type, saving a Tstat. */
+	vattr.va_type = p9fs_qid_vtype(qid);
+	if (vattr.va_type == VNON)
+		error = p9fs_client_stat(p9s, fid, &vattr);
 	if (error != 0) {
 		free(np, M_P9NODE);
 		return (error);
@@ -122,6 +171,206 @@ p9fs_nget(struct p9fs_session *p9s, uint32_t fid, struct p9fs_qid *qid,
 	return (error);
 }
 
+/*
+ * Most names a lookup walks to ahead of namei(9).  Every one of them but
+ * the last needs a Twalk of its own when namei reaches it, so there is
+ * little to gain from looking further.
+ */
+#define	P9FS_AHEAD_MAX		8
+
+/*
+ * Gather the name being looked up and, if namei(9) will go on to look up
+ * more names after it, up to P9FS_AHEAD_MAX in all.  Lookahead stops at
+ * "." and "..", which the server does not walk, and before the last name
+ * unless it too is only being looked up.  Returns the number of names.
+ */
+static uint16_t
+p9fs_lookup_names(struct componentname *cnp, struct p9fs_str *wnames)
+{
+	char *cp, *end, *last;
+	uint16_t n;
+
+	wnames[0].p9str_str = cnp->cn_nameptr;
+	wnames[0].p9str_size = cnp->cn_namelen;
+	if ((cnp->cn_flags & (ISLASTCN | ISDOTDOT)) != 0)
+		return (1);
+
+	/* The rest of the path follows, in namei's buffer. */
+	cp = cnp->cn_nameptr + cnp->cn_namelen;
+	for (n = 1; n < P9FS_AHEAD_MAX; n++) {
+		while (*cp == '/')
+			cp++;
+		for (end = cp; *end != '\0' && *end != '/'; end++)
+			continue;
+		if (end == cp || end - cp > NAME_MAX)
+			break;
+		if (cp[0] == '.' &&
+		    (end - cp == 1 || (end - cp == 2 && cp[1] == '.')))
+			break;
+		for (last = end; *last == '/'; last++)
+			continue;
+		if (*last == '\0' && cnp->cn_nameiop != LOOKUP)
+			break;
+		wnames[n].p9str_str = cp;
+		wnames[n].p9str_size = end - cp;
+		cp = end;
+	}
+	return (n);
+}
+
+/*
+ * Names walked to ahead of namei(9), left on the vnode for the name before
+ * them until namei looks them up: pa_ents[pa_next] is the next name down
+ * the path, and so on.  If pa_missing is set, the name after the last one
+ * found does not exist.  Nothing is entered into the name cache, since 9P
+ * gives no way to keep it coherent; these are only used once, by the next
+ * lookup from the vnode, and only within P9FS_AHEAD_TTL of the walk.
+ *
+ * Only the qids are known.  A name is given a fid of its own, walked from
+ * its parent's, when namei looks it up, except for the last one found if
+ * the whole path was: the walk that looked ahead left pa_lastfid bound to
+ * it, to be clunked if never used.  Protected by the vnode lock.
+ */
+struct p9fs_ahead {
+	sbintime_t pa_expires;
+	uint32_t pa_lastfid;
+	uint16_t pa_next;
+	uint16_t pa_nfound;
+	int pa_missing;
+	struct {
+		struct p9fs_qid pe_qid;
+		uint16_t pe_off;	/* Of the name, in pa_names. */
+		uint16_t pe_len;
+	} pa_ents[P9FS_AHEAD_MAX];
+	char pa_names[];
+};
+
+#define	P9FS_AHEAD_TTL		(100 * SBT_1MS)
+
+static void
+p9fs_ahead_free(struct p9fs_session *p9s, struct p9fs_ahead *pa)
+{
+
+	if (pa->pa_lastfid != NOFID) {
+		(void) p9fs_client_clunk(p9s, pa->pa_lastfid);
+		p9fs_relfid(p9s, pa->pa_lastfid);
+	}
+	free(pa, M_P9NODE);
+}
+
+/*
+ * Keep what a walk found past the name looked up.  lastfid is taken over
+ * if it was bound, that is if all nwname names were found.  Returns NULL
+ * if there is nothing to keep.
+ */
+static struct p9fs_ahead *
+p9fs_ahead_new(const struct p9fs_str *wnames, const struct p9fs_qid *qids,
+    uint16_t nfound, uint16_t nwname, int missing, uint32_t lastfid)
+{
+	struct p9fs_ahead *pa;
+	size_t len;
+	uint16_t i, nents;
+
+	missing = missing && nfound < nwname;
+	nents = nfound + (missing ? 1 : 0);
+	if (nents <= 1)
+		return (NULL);
+	for (i = 1, len = 0; i < nents; i++)
+		len += wnames[i].p9str_size;
+
+	pa = malloc(sizeof (*pa) + len, M_P9NODE, M_WAITOK);
+	pa->pa_expires = sbinuptime() + P9FS_AHEAD_TTL;
+	pa->pa_lastfid = nfound == nwname ? lastfid : NOFID;
+	pa->pa_next = 1;
+	pa->pa_nfound = nfound;
+	pa->pa_missing = missing;
+	for (i = 1, len = 0; i < nents; i++) {
+		if (i < nfound)
+			pa->pa_ents[i].pe_qid = qids[i];
+		pa->pa_ents[i].pe_off = len;
+		pa->pa_ents[i].pe_len = wnames[i].p9str_size;
+		bcopy(wnames[i].p9str_str, pa->pa_names + len,
+		    wnames[i].p9str_size);
+		len += wnames[i].p9str_size;
+	}
+	return (pa);
+}
+
+/*
+ * Look up cnp's name from the names walked ahead of dvp, if it is the next
+ * of them.  Returns 0 with *npp set, ENOENT if the name was found missing,
+ * another error if it could not be walked to after all, or -1 if the
+ * lookup must go to the server.  Either way the names are taken off dvp;
+ * those still ahead move to the new vnode.
+ */
+static int
+p9fs_ahead_lookup(struct vnode *dvp, struct componentname *cnp,
+    struct p9fs_node **npp)
+{
+	struct p9fs_node *dnp = dvp->v_data;
+	struct p9fs_session *p9s = dnp->p9n_session;
+	struct p9fs_ahead *pa;
+	struct p9fs_qid qid;
+	uint32_t fid;
+	uint16_t i;
+	int error;
+
+	if ((pa = dnp->p9n_ahead) == NULL)
+		return (-1);
+	dnp->p9n_ahead = NULL;
+	i = pa->pa_next;
+	if (sbinuptime() > pa->pa_expires ||
+	    (cnp->cn_flags & ISDOTDOT) != 0 ||
+	    ((cnp->cn_flags & ISLASTCN) != 0 && cnp->cn_nameiop != LOOKUP) ||
+	    cnp->cn_namelen != pa->pa_ents[i].pe_len ||
+	    bcmp(cnp->cn_nameptr, pa->pa_names + pa->pa_ents[i].pe_off,
+	    cnp->cn_namelen) != 0) {
+		p9fs_ahead_free(p9s, pa);
+		return (-1);
+	}
+	if (i == pa->pa_nfound) {
+		p9fs_ahead_free(p9s, pa);
+		return (ENOENT);
+	}
+	pa->pa_next++;
+
+	/* The last name found may already have a fid. */
+	qid = pa->pa_ents[i].pe_qid;
+	if (pa->pa_next == pa->pa_nfound && pa->pa_lastfid != NOFID) {
+		fid = pa->pa_lastfid;
+		pa->pa_lastfid = NOFID;
+	} else {
+		fid = p9fs_getfid(p9s, P9FS_FID_CONN(p9s, dnp->p9n_fid));
+		if (fid == NOFID) {
+			p9fs_ahead_free(p9s, pa);
+			return (-1);
+		}
+		error = p9fs_client_walk(p9s, dnp->p9n_fid, &fid,
+		    cnp->cn_namelen, cnp->cn_nameptr, &qid);
+		if (error != 0) {
+			p9fs_relfid(p9s, fid);
+			p9fs_ahead_free(p9s, pa);
+			return (error);
+		}
+		/* If the name now leads elsewhere, so may the rest. */
+		if (qid.qid_path != pa->pa_ents[i].pe_qid.qid_path) {
+			pa->pa_nfound = pa->pa_next;
+			pa->pa_missing = 0;
+		}
+	}
+
+	error = p9fs_nget(p9s, fid, &qid, cnp->cn_lkflags, npp);
+	if (error != 0) {
+		(void) p9fs_client_clunk(p9s, fid);
+		p9fs_relfid(p9s, fid);
+		p9fs_ahead_free(p9s, pa);
+	} else if (pa->pa_next < pa->pa_nfound || pa->pa_missing)
+		(*npp)->p9n_ahead = pa;
+	else
+		p9fs_ahead_free(p9s, pa);
+	return (error);
+}
+
 static int
 p9fs_lookup(struct vop_cachedlookup_args *ap)
 {
@@ -131,24 +380,73 @@ p9fs_lookup(struct vop_cachedlookup_args *ap)
 	struct p9fs_node *dnp = dvp->v_data;
 	struct p9fs_session *p9s = dnp->p9n_session;
 	struct p9fs_node *np = NULL;
-	struct p9fs_qid qid;
-	uint32_t newfid;
-	int error;
+	struct p9fs_str wnames[P9FS_AHEAD_MAX];
+	struct p9fs_qid qids[P9FS_AHEAD_MAX];
+	uint32_t dfid, lastfid, newfid;
+	uint16_t nfound, nwname;
+	int error, missing;
 
 	*vpp = NULL;
-	printf("%s(fid %u name '%.*s')\n", __func__, dnp->p9n_fid,
-	    (int)cnp->cn_namelen, cnp->cn_nameptr);
+	P9FS_VOP_START(dvp, dnp);
+	P9FS_DEBUG(p9s, 1, "%s(fid %u name '%.*s')\n", __func__,
+	    dnp->p9n_fid, (int)cnp->cn_namelen, cnp->cn_nameptr);
 
 	/* Special case: lookup a directory from itself. */
 	if (cnp->cn_namelen == 1 && *cnp->cn_nameptr == '.') {
 		*vpp = dvp;
 		vref(*vpp);
+		P9FS_VOP_DONE(dvp, dnp, 0);
 		return (0);
 	}
 
-	newfid = p9fs_getfid(p9s);
-	error = p9fs_client_walk(p9s, dnp->p9n_fid, &newfid,
-	    cnp->cn_namelen, cnp->cn_nameptr, &qid);
+	/* The name may already have been walked to by the last lookup. */
+	error = p9fs_ahead_lookup(dvp, cnp, &np);
+	if (error != -1) {
+		if (error == 0) {
+			*vpp = np->p9n_vnode;
+			vref(*vpp);
+		}
+		P9FS_VOP_DONE(dvp, dnp, error);
+		return (error);
+	}
+
+	/*
+	 * The new fid must live on its parent's connection.  The root is
+	 * attached on every connection, so lookups from it are spread across
+	 * them, starting from the least busy connection's root fid.
+	 */
+	if (dnp->p9n_fid == ROOTFID)
+		dfid = P9FS_CONN_ROOTFID(p9fs_conn_pick(p9s));
+	else
+		dfid = dnp->p9n_fid;
+	newfid = p9fs_getfid(p9s, P9FS_FID_CONN(p9s, dfid));
+	if (newfid == NOFID) {
+		P9FS_VOP_DONE(dvp, dnp, ENFILE);
+		return (ENFILE);
+	}
+
+	/*
+	 * Look ahead down the names namei will look up next as well, in the
+	 * same round trip, so that the names found are known, and those
+	 * missing are known not to exist, without asking the server again.
+	 * What is found is left on the new vnode for the next lookup; see
+	 * struct p9fs_ahead.
+	 */
+	nwname = p9fs_lookup_names(cnp, wnames);
+	lastfid = NOFID;
+	if (nwname > 1 &&
+	    (lastfid = p9fs_getfid(p9s, P9FS_FID_CONN(p9s, dfid))) == NOFID)
+		nwname = 1;
+	nfound = 0;
+	missing = 0;
+	if (nwname > 1)
+		error = p9fs_client_walkv(p9s, dfid, newfid, lastfid, nwname,
+		    wnames, qids, &nfound, &missing);
+	else {
+		error = p9fs_client_walk(p9s, dfid, &newfid,
+		    cnp->cn_namelen, cnp->cn_nameptr, &qids[0]);
+		nfound = error == 0 ? 1 : 0;
+	}
 	if (error == 0) {
 		int ltype = 0;
 
@@ -156,18 +454,28 @@ p9fs_lookup(struct vop_cachedlookup_args *ap)
 			ltype = VOP_ISLOCKED(dvp);
 			VOP_UNLOCK(dvp, 0);
 		}
-		error = p9fs_nget(p9s, newfid, &qid,
-		    cnp->cn_lkflags, &np);
+		error = p9fs_nget(p9s, newfid, &qids[0], cnp->cn_lkflags,
+		    &np);
 		if (cnp->cn_flags & ISDOTDOT)
 			vn_lock(dvp, ltype | LK_RETRY);
-
+		if (error != 0)
+			(void) p9fs_client_clunk(p9s, newfid);
 	}
 	if (error == 0) {
 		*vpp = np->p9n_vnode;
 		vref(*vpp);
+		np->p9n_ahead = p9fs_ahead_new(wnames, qids, nfound, nwname,
+		    missing, lastfid);
 	} else
 		p9fs_relfid(p9s, newfid);
+	/* lastfid was bound, and so taken over, only if all were found. */
+	if (lastfid != NOFID && (error != 0 || nfound < nwname)) {
+		if (nfound == nwname)
+			(void) p9fs_client_clunk(p9s, lastfid);
+		p9fs_relfid(p9s, lastfid);
+	}
 
+	P9FS_VOP_DONE(dvp, dnp, error);
 	return (error);
 }
 
@@ -192,10 +500,12 @@ p9fs_open(struct vop_open_args *ap)
 {
 	int error;
 	struct p9fs_node *np = ap->a_vp->v_data;
+	struct p9fs_session *p9s = np->p9n_session;
 	struct vattr vattr;
-	uint32_t fid = np->p9n_fid;
+	uint32_t fid = np->p9n_fid, ofid;
 
-	printf("%s(fid %u)\n", __func__, np->p9n_fid);
+	P9FS_VOP_START(ap->a_vp, np);
+	P9FS_DEBUG(p9s, 1, "%s(fid %u)\n", __func__, np->p9n_fid);
 
 	/*
 	 * XXX XXX XXX
@@ -251,13 +561,14 @@ p9fs_open(struct vop_open_args *ap)
 	 */
 	if (np->p9n_opens > 0) {
 		np->p9n_opens++;
-		return (0);
+		error = 0;
+		goto out;
 	}
 
 	/* XXX Can this be cached in some reasonable fashion? */
 	error = p9fs_client_stat(np->p9n_session, np->p9n_fid, &vattr);
 	if (error != 0)
-		return (error);
+		goto out;
 
 	/*
 	 * XXX VFS calls VOP_OPEN() on a directory it's about to perform
@@ -270,24 +581,51 @@ p9fs_open(struct vop_open_args *ap)
 	 */
 	if (ap->a_vp->v_type == VDIR) {
 		if (np->p9n_ofid == 0) {
-			np->p9n_ofid = p9fs_getfid(np->p9n_session);
+			np->p9n_ofid = p9fs_getfid(np->p9n_session,
+			    P9FS_FID_CONN(np->p9n_session, np->p9n_fid));
+			if (np->p9n_ofid == NOFID) {
+				np->p9n_ofid = 0;
+				error = ENFILE;
+				goto out;
+			}
 
 			error = p9fs_client_walk(np->p9n_session, np->p9n_fid,
 			    &np->p9n_ofid, 0, NULL, &np->p9n_qid);
 			if (error != 0) {
 				np->p9n_ofid = 0;
-				return (error);
+				goto out;
 			}
 		}
 		fid = np->p9n_ofid;
+	} else if (ap->a_vp->v_type == VREG && p9s->p9s_nbulk > 0) {
+		/*
+		 * Reads and writes go on the bulk connection paired with the
+		 * file's own, through a fid walked to the file there.  If
+		 * that cannot be done, the file's own fid is opened instead.
+		 */
+		ofid = p9fs_getfid(p9s,
+		    P9FS_CONN_BULK(p9s, P9FS_FID_CONN(p9s, np->p9n_fid)));
+		if (ofid != NOFID &&
+		    p9fs_client_walk_path(p9s, np->p9n_fid, ofid) == 0) {
+			np->p9n_ofid = ofid;
+			fid = ofid;
+		} else if (ofid != NOFID)
+			p9fs_relfid(p9s, ofid);
 	}
 
-	error = p9fs_client_open(np->p9n_session, fid, ap->a_mode);
+	error = p9fs_client_open(np->p9n_session, fid, ap->a_mode,
+	    &np->p9n_iounit);
 	if (error == 0) {
 		np->p9n_opens = 1;
 		vnode_create_vobject(ap->a_vp, vattr.va_bytes, ap->a_td);
+	} else if (ap->a_vp->v_type == VREG && np->p9n_ofid != 0) {
+		(void) p9fs_client_clunk(p9s, np->p9n_ofid);
+		p9fs_relfid(p9s, np->p9n_ofid);
+		np->p9n_ofid = 0;
 	}
 
+out:
+	P9FS_VOP_DONE(ap->a_vp, np, error);
 	return (error);
 }
 
@@ -296,13 +634,16 @@ p9fs_close(struct vop_close_args *ap)
 {
 	struct p9fs_node *np = ap->a_vp->v_data;
 
-	printf("%s(fid %d ofid %d opens %d)\n", __func__,
-	    np->p9n_fid, np->p9n_ofid, np->p9n_opens);
+	P9FS_VOP_START(ap->a_vp, np);
+	P9FS_DEBUG(np->p9n_session, 1, "%s(fid %d ofid %d opens %d)\n",
+	    __func__, np->p9n_fid, np->p9n_ofid, np->p9n_opens);
 	np->p9n_opens--;
-	if (np->p9n_opens == 0) {
+	if (np->p9n_opens == 0 && np->p9n_ofid != 0) {
+		(void) p9fs_client_clunk(np->p9n_session, np->p9n_ofid);
 		p9fs_relfid(np->p9n_session, np->p9n_ofid);
 		np->p9n_ofid = 0;
 	}
+	P9FS_VOP_DONE(ap->a_vp, np, 0);
 
 	/*
 	 * In p9fs, the only close-time operation to do is Tclunk, but it's
@@ -321,6 +662,8 @@ p9fs_access(struct vop_access_args *ap)
 	struct vattr vattr;
 	int error;
 
+	P9FS_VOP_START(ap->a_vp, np);
+
 	/* Read-only filesystem check. */
 	if ((accmode & VMODIFY_PERMS) != 0 &&
 	    (ap->a_vp->v_mount->mnt_flag & MNT_RDONLY) != 0) {
@@ -356,7 +699,9 @@ p9fs_access(struct vop_access_args *ap)
 	    vattr.va_gid, accmode, ap->a_cred, NULL);
 
 out:
-	printf("%s(fid %d) ret %d\n", __func__, np->p9n_fid, error);
+	P9FS_DEBUG(np->p9n_session, 1, "%s(fid %d) ret %d\n", __func__,
+	    np->p9n_fid, error);
+	P9FS_VOP_DONE(ap->a_vp, np, error);
 	return (error);
 }
 
@@ -364,9 +709,13 @@ static int
 p9fs_getattr(struct vop_getattr_args *ap)
 {
 	struct p9fs_node *np = ap->a_vp->v_data;
-	int error = p9fs_client_stat(np->p9n_session, np->p9n_fid, ap->a_vap);
+	int error;
 
-	printf("%s(fid %d) ret %d\n", __func__, np->p9n_fid, error);
+	P9FS_VOP_START(ap->a_vp, np);
+	error = p9fs_client_stat(np->p9n_session, np->p9n_fid, ap->a_vap);
+	P9FS_DEBUG(np->p9n_session, 1, "%s(fid %d) ret %d\n", __func__,
+	    np->p9n_fid, error);
+	P9FS_VOP_DONE(ap->a_vp, np, error);
 	return (error);
 }
 
@@ -379,7 +728,37 @@ p9fs_setattr(struct vop_setattr_args *ap)
 static int
 p9fs_read(struct vop_read_args *ap)
 {
-	VNOP_UNIMPLEMENTED;
+	struct vnode *vp = ap->a_vp;
+	struct p9fs_node *np = vp->v_data;
+	struct uio *uio = ap->a_uio;
+	ssize_t resid;
+	int error = 0;
+
+	if (vp->v_type == VDIR)
+		return (EISDIR);
+	if (vp->v_type != VREG)
+		return (EOPNOTSUPP);
+	if (np->p9n_opens == 0)
+		return (EBADF);
+	P9FS_VOP_START(vp, np);
+
+	/*
+	 * Each Rread's data is copied from its mbufs straight into uio, with
+	 * the mount's reads Treads in flight.  The file was opened through
+	 * p9n_ofid if it has one.
+	 */
+	while (uio->uio_resid > 0) {
+		resid = uio->uio_resid;
+		error = p9fs_client_readv(np->p9n_session,
+		    np->p9n_ofid != 0 ? np->p9n_ofid : np->p9n_fid,
+		    np->p9n_iounit, np->p9n_session->p9s_reads, uio);
+		/* Stop on error or end of file. */
+		if (error != 0 || uio->uio_resid == resid)
+			break;
+	}
+
+	P9FS_VOP_DONE(vp, np, error);
+	return (error);
 }
 
 static int
@@ -447,46 +826,43 @@ struct p9fs_readdir_state {
 	int *rd_eofp;
 };
 
+/*
+ * Directory entries are decoded straight out of the received chain, so a
+ * transfer is limited only as p9fs_client_read() limits it, by the
+ * negotiated msize and the directory's iounit.
+ */
+#define	P9FS_READDIR_MAX	(P9_MSG_MAX - P9_IOHDRSZ)
+
 static int
-p9fs_readdir_cb(void *mp, uint32_t count, size_t *offp, struct uio *arg)
+p9fs_readdir_cb(void **mpp, uint32_t count, size_t *offp, struct uio *arg)
 {
 	struct p9fs_readdir_state *rd = (struct p9fs_readdir_state *)arg;
 	struct vop_readdir_args *ap = rd->rd_ap;
-	struct p9fs_stat *p9stat;
+	struct p9fs_node *np = ap->a_vp->v_data;
+	struct p9fs_stat st, *p9stat = &st;
 	struct dirent entry;
 	struct p9fs_str *str;
-	struct p9fs_stat_u_payload upay;
-	int error;
+	int error = 0;
 	size_t end_off;
+	void *mp = *mpp;
 
 	if (count == 0) {
 		*rd->rd_eofp = 1;
 		return (EJUSTRETURN);
 	}
 
-	/*
-	 * If this is the first run, pop off the stat[n] total byte header.
-	 * XXX See comments in p9fs_client_stat() about compliance of this.
-	 */
-#if 0
-	if (ap->a_uio->uio_offset == 0) {
-		uint16_t *totsz;
-
-		p9fs_msg_get(mp, offp, (void *)&totsz, sizeof (*totsz));
-		printf("%s: got totsz %d\n", __func__, *totsz);
-	}
-#endif
-
 	/*
 	 * Parse p9fs_stat structures out of the message until there is no
 	 * space left in the message or until our client's uio runs out.
 	 */
-	end_off = count + sizeof (struct p9fs_msg_hdr);
-	printf("%s: got count %d off %zu end_off %zd uio off %ld\n",
+	end_off = *offp + count;
+	P9FS_DEBUG(np->p9n_session, 2,
+	    "%s: got count %d off %zu end_off %zd uio off %ld\n",
 	    __func__, count, *offp, end_off, ap->a_uio->uio_offset);
 	while (*offp < end_off && ap->a_uio->uio_resid > 0) {
-		p9fs_client_parse_u_stat(mp, &upay, offp);
-		p9stat = upay.upay_std.pay_stat;
+		error = p9fs_stat_parse(mp, offp, end_off, p9stat);
+		if (error != 0)
+			break;
 
 		entry.d_fileno = (uint32_t)(p9stat->stat_qid.qid_path >> 32);
 		entry.d_reclen = offsetof(struct dirent, d_name);
@@ -526,7 +902,7 @@ p9fs_readdir_cb(void *mp, uint32_t count, size_t *offp, struct uio *arg)
 		}
 
 		/* Copy the entry name, ensuring the entry will fit. */
-		str = &upay.upay_std.pay_name;
+		str = &p9stat->stat_name;
 		entry.d_namlen = str->p9str_size;
 		if (entry.d_namlen > MAXNAMLEN) {
 			error = ENAMETOOLONG;
@@ -537,7 +913,7 @@ p9fs_readdir_cb(void *mp, uint32_t count, size_t *offp, struct uio *arg)
 			error = EJUSTRETURN;
 			break;
 		}
-		bcopy(str->p9str_str, entry.d_name, entry.d_namlen);
+		p9fs_str_copy(str, entry.d_name, entry.d_namlen);
 		entry.d_name[entry.d_namlen] = '\0';
 
 		/* All good, now send it to the caller. */
@@ -553,9 +929,9 @@ p9fs_readdir_cb(void *mp, uint32_t count, size_t *offp, struct uio *arg)
 			    ("p9fs_readdir: cookies buffer too small"));
 			*rd->rd_cookies++ = ap->a_uio->uio_offset;
 		}
-		printf("%s loop iter end off %zu\n", __func__, *offp);
+		P9FS_DEBUG(np->p9n_session, 2, "%s: '%s' end off %zu\n",
+		    __func__, entry.d_name, *offp);
 	}
-	printf("%s end of loop\n", __func__);
 
 	return (error);
 }
@@ -576,6 +952,7 @@ p9fs_readdir(struct vop_readdir_args *ap)
 
 	if (ap->a_uio->uio_iov->iov_len <= 0)
 		return (EINVAL);
+	P9FS_VOP_START(ap->a_vp, np);
 
 	rd.rd_eofp = ap->a_eofflag != NULL ? ap->a_eofflag : &rd.rd_eof;
 	if (ap->a_ncookies != NULL) {
@@ -593,7 +970,8 @@ p9fs_readdir(struct vop_readdir_args *ap)
 	 * list completely fulfilled.  Set up the local uio before starting.
 	 * This local uio tracks the offset from the server's point of view.
 	 */
-	iov.iov_base = malloc(P9_MSG_MAX, M_TEMP, M_WAITOK);
+	/* Only the size of the transfer is used; nothing is copied to it. */
+	iov.iov_base = NULL;
 	rd.rd_uio.uio_iov = &iov;
 	rd.rd_uio.uio_segflg = UIO_SYSSPACE;
 	rd.rd_uio.uio_rw = UIO_READ;
@@ -604,7 +982,7 @@ p9fs_readdir(struct vop_readdir_args *ap)
 	for (;;) {
 		ssize_t resid = ap->a_uio->uio_resid;
 
-		rd.rd_uio.uio_resid = iov.iov_len = P9_MSG_MAX;
+		rd.rd_uio.uio_resid = iov.iov_len = P9FS_READDIR_MAX;
 		/*
 		 * XXX How to translate caller offset to internal offset?
 		 *     VOP_READDIR() will get called again until no more
@@ -622,7 +1000,7 @@ p9fs_readdir(struct vop_readdir_args *ap)
 		 */
 		rd.rd_uio.uio_offset = ap->a_uio->uio_offset;
 		error = p9fs_client_read(np->p9n_session, np->p9n_ofid,
-		    p9fs_readdir_cb, (struct uio *)&rd);
+		    np->p9n_iounit, p9fs_readdir_cb, (struct uio *)&rd);
 		/* Stop on error or if no more entries can be sent to caller. */
 		if (error != 0 || ap->a_uio->uio_resid < DIRENT_MIN_LEN ||
 		    ap->a_uio->uio_resid == resid)
@@ -646,9 +1024,10 @@ p9fs_readdir(struct vop_readdir_args *ap)
 		*ap->a_ncookies = 0;
 		*ap->a_cookies = NULL;
 	}
-	free(iov.iov_base, M_TEMP);
 
-	printf("%s(fid %d) ret %d\n", __func__, np->p9n_ofid, error);
+	P9FS_DEBUG(np->p9n_session, 1, "%s(fid %d) ret %d\n", __func__,
+	    np->p9n_ofid, error);
+	P9FS_VOP_DONE(ap->a_vp, np, error);
 	return (error);
 }
 
@@ -670,6 +1049,13 @@ p9fs_reclaim(struct vop_reclaim_args *ap)
 	struct p9fs_node *np = ap->a_vp->v_data;
 	int error;
 
+	P9FS_VOP_START(ap->a_vp, np);
+
+	if (np->p9n_ahead != NULL) {
+		p9fs_ahead_free(np->p9n_session, np->p9n_ahead);
+		np->p9n_ahead = NULL;
+	}
+
 	/* Remove the p9fs_node from visibility. */
 	vnode_destroy_vobject(ap->a_vp);
 	vfs_hash_remove(ap->a_vp);
@@ -682,7 +1068,9 @@ p9fs_reclaim(struct vop_reclaim_args *ap)
 		/* Failure should never happen here! */
 		printf("%s(%d): error %d\n", __func__, np->p9n_fid, error);
 	}
-	printf("%s(fid %d ofid %d)\n", __func__, np->p9n_fid, np->p9n_ofid);
+	P9FS_DEBUG(np->p9n_session, 1, "%s(fid %d ofid %d)\n", __func__,
+	    np->p9n_fid, np->p9n_ofid);
+	P9FS_VOP_DONE(ap->a_vp, np, error);
 
 	if (np->p9n_ofid != 0)
 		p9fs_relfid(np->p9n_session, np->p9n_ofid);
@@ -0,0 +1,299 @@
+/*-
+ * Copyright (c) 2015 Will Andrews.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Plan9 message layer microbenchmark.
+ *
+ * For each message type, a sample message is filled in from its field list
+ * and timed through both halves of the message layer:
+ *   encode	p9fs_msg_build(), plus p9fs_msg_add() of any data, and free
+ *   decode	p9fs_msg_parse() of the message as it would arrive from a
+ *		socket, in segments, and free
+ * Results are in nanoseconds and mbuf allocations per message.
+ */
+
+#include <err.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "p9fs_user.h"
+#include "p9fs_proto.h"
+#include "p9fs_subr.h"
+
+/* Messages decoded per timed batch; each needs a fresh received chain. */
+#define	BENCH_BATCH	1024
+
+struct bench {
+	uint32_t b_datalen;	/* Data bytes attached, if the type has any. */
+	int b_hasdata;
+	int b_seglen;		/* Received segment size. */
+	char *b_data;
+};
+
+static char *bench_names[] = { "p9fs", "bench", "a", "longer-path-element" };
+
+static void
+bench_fill_u8(struct bench *b __unused, uint8_t *v)
+{
+
+	*v = 0x5a;
+}
+
+static void
+bench_fill_u16(struct bench *b __unused, uint16_t *v)
+{
+
+	*v = 0x1234;
+}
+
+static void
+bench_fill_u32(struct bench *b __unused, uint32_t *v)
+{
+
+	*v = 0x12345678;
+}
+
+static void
+bench_fill_u64(struct bench *b __unused, uint64_t *v)
+{
+
+	*v = 0x123456789abcdefULL;
+}
+
+static void
+bench_fill_str(struct bench *b __unused, struct p9fs_str *v)
+{
+
+	v->p9str_str = "p9fs-bench";
+	v->p9str_size = strlen(v->p9str_str);
+}
+
+static void
+bench_fill_qid(struct bench *b, struct p9fs_qid *f)
+{
+
+#define	BENCH_FILL(P, kind, name)	bench_fill_##kind(b, &f->P##_##name);
+	P9FS_QID_FIELDS(BENCH_FILL, qid)
+}
+
+static void
+bench_fill_stat(struct bench *b, struct p9fs_stat *f)
+{
+
+	P9FS_STAT_FIELDS(BENCH_FILL, stat)
+}
+
+static void
+bench_fill_wnames(struct bench *b __unused, struct p9fs_wnames *v)
+{
+	int i;
+
+	v->wn_nwname = nitems(bench_names);
+	for (i = 0; i < v->wn_nwname; i++) {
+		v->wn_wname[i].p9str_str = bench_names[i];
+		v->wn_wname[i].p9str_size = strlen(bench_names[i]);
+	}
+}
+
+static void
+bench_fill_wqids(struct bench *b, struct p9fs_wqids *v)
+{
+	int i;
+
+	v->wq_nwqid = nitems(bench_names);
+	for (i = 0; i < v->wq_nwqid; i++)
+		bench_fill_qid(b, &v->wq_qid[i]);
+}
+
+static void
+bench_fill_data(struct bench *b, struct p9fs_data *v)
+{
+
+	v->pd_count = b->b_datalen;
+	b->b_hasdata = 1;
+}
+
+/* Fill in a sample message of the given type; returns its data length. */
+static uint32_t
+bench_fill(struct bench *b, enum p9fs_msg_type type, union p9fs_msg *msg)
+{
+
+	b->b_hasdata = 0;
+	switch (type) {
+#define	BENCH_CASE(T)							\
+	case T: {							\
+		struct p9fs_msg_##T *f = &msg->p9msg_##T;		\
+									\
+		(void)f;						\
+		P9FS_MSG_##T(BENCH_FILL, T)				\
+		break;							\
+	}
+	P9FS_MSGS(BENCH_CASE)
+	default:
+		break;
+	}
+	return (b->b_hasdata ? b->b_datalen : 0);
+}
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static struct mbuf *
+bench_encode(struct bench *b, enum p9fs_msg_type type,
+    const union p9fs_msg *msg, uint32_t datalen)
+{
+	struct mbuf *m;
+	uint32_t size;
+
+	m = p9fs_msg_build(type, 1, msg);
+	if (m == NULL)
+		errx(1, "%s: p9fs_msg_build failed", p9fs_msg_name(type));
+	if (datalen > 0)
+		p9fs_msg_add(m, datalen, b->b_data);
+	size = m->m_pkthdr.len;
+	le32enc(mtod(m, void *), size);
+	return (m);
+}
+
+static void
+bench_decode(enum p9fs_msg_type type, struct mbuf *m)
+{
+	union p9fs_msg msg;
+	int error;
+
+	error = p9fs_msg_parse(m, type, &msg);
+	if (error != 0)
+		errx(1, "%s: decode failed: %d", p9fs_msg_name(type), error);
+	m_freem(m);
+}
+
+static void
+bench_type(struct bench *b, enum p9fs_msg_type type, u_long iters)
+{
+	static struct mbuf *batch[BENCH_BATCH];
+	static char wire[MJUM16BYTES * 2];
+	union p9fs_msg msg;
+	struct mbuf *m;
+	uint64_t enc_ns, dec_ns, start;
+	u_long enc_allocs, dec_allocs, i, j, n;
+	uint32_t datalen;
+	int size;
+
+	memset(&msg, 0, sizeof (msg));
+	datalen = bench_fill(b, type, &msg);
+
+	/* The message as it goes on the wire, to be received in segments. */
+	m = bench_encode(b, type, &msg, datalen);
+	size = m->m_pkthdr.len;
+	if (size > (int)sizeof (wire))
+		errx(1, "%s: %d byte message too large", p9fs_msg_name(type),
+		    size);
+	m_copydata(m, 0, size, wire);
+	m_freem(m);
+
+	enc_allocs = p9fs_user_allocs;
+	start = bench_now();
+	for (i = 0; i < iters; i++)
+		m_freem(bench_encode(b, type, &msg, datalen));
+	enc_ns = bench_now() - start;
+	enc_allocs = p9fs_user_allocs - enc_allocs;
+
+	dec_ns = dec_allocs = 0;
+	for (i = 0; i < iters; i += n) {
+		n = MIN(iters - i, BENCH_BATCH);
+		for (j = 0; j < n; j++)
+			batch[j] = p9fs_user_chain(wire, size, b->b_seglen);
+		dec_allocs -= p9fs_user_allocs;
+		start = bench_now();
+		for (j = 0; j < n; j++)
+			bench_decode(type, batch[j]);
+		dec_ns += bench_now() - start;
+		dec_allocs += p9fs_user_allocs;
+	}
+	if (p9fs_user_live != 0)
+		errx(1, "%s: %lu mbufs leaked", p9fs_msg_name(type),
+		    p9fs_user_live);
+
+	printf("%-9s %6d %9.1f %7.2f %9.1f %7.2f\n", p9fs_msg_name(type),
+	    size, (double)enc_ns / iters, (double)enc_allocs / iters,
+	    (double)dec_ns / iters, (double)dec_allocs / iters);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr,
+	    "usage: p9fs_msgbench [-d datalen] [-n iterations] [-s seglen]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const enum p9fs_msg_type types[] = {
+#define	BENCH_TYPE(T)	T,
+		P9FS_MSGS(BENCH_TYPE)
+	};
+	struct bench b;
+	u_long iters = 100000;
+	u_int i;
+	int ch;
+
+	b.b_datalen = 8192;
+	b.b_seglen = MCLBYTES;
+	while ((ch = getopt(argc, argv, "d:n:s:")) != -1) {
+		switch (ch) {
+		case 'd':
+			b.b_datalen = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			iters = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			b.b_seglen = strtol(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (iters == 0 || b.b_seglen <= 0 || b.b_datalen > MJUM16BYTES)
+		usage();
+	if ((b.b_data = calloc(1, b.b_datalen + 1)) == NULL)
+		err(1, "calloc");
+
+	printf("%-9s %6s %9s %7s %9s %7s\n", "type", "bytes", "enc ns",
+	    "allocs", "dec ns", "allocs");
+	for (i = 0; i < nitems(types); i++)
+		bench_type(&b, types[i], iters);
+	return (0);
+}
@@ -0,0 +1,152 @@
+/*-
+ * Copyright (c) 2015 Will Andrews.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Plan9 message receive path fuzzer, in the libFuzzer style.
+ *
+ * The first input byte picks the size of the segments the message arrives
+ * in; the rest is the message, framed by its size field as the socket
+ * transport frames it.  Each message goes through p9fs_msg_parse(), and
+ * Rread data through p9fs_stat_parse() as readdir would.  Anything that
+ * parses must encode back to the same bytes, and no mbuf may be leaked.
+ *
+ * Built with P9FS_FUZZ_REPLAY, this has its own main() that runs each file
+ * named on the command line once, e.g. to replay a crash without libFuzzer.
+ */
+
+#include "p9fs_user.h"
+#include "p9fs_proto.h"
+#include "p9fs_subr.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *, size_t);
+
+/* Walk Rread data as a directory's stat entries. */
+static void
+fuzz_readdir(struct mbuf *m, const struct p9fs_data *data)
+{
+	struct p9fs_stat st;
+	size_t off, end;
+
+	off = data->pd_off;
+	end = off + data->pd_count;
+	while (off < end && p9fs_stat_parse(m, &off, end, &st) == 0)
+		continue;
+}
+
+/*
+ * Messages whose encoding is not unique: data is attached separately, and
+ * stat entries may carry fields past the known ones, which are skipped.
+ */
+static int
+fuzz_reencodes(enum p9fs_msg_type type)
+{
+
+	switch (type) {
+	case Rread:
+	case Twrite:
+	case Rstat:
+	case Twstat:
+		return (0);
+	default:
+		return (1);
+	}
+}
+
+static void
+fuzz_reencode(struct mbuf *m, const struct p9fs_msg_hdr *hdr,
+    const union p9fs_msg *msg)
+{
+	static char buf[MJUM16BYTES];
+	struct mbuf *n;
+	int len;
+
+	n = p9fs_msg_build(hdr->hdr_type, hdr->hdr_tag, msg);
+	if (n == NULL)
+		return;
+	len = n->m_pkthdr.len;
+	KASSERT(len <= (int)hdr->hdr_size && n->m_next == NULL,
+	    ("%s: re-encoded to %d of %u bytes", p9fs_msg_name(hdr->hdr_type),
+	    len, hdr->hdr_size));
+	m_copydata(m, 0, len, buf);
+	KASSERT(memcmp(buf + sizeof (uint32_t),
+	    mtod(n, char *) + sizeof (uint32_t), len - sizeof (uint32_t)) == 0,
+	    ("%s: re-encoded differently", p9fs_msg_name(hdr->hdr_type)));
+	m_freem(n);
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *buf, size_t len)
+{
+	struct p9fs_msg_hdr hdr;
+	union p9fs_msg msg;
+	struct mbuf *m;
+	int seglen;
+
+	if (len < 1 + P9_HDRSZ || len > 1 + MJUM16BYTES)
+		return (0);
+	seglen = buf[0] + 1;
+	buf++;
+	len--;
+
+	m = p9fs_user_chain(buf, len, seglen);
+	p9fs_msg_hdr(m, &hdr);
+	if (hdr.hdr_size < P9_HDRSZ || hdr.hdr_size != len) {
+		m_freem(m);
+		return (0);
+	}
+
+	if (p9fs_msg_parse(m, hdr.hdr_type, &msg) == 0) {
+		if (hdr.hdr_type == Rread)
+			fuzz_readdir(m, &msg.p9msg_Rread.Rread_data);
+		else if (fuzz_reencodes(hdr.hdr_type))
+			fuzz_reencode(m, &hdr, &msg);
+	}
+	m_freem(m);
+	KASSERT(p9fs_user_live == 0, ("%lu mbufs leaked", p9fs_user_live));
+	return (0);
+}
+
+#ifdef P9FS_FUZZ_REPLAY
+int
+main(int argc, char **argv)
+{
+	static uint8_t buf[1 + MJUM16BYTES];
+	FILE *fp;
+	size_t len;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if ((fp = fopen(argv[i], "r")) == NULL) {
+			perror(argv[i]);
+			return (1);
+		}
+		len = fread(buf, 1, sizeof (buf), fp);
+		fclose(fp);
+		LLVMFuzzerTestOneInput(buf, len);
+	}
+	return (0);
+}
+#endif
@@ -0,0 +1,150 @@
+/*-
+ * Copyright (c) 2015 Will Andrews.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Userland stand-ins for the kernel interfaces the p9fs message layer
+ * (p9fs.ko/p9fs_codec.c) uses: a minimal mbuf allocator and a few macros.
+ *
+ * The mbufs keep the kernel's size classes and allocation rules, e.g.
+ * m_get2() gives up past a page, so that the allocation counts and failure
+ * paths seen here match the kernel's.
+ */
+
+#ifndef	__P9FS_USER_H__
+#define	__P9FS_USER_H__
+
+#include <sys/types.h>
+#include <sys/param.h>
+#ifdef __FreeBSD__
+#include <sys/endian.h>
+#else
+#include <endian.h>
+#endif
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#ifndef __unused
+#define	__unused	__attribute__((__unused__))
+#endif
+#ifndef __DECONST
+#define	__DECONST(type, var)	((type)(uintptr_t)(const void *)(var))
+#endif
+#ifndef nitems
+#define	nitems(x)	(sizeof ((x)) / sizeof ((x)[0]))
+#endif
+
+#define	KASSERT(exp, msg) do {						\
+	if (!(exp)) {							\
+		printf msg;						\
+		printf("\n");						\
+		abort();						\
+	}								\
+} while (0)
+
+#ifndef __FreeBSD__
+#define	P9FS_USER_LE(bits)						\
+static __inline void							\
+le##bits##enc(void *pp, uint##bits##_t v)				\
+{									\
+									\
+	v = htole##bits(v);						\
+	memcpy(pp, &v, sizeof (v));					\
+}									\
+									\
+static __inline uint##bits##_t						\
+le##bits##dec(const void *pp)						\
+{									\
+	uint##bits##_t v;						\
+									\
+	memcpy(&v, pp, sizeof (v));					\
+	return (le##bits##toh(v));					\
+}
+P9FS_USER_LE(16)
+P9FS_USER_LE(32)
+P9FS_USER_LE(64)
+#undef	P9FS_USER_LE
+#endif
+
+/* mbuf and cluster sizes, as on amd64. */
+#define	MLEN		224
+#define	MHLEN		168
+#ifndef MCLBYTES
+#define	MCLBYTES	2048
+#endif
+#ifndef MJUMPAGESIZE
+#define	MJUMPAGESIZE	4096
+#endif
+#ifndef MJUM9BYTES
+#define	MJUM9BYTES	(9 * 1024)
+#endif
+#ifndef MJUM16BYTES
+#define	MJUM16BYTES	(16 * 1024)
+#endif
+
+#define	M_NOWAIT	0x0001
+#define	M_WAITOK	0x0002
+#define	MT_DATA		1
+#define	M_PKTHDR	0x00000002
+
+struct pkthdr {
+	int len;
+};
+
+struct mbuf {
+	struct mbuf *m_next;
+	caddr_t m_data;
+	int m_len;
+	int m_flags;
+	struct pkthdr m_pkthdr;
+	int m_size;		/* Bytes of storage at m_buf. */
+	char m_buf[];
+};
+
+#define	mtod(m, t)	((t)((m)->m_data))
+#define	M_TRAILINGSPACE(m)						\
+	((int)((m)->m_buf + (m)->m_size - ((m)->m_data + (m)->m_len)))
+
+struct mbuf *m_get2(int, int, short, int);
+struct mbuf *m_getjcl(int, short, int, int);
+struct mbuf *m_gethdr(int, short);
+struct mbuf *m_getm2(struct mbuf *, int, int, short, int);
+void m_freem(struct mbuf *);
+struct mbuf *m_last(struct mbuf *);
+u_int m_length(struct mbuf *, struct mbuf **);
+void m_copydata(const struct mbuf *, int, int, caddr_t);
+
+/* Allocation counts, for the benchmark and for leak checks. */
+extern u_long p9fs_user_allocs;
+extern u_long p9fs_user_live;
+
+/* Build a chain holding len bytes from buf, in segments of seglen. */
+struct mbuf *p9fs_user_chain(const void *, int, int);
+
+#endif /* __P9FS_USER_H__ */
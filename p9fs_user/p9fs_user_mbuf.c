@@ -0,0 +1,193 @@
+/*-
+ * Copyright (c) 2015 Will Andrews.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Userland mbufs, just enough of them for the p9fs message layer.  Each
+ * mbuf and its storage are one malloc(3), which is counted.
+ */
+
+#include "p9fs_user.h"
+
+u_long p9fs_user_allocs;
+u_long p9fs_user_live;
+
+static struct mbuf *
+m_alloc(int size, int flags)
+{
+	struct mbuf *m;
+
+	m = malloc(sizeof (*m) + size);
+	if (m == NULL)
+		abort();
+	m->m_next = NULL;
+	m->m_data = m->m_buf;
+	m->m_len = 0;
+	m->m_flags = flags & M_PKTHDR;
+	m->m_pkthdr.len = 0;
+	m->m_size = size;
+	p9fs_user_allocs++;
+	p9fs_user_live++;
+	return (m);
+}
+
+struct mbuf *
+m_get2(int size, int how __unused, short type __unused, int flags)
+{
+
+	if (size <= MHLEN || (size <= MLEN && (flags & M_PKTHDR) == 0))
+		return (m_alloc((flags & M_PKTHDR) ? MHLEN : MLEN, flags));
+	if (size <= MCLBYTES)
+		return (m_alloc(MCLBYTES, flags));
+	if (size > MJUMPAGESIZE)
+		return (NULL);
+	return (m_alloc(MJUMPAGESIZE, flags));
+}
+
+struct mbuf *
+m_getjcl(int how __unused, short type __unused, int flags, int size)
+{
+
+	return (m_alloc(size, flags));
+}
+
+struct mbuf *
+m_gethdr(int how __unused, short type __unused)
+{
+
+	return (m_alloc(MHLEN, M_PKTHDR));
+}
+
+/* Allocate a chain with room for len bytes, appended to m if given. */
+struct mbuf *
+m_getm2(struct mbuf *m, int len, int how, short type, int flags)
+{
+	struct mbuf *mb, *nm = NULL, *mtail = NULL;
+
+	while (len > 0) {
+		if (len > MCLBYTES)
+			mb = m_getjcl(how, type, flags, MJUMPAGESIZE);
+		else
+			mb = m_get2(len, how, type, flags);
+		len -= mb->m_size;
+		flags &= ~M_PKTHDR;
+		if (mtail != NULL)
+			mtail->m_next = mb;
+		else
+			nm = mb;
+		mtail = mb;
+	}
+	if (m != NULL) {
+		m_last(m)->m_next = nm;
+		return (m);
+	}
+	return (nm);
+}
+
+void
+m_freem(struct mbuf *m)
+{
+	struct mbuf *n;
+
+	for (; m != NULL; m = n) {
+		n = m->m_next;
+		free(m);
+		p9fs_user_live--;
+	}
+}
+
+struct mbuf *
+m_last(struct mbuf *m)
+{
+
+	while (m->m_next != NULL)
+		m = m->m_next;
+	return (m);
+}
+
+u_int
+m_length(struct mbuf *m0, struct mbuf **last)
+{
+	struct mbuf *m;
+	u_int len = 0;
+
+	for (m = m0; m != NULL; m = m->m_next) {
+		len += m->m_len;
+		if (m->m_next == NULL)
+			break;
+	}
+	if (last != NULL)
+		*last = m;
+	return (len);
+}
+
+void
+m_copydata(const struct mbuf *m, int off, int len, caddr_t cp)
+{
+	u_int count;
+
+	KASSERT(off >= 0 && len >= 0, ("m_copydata: off %d len %d", off,
+	    len));
+	while (off > 0) {
+		KASSERT(m != NULL, ("m_copydata: offset past chain"));
+		if (off < m->m_len)
+			break;
+		off -= m->m_len;
+		m = m->m_next;
+	}
+	while (len > 0) {
+		KASSERT(m != NULL, ("m_copydata: length past chain"));
+		count = MIN(m->m_len - off, len);
+		bcopy(mtod(m, caddr_t) + off, cp, count);
+		len -= count;
+		cp += count;
+		off = 0;
+		m = m->m_next;
+	}
+}
+
+struct mbuf *
+p9fs_user_chain(const void *buf, int len, int seglen)
+{
+	struct mbuf *m, *n;
+	const char *cp = buf;
+	int count;
+
+	m = n = m_gethdr(M_WAITOK, MT_DATA);
+	m->m_pkthdr.len = len;
+	for (;;) {
+		count = MIN(len, MIN(seglen, M_TRAILINGSPACE(n)));
+		bcopy(cp, mtod(n, char *), count);
+		n->m_len = count;
+		cp += count;
+		len -= count;
+		if (len == 0)
+			break;
+		n->m_next = m_get2(MIN(len, MIN(seglen, MJUMPAGESIZE)),
+		    M_WAITOK, MT_DATA, 0);
+		n = n->m_next;
+	}
+	return (m);
+}
@@ -0,0 +1,289 @@
+/*-
+ * Copyright (c) 2015 Will Andrews.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE NETBSD FOUNDATION, INC. AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE FOUNDATION OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Plan9 filesystem statistics, after nfsstat(1).
+ *
+ * Reads each p9fs mount's vfs.p9fs.<unit>.stats and shows, for each
+ * message type, the requests sent, errors, bytes each way and latency.
+ * With -w, it shows the change over each interval instead.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include <sys/param.h>
+#include <sys/mount.h>
+#include <sys/sysctl.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "p9fs_stats.h"
+
+/* How far to look for the units of the mounts getmntinfo(3) reports. */
+#define	P9FSSTAT_MAXUNIT	4096
+
+struct p9mount {
+	char pm_mntonname[MNAMELEN];
+	int pm_unit;
+	struct p9fs_stats pm_stats;	/* As of the last interval. */
+};
+
+static const char *p9fsstat_names[P9FS_STATS_TYPES] = P9FS_STATS_NAMES;
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: p9fsstat [-l] [-m mountpoint] [-w wait]\n");
+	exit(1);
+}
+
+/*
+ * Find the p9fs mounts, or just the one on mntonname, and the units of
+ * their sysctl trees.  Returns how many were found.
+ */
+static int
+p9fsstat_mounts(const char *mntonname, struct p9mount **pmp)
+{
+	struct statfs *sfs;
+	struct p9mount *pm;
+	char name[64], path[MNAMELEN];
+	size_t len;
+	int i, n, nmounts, found, unit;
+
+	if ((nmounts = getmntinfo(&sfs, MNT_NOWAIT)) == 0)
+		err(1, "getmntinfo");
+	if ((pm = calloc(nmounts, sizeof (*pm))) == NULL)
+		err(1, "calloc");
+	for (i = n = 0; i < nmounts; i++) {
+		if (strcmp(sfs[i].f_fstypename, "p9fs") != 0)
+			continue;
+		if (mntonname != NULL &&
+		    strcmp(sfs[i].f_mntonname, mntonname) != 0)
+			continue;
+		strlcpy(pm[n].pm_mntonname, sfs[i].f_mntonname,
+		    sizeof (pm[n].pm_mntonname));
+		pm[n++].pm_unit = -1;
+	}
+
+	/* Units are allocated lowest first, so they are never far apart. */
+	for (unit = found = 0; unit < P9FSSTAT_MAXUNIT && found < n; unit++) {
+		snprintf(name, sizeof (name), "vfs.p9fs.%d.mntonname", unit);
+		len = sizeof (path);
+		if (sysctlbyname(name, path, &len, NULL, 0) != 0)
+			continue;
+		for (i = 0; i < n; i++) {
+			if (pm[i].pm_unit == -1 &&
+			    strcmp(pm[i].pm_mntonname, path) == 0) {
+				pm[i].pm_unit = unit;
+				found++;
+				break;
+			}
+		}
+	}
+
+	*pmp = pm;
+	return (n);
+}
+
+static int
+p9fsstat_fetch(struct p9mount *pm, struct p9fs_stats *ps)
+{
+	char name[64];
+	size_t len;
+
+	snprintf(name, sizeof (name), "vfs.p9fs.%d.stats", pm->pm_unit);
+	len = sizeof (*ps);
+	if (sysctlbyname(name, ps, &len, NULL, 0) != 0) {
+		warn("%s", name);
+		return (-1);
+	}
+	if (len != sizeof (*ps) || ps->ps_version != P9FS_STATS_VERSION) {
+		warnx("%s: version mismatch with the kernel", name);
+		return (-1);
+	}
+	return (0);
+}
+
+/* Subtract old from the running totals in new, leaving the gauges. */
+static void
+p9fsstat_delta(struct p9fs_stats *new, const struct p9fs_stats *old)
+{
+	uint64_t *np;
+	const uint64_t *op;
+	size_t i, j;
+
+	new->ps_timeouts -= old->ps_timeouts;
+	for (i = 0; i < P9FS_STATS_TYPES; i++) {
+		np = (uint64_t *)&new->ps_ops[i];
+		op = (const uint64_t *)&old->ps_ops[i];
+		for (j = 0; j < sizeof (new->ps_ops[i]) / sizeof (*np); j++)
+			np[j] -= op[j];
+	}
+}
+
+/*
+ * Return the latency, in microseconds, under which the fraction q of the
+ * requests completed, rounded up to the bucket's upper bound.
+ */
+static uint64_t
+p9fsstat_quantile(const struct p9fs_stats_op *so, double q)
+{
+	uint64_t total, want, sum;
+	int i;
+
+	for (i = 0, total = 0; i < P9FS_STATS_BUCKETS; i++)
+		total += so->so_lat[i];
+	if (total == 0)
+		return (0);
+	want = (uint64_t)(q * total + 0.5);
+	if (want == 0)
+		want = 1;
+	for (i = 0, sum = 0; i < P9FS_STATS_BUCKETS - 1; i++) {
+		sum += so->so_lat[i];
+		if (sum >= want)
+			break;
+	}
+	return ((uint64_t)1 << i);
+}
+
+/* Print the non-empty buckets of a latency histogram. */
+static void
+p9fsstat_hist(const struct p9fs_stats_op *so)
+{
+	char range[32];
+	int i;
+
+	for (i = 0; i < P9FS_STATS_BUCKETS; i++) {
+		if (so->so_lat[i] == 0)
+			continue;
+		if (i == 0)
+			snprintf(range, sizeof (range), "< 1");
+		else if (i == P9FS_STATS_BUCKETS - 1)
+			snprintf(range, sizeof (range), ">= %ju",
+			    (uintmax_t)1 << (i - 1));
+		else
+			snprintf(range, sizeof (range), "%ju - %ju",
+			    (uintmax_t)1 << (i - 1), ((uintmax_t)1 << i) - 1);
+		printf("%8s %21s us %8ju\n", "", range,
+		    (uintmax_t)so->so_lat[i]);
+	}
+}
+
+static void
+p9fsstat_print(const struct p9mount *pm, const struct p9fs_stats *ps,
+    int hist)
+{
+	const struct p9fs_stats_op *so;
+	int i;
+
+	printf("%s: %u in flight (max %u), %u tags (max %u), %ju fids, "
+	    "%ju timeouts\n", pm->pm_mntonname, ps->ps_inflight,
+	    ps->ps_inflight_max, ps->ps_tags_inuse, ps->ps_tags_max,
+	    (uintmax_t)ps->ps_fids_inuse, (uintmax_t)ps->ps_timeouts);
+	printf("%-8s %12s %8s %10s %10s %8s %8s %8s\n", "type", "requests",
+	    "errors", "KB out", "KB in", "avg us", "p50 us", "p99 us");
+	for (i = 0; i < P9FS_STATS_TYPES; i++) {
+		so = &ps->ps_ops[i];
+		if (so->so_requests == 0)
+			continue;
+		printf("%-8s %12ju %8ju %10ju %10ju %8ju %8ju %8ju\n",
+		    p9fsstat_names[i], (uintmax_t)so->so_requests,
+		    (uintmax_t)so->so_errors,
+		    (uintmax_t)so->so_bytes_out / 1024,
+		    (uintmax_t)so->so_bytes_in / 1024,
+		    (uintmax_t)(so->so_time_us / so->so_requests),
+		    (uintmax_t)p9fsstat_quantile(so, 0.5),
+		    (uintmax_t)p9fsstat_quantile(so, 0.99));
+		if (hist)
+			p9fsstat_hist(so);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	struct p9mount *pms, *pm;
+	struct p9fs_stats ps, cur;
+	struct statfs sfs;
+	const char *mntonname = NULL;
+	int ch, hist = 0, i, n, wait = 0;
+
+	while ((ch = getopt(argc, argv, "lm:w:")) != -1) {
+		switch (ch) {
+		case 'l':
+			hist = 1;
+			break;
+		case 'm':
+			if (statfs(optarg, &sfs) != 0)
+				err(1, "%s", optarg);
+			if (strcmp(sfs.f_fstypename, "p9fs") != 0)
+				errx(1, "%s: not a p9fs mount", optarg);
+			mntonname = strdup(sfs.f_mntonname);
+			break;
+		case 'w':
+			wait = atoi(optarg);
+			if (wait <= 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc != optind)
+		usage();
+
+	n = p9fsstat_mounts(mntonname, &pms);
+	if (n == 0)
+		errx(1, "no p9fs mounts");
+
+	/* The totals since mounting, then the changes over each interval. */
+	for (;;) {
+		for (i = 0; i < n; i++) {
+			pm = &pms[i];
+			if (pm->pm_unit == -1 || p9fsstat_fetch(pm, &cur) != 0)
+				continue;
+			ps = cur;
+			if (pm->pm_stats.ps_version != 0)
+				p9fsstat_delta(&ps, &pm->pm_stats);
+			pm->pm_stats = cur;
+			p9fsstat_print(pm, &ps, hist);
+		}
+		if (wait == 0)
+			break;
+		fflush(stdout);
+		sleep(wait);
+		printf("\n");
+	}
+	return (0);
+}